@@ -15,7 +15,19 @@
  *     of a drive is being used.
  */
 
+#define _GNU_SOURCE
 #include "bc_file_system.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
 
 /** 
  * ======================================================================== 
@@ -31,44 +43,391 @@
  * not be used. If the given virtual drive has not been 
  * previously initialized, the virtual drive will be
  * initialized and use the given virtual drive label.
- * 
+ *
+ * The drive flags select how the virtual drive is accessed. With
+ * DRIVE_MODE_STDIO every access is a pread or pwrite on the drive 
+ * file. With DRIVE_MODE_MMAP the whole drive is 
+ * mapped into memory and clusters are addressed directly as pointers 
+ * into the mapping. If the drive cannot be mapped, the file system
+ * falls back to DRIVE_MODE_STDIO. The drive mode may be combined 
+ * with the following flags:
+ *
+ *   - DRIVE_DIR_INDEX: keep an in-memory hash index of each directory
+ *                      which has been searched, so that names are 
+ *                      located without scanning the directory
+ *
+ *   - DRIVE_LARGE_FILES: lift the FILE_SIZE_MAX limit on the size of a
+ *                        file, so a file may grow to fill the drive.
+ *                        Sizes past 32 bits are held in version 2 
+ *                        directory entries (see getDirEntrySize())
+ *
+ *   - DRIVE_LAZY_ZERO: do not zero the clusters of a deleted file 
+ *                      straight away, see reclaimClusters()
+ *
+ *   - DRIVE_BACKGROUND_RECLAIM: as DRIVE_LAZY_ZERO, and also run a 
+ *                               thread which zeroes the clusters of 
+ *                               deleted files while the file system is
+ *                               in use, see startReclaimer()
+ *
+ *   - DRIVE_SYNC_METADATA: write the size and modified date of a file
+ *                          to its directory entry on every write. 
+ *                          Without this flag they are held in the 
+ *                          open BC_FILE and written when the file is
+ *                          closed, the file system is synced or the
+ *                          metadata interval has passed
+ *
+ *   - DRIVE_ASYNC_IO: transfer the data of each file read or write as
+ *                     one batch of drive requests through the async 
+ *                     I/O engine (see the Async I/O section), and let
+ *                     readFileAsync() and writeFileAsync() return 
+ *                     before their data has been transferred. Only
+ *                     used in DRIVE_MODE_STDIO with a cache size of 0
+ *
+ * In DRIVE_MODE_STDIO, accesses are served from a cache holding up 
+ * to cacheSlots clusters of the drive. A cache size of 0 disables 
+ * the cache. The cache is not used in DRIVE_MODE_MMAP.
+ *
+ * Like the label, the cluster size is only used when the drive is 
+ * initialized. It must be a power of two from CLUSTER_SIZE_MIN to 
+ * CLUSTER_SIZE_MAX bytes.
+ *
+ * Each call mounts a drive independently of any others, so several
+ * drives may be mounted at once. All other operations take the 
+ * returned handle, or a BC_FILE opened through it.
  *
  * @param virDriveName  The file name of the virtual drive
  * @param virDriveLabel The label to give the virtual drive
+ * @param driveFlags    DRIVE_MODE_STDIO or DRIVE_MODE_MMAP, optionally
+ *                      combined with the flags listed above
+ * @param cacheSlots    The number of clusters to cache
+ * @param clusterSize   The number of bytes per cluster to give the
+ *                      virtual drive (0 for CLUSTER_SIZE)
+ * @return              A pointer to the file system, or NULL if the 
+ *                      virtual drive could not be opened or formatted
  */
-void initFileSystem(char *virDriveName, char *virDriveLabel)
+BC_FS *initFileSystem(char *virDriveName, char *virDriveLabel, int driveFlags, u_int cacheSlots, u_int clusterSize)
 {
-	virDrive = openVirDrive(virDriveName);
+	BC_FS *fs = calloc(1, sizeof(BC_FS));
+	fs->virDrive = openVirDrive(virDriveName);
+	if(!fs->virDrive)
+	{
+		free(fs);
+		return NULL;
+	}
+	initLocks(fs);
+
+	fs->dirIndexEnabled = driveFlags & DRIVE_DIR_INDEX;
+	if(fs->dirIndexEnabled)
+	{
+		/* The search counters are cache line aligned, so searches from
+		   different threads do not write to the same line */
+		fs->snapshotReaders = aligned_alloc(64, DIR_SNAPSHOT_SLOTS * sizeof(SnapshotReader));
+		memset(fs->snapshotReaders, 0, DIR_SNAPSHOT_SLOTS * sizeof(SnapshotReader));
+	}
+	fs->metaStrict = driveFlags & DRIVE_SYNC_METADATA;
+	fs->largeFiles = driveFlags & DRIVE_LARGE_FILES;
+	fs->lazyZero = driveFlags & (DRIVE_LAZY_ZERO | DRIVE_BACKGROUND_RECLAIM);
+	fs->metaSyncInterval = 0;
+	fs->virDriveMode = DRIVE_MODE_STDIO;
+	if((driveFlags & DRIVE_MODE_MMAP) && !mapVirDrive(fs))
+		fprintf(stderr, "Could not map virtual drive, using stdio mode\n");
 
 	/* Check if the drive has previously been initialized */
-	rewind(virDrive);
-	char init = getc(virDrive);
+	char init;
+	readVirDrive(fs, &init, 0, 1);
 	if(init)
 	{
 		fprintf(stdout, "\nVirtual drive has previously been initialized.\n");
 		fprintf(stdout, "Loading virtual drive properties.\n");
-		bootRecord = calloc(1, sizeof(*bootRecord));
-		readBootRecord();
-		fileAllocTable = (u_int*) calloc(sizeof(u_int), bootRecord->clustersOnDrive);
-		readFAT();
+		fs->bootRecord = calloc(1, sizeof(*fs->bootRecord));
+		readBootRecord(fs);
+		initClusterCache(fs, cacheSlots);
+		fs->fileAllocTable = (u_int*) calloc(sizeof(u_int), fs->bootRecord->clustersOnDrive);
+		readFAT(fs);
 	}
 	else
 	{
 		fprintf(stdout, "\nVirtual drive has not previously been initialized.\n");
 		fprintf(stdout, "Initializing virtual drive properties.\n");
-		formatVirDrive();
-		bootRecord = initBootRecord(virDriveLabel);
-		writeBootRecord();
-		fileAllocTable = initFATClusters();
-		writeFAT();
+		if(formatVirDrive(fs) != 0)
+		{
+			/* Stale tables of an old image would be left on the drive */
+			unmapVirDrive(fs);
+			closeVirDrive(fs);
+			free(fs->snapshotReaders);
+			destroyLocks(fs);
+			free(fs);
+			return NULL;
+		}
+		fs->bootRecord = initBootRecord(fs, virDriveLabel, clusterSize);
+		initClusterCache(fs, cacheSlots);
+		writeBootRecord(fs);
+		fs->fileAllocTable = initFATClusters(fs);
+		buildFreeClusterMap(fs);
+		writeFAT(fs);
+		initDirHeader(fs, fs->bootRecord->rootDirStart);
+	}
+
+	if(driveFlags & DRIVE_ASYNC_IO)
+		initAsyncEngine(fs);
+	if(driveFlags & DRIVE_BACKGROUND_RECLAIM)
+		startReclaimer(fs);
+
+	return fs;
+}
+
+/**
+ * Writes the boot record and the file allocation table to the 
+ * virtual drive and closes the file system. The file system and any 
+ * files still open on it may not be used after this call, so no other
+ * thread may be using it and every async read or write must have been
+ * waited for.
+ *
+ * @param fs The file system
+ */
+void closeFileSystem(BC_FS *fs)
+{
+	stopReclaimer(fs);
+	destroyAsyncEngine(fs);
+	freeUnlinkedFiles(fs);
+	syncFileSystem(fs);
+	fs->openFiles = NULL;
+	destroyClusterCache(fs);
+	unmapVirDrive(fs);
+	closeVirDrive(fs);
+	free(fs->freeClusterMap);
+	fs->freeClusterMap = NULL;
+	free(fs->fatClusterFree);
+	fs->fatClusterFree = NULL;
+	free(fs->pendingZeroMap);
+	fs->pendingZeroMap = NULL;
+	free(fs->fatClusterDirty);
+	fs->fatClusterDirty = NULL;
+	destroyDirIndexes(fs);
+	invalidatePathCache(fs, 1);
+	free(fs->fileAllocTable);
+	free(fs->bootRecord);
+	destroyLocks(fs);
+	free(fs);
+}
+
+/**
+ * Writes the pending metadata of the open files, returns the clusters
+ * reserved by the open files which they have not used, zeroes the clusters
+ * of deleted files which are waiting to be zeroed, writes the boot 
+ * record and the modified clusters of the file allocation table to 
+ * the virtual drive and flushes the drive, 
+ * leaving the file system open. After this call the drive file is
+ * consistent with the state of the file system.
+ *
+ * @param fs The file system
+ */
+void syncFileSystem(BC_FS *fs)
+{
+	syncFileMetadata(fs);
+	releaseAllocPools(fs);
+	reclaimClusters(fs, fs->bootRecord->clustersOnDrive);
+	writeBootRecord(fs);
+	writeFAT(fs);
+	syncVirDrive(fs);
+}
+
+/**
+ * Sets how often the pending size and modified date of an open file 
+ * are written to its directory entry when metadata is deferred. A 
+ * write to the file writes them if at least the given number of 
+ * seconds have passed since they were last written. An interval of 0
+ * (the default) writes them only on close and sync.
+ *
+ * @param fs      The file system
+ * @param seconds The interval in seconds
+ */
+void setMetadataInterval(BC_FS *fs, u_int seconds)
+{
+	fs->metaSyncInterval = seconds;
+}
+
+/** 
+ * ======================================================================== 
+ * |                          Lock Operations                             | 
+ * ======================================================================== 
+ * 
+ *     This section holds the locks which make the file system safe to 
+ *     use from several threads at once. All drive accesses are 
+ *     positional (pread/pwrite or the mapping), so threads never share
+ *     a file position. The locks are:
+ *
+ *       - fatLock: guards the file allocation table, the free cluster 
+ *                  and pending zero maps and the counters of the boot
+ *                  record. It is taken by every operation of the FAT 
+ *                  section which changes them, and is recursive so 
+ *                  that those operations can call each other.
+ *
+ *       - dirLocks: reader/writer locks guarding the directories. The
+ *                   lock of a directory is chosen by its starting 
+ *                   cluster from DIR_LOCK_STRIPES locks. Searches hold
+ *                   the read lock and changes the write lock. The 
+ *                   operations of the directory sections expect the 
+ *                   caller to hold the lock; the lock is taken by the
+ *                   file operations. Searches of a directory index 
+ *                   need no lock (see the Directory Index section). At
+ *                   most one directory lock is held at a time. Each 
+ *                   lock has a sequence count which is odd while the 
+ *                   write lock is held, so that an entry read without
+ *                   the lock can be checked against a concurrent 
+ *                   change.
+ *
+ *       - lock (in BC_FILE): a recursive lock guarding the position, 
+ *                            size and cluster map of an open file, 
+ *                            so reads and writes of different files
+ *                            do not contend.
+ *
+ *       - openFilesLock: guards the list of open files.
+ *
+ *       - cacheLock: guards the cluster cache.
+ *
+ *       - dirIndexLock and pathCacheLock: guard the table of directory
+ *                                         indexes and the path cache.
+ *
+ *       - aioLock: guards the async I/O engine. Its conditions are 
+ *                  aioWork, signalled when requests are queued for the
+ *                  worker threads, and aioDone, signalled when requests
+ *                  complete.
+ *
+ *       - reclaimLock: guards the stop flag of the background 
+ *                      reclaimer, which waits on reclaimWake between 
+ *                      passes. No other lock is taken while it is held.
+ *
+ *     Locks are always taken in the order openFilesLock, a file's lock,
+ *     a directory lock, dirIndexLock or pathCacheLock, fatLock, 
+ *     cacheLock and aioLock.
+ */
+
+/**
+ * Initializes the locks of a file system
+ *
+ * @param fs The file system
+ */
+void initLocks(BC_FS *fs)
+{
+	u_int i;
+
+	initRecursiveMutex(&fs->fatLock);
+	pthread_mutex_init(&fs->cacheLock, NULL);
+	pthread_mutex_init(&fs->openFilesLock, NULL);
+	pthread_mutex_init(&fs->dirIndexLock, NULL);
+	pthread_rwlock_init(&fs->pathCacheLock, NULL);
+	for(i = 0; i < DIR_LOCK_STRIPES; i++)
+		pthread_rwlock_init(&fs->dirLocks[i], NULL);
+	pthread_mutex_init(&fs->aioLock, NULL);
+	pthread_cond_init(&fs->aioDone, NULL);
+	pthread_cond_init(&fs->aioWork, NULL);
+	pthread_mutex_init(&fs->reclaimLock, NULL);
+	pthread_cond_init(&fs->reclaimWake, NULL);
+}
+
+/**
+ * Destroys the locks of a file system
+ *
+ * @param fs The file system
+ */
+void destroyLocks(BC_FS *fs)
+{
+	u_int i;
+
+	pthread_mutex_destroy(&fs->fatLock);
+	pthread_mutex_destroy(&fs->cacheLock);
+	pthread_mutex_destroy(&fs->openFilesLock);
+	pthread_mutex_destroy(&fs->dirIndexLock);
+	pthread_rwlock_destroy(&fs->pathCacheLock);
+	for(i = 0; i < DIR_LOCK_STRIPES; i++)
+		pthread_rwlock_destroy(&fs->dirLocks[i]);
+	pthread_mutex_destroy(&fs->aioLock);
+	pthread_cond_destroy(&fs->aioDone);
+	pthread_cond_destroy(&fs->aioWork);
+	pthread_mutex_destroy(&fs->reclaimLock);
+	pthread_cond_destroy(&fs->reclaimWake);
+}
+
+/**
+ * Initializes a mutex which may be locked again by the thread holding it
+ *
+ * @param mutex The mutex to initialize
+ */
+void initRecursiveMutex(pthread_mutex_t *mutex)
+{
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/**
+ * Locks a directory for reading or writing
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ * @param write      1 to lock the directory for writing, 0 for reading
+ */
+void lockDir(BC_FS *fs, u_int dirCluster, int write)
+{
+	u_int stripe = dirCluster % DIR_LOCK_STRIPES;
+
+	if(write)
+	{
+		pthread_rwlock_wrlock(&fs->dirLocks[stripe]);
+		__atomic_store_n(&fs->dirSeq[stripe], fs->dirSeq[stripe] + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
 	}
+	else
+		pthread_rwlock_rdlock(&fs->dirLocks[stripe]);
+}
+
+/**
+ * Unlocks a directory locked by lockDir()
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ */
+void unlockDir(BC_FS *fs, u_int dirCluster)
+{
+	u_int stripe = dirCluster % DIR_LOCK_STRIPES;
+
+	/* The count is only odd while the write lock is held */
+	u_int seq = __atomic_load_n(&fs->dirSeq[stripe], __ATOMIC_RELAXED);
+	if(seq & 1)
+		__atomic_store_n(&fs->dirSeq[stripe], seq + 1, __ATOMIC_RELEASE);
+	pthread_rwlock_unlock(&fs->dirLocks[stripe]);
+}
+
+/**
+ * Returns the sequence count of a directory's lock, to be passed to 
+ * checkDirSeq() after reading the directory without its lock
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster of the directory
+ * @return            The sequence count
+ */
+u_int readDirSeq(BC_FS *fs, u_int dirCluster)
+{
+	return __atomic_load_n(&fs->dirSeq[dirCluster % DIR_LOCK_STRIPES], __ATOMIC_ACQUIRE);
 }
 
-void closeFileSystem()
+/**
+ * Determines if a read of a directory made without its lock since 
+ * readDirSeq() returned the given count saw no change to the directory
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster of the directory
+ * @param  seq        The count returned by readDirSeq()
+ * @return            1 if the read is consistent, 0 otherwise
+ */
+int checkDirSeq(BC_FS *fs, u_int dirCluster, u_int seq)
 {
-	writeBootRecord();
-	writeFAT();
-	closeVirDrive();
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return !(seq & 1) && __atomic_load_n(&fs->dirSeq[dirCluster % DIR_LOCK_STRIPES], __ATOMIC_RELAXED) == seq;
 }
 
 /** 
@@ -80,8 +439,9 @@ void closeFileSystem()
  *     the virtual drive. The virtual drive will be represented by a 
  *     file (one of the four files provided: Drive10MB, Drive5MB, Drive3MB, 
  *     or Drive2MB). The virtual drive's allocation unit size, or cluster 
- *     size (as it will be refered to throughout these docs) will be 512 
- *     bytes. The layout of the clusters on the virtual drive will be as 
+ *     size (as it will be refered to throughout these docs) is chosen 
+ *     when the drive is initialized, from 512 bytes (the default) up to
+ *     64 KB, and is held in the boot record. The layout of the clusters on the virtual drive will be as 
  *     follows (cluster addresses):
  *
  *       -   0: The boot cluster
@@ -110,848 +470,4178 @@ FILE *openVirDrive(char *virDriveName)
 }
 
 /** 
- * Formats the virtual drive. 
+ * Formats the virtual drive by zeroing the whole drive file. Where the
+ * file system supports it, the blocks of the file are released with 
+ * fallocate (or the file is truncated and extended), leaving a sparse
+ * file, so no data is written; otherwise the zeroes are written in 
+ * large blocks.
  *
-*/
-void formatVirDrive()
+ * @param  fs The file system
+ * @return    0 if the whole drive was zeroed, -1 otherwise
+ */
+int formatVirDrive(BC_FS *fs)
 {
-	rewind(virDrive);
-	int i;
-	u_int driveSize = 0;
-	while(fgetc(virDrive) != EOF)
-		driveSize++;
-	rewind(virDrive);
-	for(i = 0; i < driveSize; i++)
-		fputc(0x00, virDrive);
-	rewind(virDrive);
+	struct stat st;
+	int fd = fileno(fs->virDrive);
+	if(fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Could not format virtual drive: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Release the blocks of the drive file, which then read as zeroes */
+	if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, st.st_size) == 0)
+		return 0;
+
+	if(fs->virDriveMode == DRIVE_MODE_MMAP)
+	{
+		memset(fs->virDriveMap, 0x00, fs->virDriveMapSize);
+		return 0;
+	}
+
+	/* Truncate the drive file and extend it again as a sparse file */
+	if(ftruncate(fd, 0) == 0 && ftruncate(fd, st.st_size) == 0)
+		return 0;
+
+	/* Write the zeroes a block at a time, finishing short writes */
+	off_t loc = 0;
+	char *empty = calloc(CLUSTER_SIZE_MAX, sizeof(char));
+	if(!empty)
+	{
+		fprintf(stderr, "Could not format virtual drive: out of memory\n");
+		return -1;
+	}
+	while(loc < st.st_size)
+	{
+		off_t len = CLUSTER_SIZE_MAX;
+		if(st.st_size - loc < len)
+			len = st.st_size - loc;
+		ssize_t written = pwrite(fd, empty, len, loc);
+		if(written < 0 && errno == EINTR)
+			continue;
+		if(written <= 0)
+		{
+			fprintf(stderr, "Could not format virtual drive: %s\n", written < 0 ? strerror(errno) : "no bytes written");
+			free(empty);
+			return -1;
+		}
+		loc += written;
+	}
+	free(empty);
+
+	return 0;
 }
 
 /**
  * Closes the virtual drive
  *
- * @param virDrive A pointer to the file pointer of the virtual drive
+ * @param fs The file system
 */
-void closeVirDrive()
+void closeVirDrive(BC_FS *fs)
 {
-	fclose(virDrive);
+	fclose(fs->virDrive);
 }
 
 /**
  * Formats the given cluster on the virtual drive
  *
+ * @param fs          The file system
  * @param clusterAddr The address of the cluster to format
  */
-void formatCluster(u_int clusterAddr)
+void formatCluster(BC_FS *fs, u_int clusterAddr)
 {
-	u_int i;
-	u_int loc = clusterAddr * bootRecord->bytesPerCluster;
-	fseek(virDrive, loc, SEEK_SET);
-	for(i = 0; i < bootRecord->bytesPerCluster; i++)
-		fputc(0x00, virDrive);
+	if(fs->virDriveMode == DRIVE_MODE_MMAP)
+	{
+		memset(getClusterPtr(fs, clusterAddr), 0x00, fs->bootRecord->bytesPerCluster);
+		return;
+	}
+
+	off_t loc = getClusterLoc(fs, clusterAddr);
+	char *empty = calloc(fs->bootRecord->bytesPerCluster, sizeof(char));
+	writeVirDrive(fs, empty, loc, fs->bootRecord->bytesPerCluster);
+	free(empty);
 }
 
-/** 
- * ======================================================================== 
- * |                    Boot Record Operations                            | 
- * ======================================================================== 
- * 
- *     This section holds all of the operations which can be performed on 
- *     the boot record of the virtual drive. The boot cluster will have 
- *     a size of one cluster (512 bytes). The layout of the data contained 
- *     in the boot record/cluster is as follows:
- *     
- *        (bytes) | property 
- *       ---------------------------------------------------------------
- *        (0)      | A byte designating the virtual drive as initialized
- *        (1-23)   | A label for the virtual drive
- *        (24-27)  | The number of bytes per cluster
- *        (28-31)  | The number of reserved clusters
- *        (32-35)  | The number of clusters on the virtual drive
- *        (36-39)  | The number of clusters per file allocation table
- *        (40-43)  | The first cluster of the root directory
- *        (44-47)  | The number of free clusters
- *        (48-51)  | The next free cluster
- *        (52-55)  | The size of the virtual drive in bytes
- *        (55-511) | This space is unused
+/**
+ * Maps the entire virtual drive into memory and switches the
+ * file system into DRIVE_MODE_MMAP. Changes made through the
+ * mapping reach the drive file when syncVirDrive() is called 
+ * or the drive is unmapped.
  *
- *     The boot record will be represented in the file system application 
- *     as a struct containing all of the properties listed above. 
+ * @param  fs The file system
+ * @return 1 if the drive was mapped, 0 otherwise
  */
+int mapVirDrive(BC_FS *fs)
+{
+	struct stat st;
+	if(fstat(fileno(fs->virDrive), &st) != 0 || st.st_size == 0)
+		return 0;
+
+	char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fs->virDrive), 0);
+	if(map == MAP_FAILED)
+		return 0;
 
+	fs->virDriveMap = map;
+	fs->virDriveMapSize = st.st_size;
+	fs->virDriveMode = DRIVE_MODE_MMAP;
+
+	return 1;
+}
 
 /**
- * Initializes a boot record struct for the virtual drive.
- * NOTE: This function does not write the boot record struct to
- * the virtual drive.
+ * Unmaps the virtual drive if it is mapped
  *
- * @param  driveLabel A string containing the label for the drive
- * @return            An pointer to an initialized boot record struct
+ * @param fs The file system
  */
-BootRecord *initBootRecord(char *driveLabel)
+void unmapVirDrive(BC_FS *fs)
 {
-	BootRecord *boot = calloc(1, sizeof(*boot));
-
-	/* Get size of the drive in bytes */
-	rewind(virDrive);
-	u_int dSize = 0;
-	while(fgetc(virDrive) != EOF)
-		dSize++;
-	rewind(virDrive);
-
-	boot->init = 1;
-	strncpy(boot->label, driveLabel, DRIVE_LABEL_MAX);
-	boot->bytesPerCluster = CLUSTER_SIZE;
-	boot->reservedClusters = 1;
-	boot->clustersOnDrive = dSize / CLUSTER_SIZE;
-	boot->clustersPerFat = ceil((double) boot->clustersOnDrive * FAT_ENTRY_BYTES / CLUSTER_SIZE);
-	boot->rootDirStart = boot->clustersPerFat + 1;
-	boot->freeClusters = boot->clustersOnDrive - (boot->clustersPerFat + 2);
-	boot->nextFreeCluster = boot->clustersPerFat + 2;
-	boot->driveSize = dSize;
-
-	return boot;
+	if(fs->virDriveMode == DRIVE_MODE_MMAP)
+	{
+		munmap(fs->virDriveMap, fs->virDriveMapSize);
+		fs->virDriveMap = NULL;
+		fs->virDriveMapSize = 0;
+		fs->virDriveMode = DRIVE_MODE_STDIO;
+	}
 }
 
 /**
- * Writes the global boot record struct to the virtual drive
+ * Flushes all pending changes to the virtual drive file. In 
+ * DRIVE_MODE_MMAP the mapping is synchronously written back with 
+ * msync, otherwise the dirty clusters of the cluster cache are 
+ * written back and the stdio buffer of the drive is flushed. This
+ * can be called at any point to obtain a consistent drive file.
+ *
+ * @param fs The file system
  */
-void writeBootRecord()
+void syncVirDrive(BC_FS *fs)
 {
-	rewind(virDrive);
-	fwrite(bootRecord, sizeof(BootRecord), 1, virDrive);
+	if(fs->virDriveMode == DRIVE_MODE_MMAP)
+		msync(fs->virDriveMap, fs->virDriveMapSize, MS_SYNC);
+	else
+	{
+		flushClusterCache(fs);
+		fflush(fs->virDrive);
+	}
 }
 
 /**
- * Reads the boot record from the drive and stores it in the
- * global boot record struct
+ * Returns the offset (in bytes) from the beginning of the virtual drive
+ * to the start of the given cluster
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The address of the cluster
+ * @return             The drive offset of the cluster in bytes
  */
-void readBootRecord()
+off_t getClusterLoc(BC_FS *fs, u_int clusterAddr)
 {
-	rewind(virDrive);
-	fread(bootRecord, sizeof(BootRecord), 1, virDrive);
+	return (off_t) clusterAddr * fs->bootRecord->bytesPerCluster;
 }
 
-/** 
- * ======================================================================== 
- * |               File Allocation Table Operations                       | 
- * ======================================================================== 
+/**
+ * Returns a pointer to the start of the given cluster within the
+ * mapped virtual drive. Only valid in DRIVE_MODE_MMAP.
  *
- *     This section holds all of the operations that can be performed on
- *     the file allocation table clusters on the virtual drive. Each 
- *     file allocation table entry will consist of 4 bytes. This will
- *     allow for 128 entries per cluster. Each file allocation table
- *     entry can hold one of three types of values:
- *     
- *       - The address of the next cluster in the chain
- *       - The end of chain identifier 0xffffffff
- *       - The empty cluster identifier 0x0
- *       
- *     File allocation table cluster addresses (clusterAddr) refer to the 
- *     position of the cluster on disk. The cluster addresses are defined 
- *     as follows:
- *     
- *       -   0: The boot cluster
- *       -   1: The first cluster of the file allocation table
- *       -   2: The second cluster of the file allocation table
- *         ...
- *       -   n: The last cluster of the file allocation table
- *              Note: n = (((drive size / cluster size) * entry size) / cluster size) + 1
- *       - n+1: The root directory cluster
- *       - n+2: The first cluster of the data region
- *         ...
- *       -   x: The last cluster of the data region
- *              Note: x = (drive size / cluster size) - 1
+ * @param  fs          The file system
+ * @param  clusterAddr The address of the cluster
+ * @return             A pointer to the first byte of the cluster
  */
+char *getClusterPtr(BC_FS *fs, u_int clusterAddr)
+{
+	assert(fs->virDriveMode == DRIVE_MODE_MMAP);
+	return fs->virDriveMap + (size_t) clusterAddr * fs->bootRecord->bytesPerCluster;
+}
 
 /**
- * Initializes the file allocation table clusters of a virtual drive.
+ * Reads a number of bytes from the given offset of the virtual drive.
+ * In DRIVE_MODE_STDIO the read is served from the cluster cache when
+ * the cache is enabled.
  *
- * @param virDrive A pointer to the file pointer of the virtual drive
+ * @param fs   The file system
+ * @param dest The buffer to store the data read
+ * @param loc  The offset (in bytes) from the beginning of the drive
+ * @param len  The number of bytes to read
  */
-u_int *initFATClusters()
+void readVirDrive(BC_FS *fs, void *dest, off_t loc, u_int len)
 {
-	int i;
-	int n = bootRecord->clustersPerFat;
-	u_int *fat = (u_int*) calloc(sizeof(u_int), bootRecord->clustersOnDrive);
-	
-	/* Boot Cluster */
-	fat[0] = 0xffffffff;
-	/* FAT Clusters */
-	for(i = 1; i < n; i++)
-		fat[i] = i + 1;
-	fat[n] = 0xffffffff;
-	/* Root Dir Cluster */
-	fat[bootRecord->rootDirStart] = 0xffffffff;
+	if(fs->virDriveMode == DRIVE_MODE_MMAP)
+	{
+		/* Like fread, a read past the end of the drive is short */
+		if((size_t) loc + len > fs->virDriveMapSize)
+			len = (size_t) loc < fs->virDriveMapSize ? fs->virDriveMapSize - loc : 0;
+		memcpy(dest, fs->virDriveMap + loc, len);
+	}
+	else if(fs->clusterCacheSlots)
+	{
+		char *p = dest;
+		u_int clusterSize = fs->bootRecord->bytesPerCluster;
+		pthread_mutex_lock(&fs->cacheLock);
+		while(len > 0)
+		{
+			u_int clusterAddr = loc / clusterSize;
+			u_int offset = loc % clusterSize;
+			u_int chunk = clusterSize - offset;
+			if(chunk > len)
+				chunk = len;
 
-	return fat;
+			/* The partial cluster at the end of the drive is never cached */
+			if(clusterAddr >= fs->bootRecord->clustersOnDrive)
+			{
+				readVirDriveDirect(fs, p, loc, len);
+				break;
+			}
+
+			CacheSlot *slot = getCacheSlot(fs, clusterAddr, 1);
+			memcpy(p, slot->data + offset, chunk);
+			p += chunk;
+			loc += chunk;
+			len -= chunk;
+		}
+		pthread_mutex_unlock(&fs->cacheLock);
+	}
+	else
+		readVirDriveDirect(fs, dest, loc, len);
 }
 
-void writeFAT()
+/**
+ * Writes a number of bytes to the given offset of the virtual drive.
+ * In DRIVE_MODE_STDIO the write is held in the cluster cache when
+ * the cache is enabled and reaches the drive file on eviction or
+ * when the cache is flushed.
+ *
+ * @param fs  The file system
+ * @param src The data to write
+ * @param loc The offset (in bytes) from the beginning of the drive
+ * @param len The number of bytes to write
+ */
+void writeVirDrive(BC_FS *fs, void *src, off_t loc, u_int len)
 {
-	u_int loc = bootRecord->bytesPerCluster * bootRecord->reservedClusters;
-	fseek(virDrive, loc, SEEK_SET);
-	fwrite(fileAllocTable, sizeof(u_int), bootRecord->clustersOnDrive, virDrive);
+	if(fs->virDriveMode == DRIVE_MODE_MMAP)
+	{
+		assert((size_t) loc + len <= fs->virDriveMapSize);
+		memcpy(fs->virDriveMap + loc, src, len);
+	}
+	else if(fs->clusterCacheSlots)
+	{
+		char *p = src;
+		u_int clusterSize = fs->bootRecord->bytesPerCluster;
+		pthread_mutex_lock(&fs->cacheLock);
+		while(len > 0)
+		{
+			u_int clusterAddr = loc / clusterSize;
+			u_int offset = loc % clusterSize;
+			u_int chunk = clusterSize - offset;
+			if(chunk > len)
+				chunk = len;
+
+			/* The partial cluster at the end of the drive is never cached */
+			if(clusterAddr >= fs->bootRecord->clustersOnDrive)
+			{
+				writeVirDriveDirect(fs, p, loc, len);
+				break;
+			}
+
+			/* A write covering the whole cluster does not need to load it */
+			CacheSlot *slot = getCacheSlot(fs, clusterAddr, chunk < clusterSize);
+			memcpy(slot->data + offset, p, chunk);
+			slot->dirty = 1;
+			p += chunk;
+			loc += chunk;
+			len -= chunk;
+		}
+		pthread_mutex_unlock(&fs->cacheLock);
+	}
+	else
+		writeVirDriveDirect(fs, src, loc, len);
 }
 
-void readFAT()
+/**
+ * Reads a number of bytes from the given offset of the drive file,
+ * bypassing the cluster cache. Only valid in DRIVE_MODE_STDIO. The 
+ * read is a pread on the drive file's descriptor, so it does not use
+ * or move the stdio position of the drive.
+ *
+ * @param  fs   The file system
+ * @param  dest The buffer to store the data read
+ * @param  loc  The offset (in bytes) from the beginning of the drive
+ * @param  len  The number of bytes to read
+ * @return      The number of bytes read, or -1 if the read failed
+ */
+ssize_t readVirDriveDirect(BC_FS *fs, void *dest, off_t loc, u_int len)
 {
-	u_int loc = bootRecord->bytesPerCluster * bootRecord->reservedClusters;
-	fseek(virDrive, loc, SEEK_SET);
-	fread(fileAllocTable, sizeof(u_int), bootRecord->clustersOnDrive, virDrive);
+	return pread(fileno(fs->virDrive), dest, len, loc);
 }
 
 /**
- * Adds a cluster to the end of a cluster chain. The cluster address 
- * that is passed in must be the ending cluster of the chain.
+ * Writes a number of bytes to the given offset of the drive file,
+ * bypassing the cluster cache. Only valid in DRIVE_MODE_STDIO. The 
+ * write is a pwrite on the drive file's descriptor.
  *
- * @param  clusterAddr The cluster address of the entry that is being extended
- * @return             The new end of chain cluster address
+ * @param  fs  The file system
+ * @param  src The data to write
+ * @param  loc The offset (in bytes) from the beginning of the drive
+ * @param  len The number of bytes to write
+ * @return     The number of bytes written, or -1 if the write failed
  */
-u_int addClusterToChain(u_int clusterAddr)
+ssize_t writeVirDriveDirect(BC_FS *fs, void *src, off_t loc, u_int len)
 {
-	u_int next = bootRecord->nextFreeCluster;
-	fileAllocTable[clusterAddr] = next;
-	fileAllocTable[next] = 0xffffffff;
-	findAndSetNextFreeCluster();
-	bootRecord->freeClusters--;
-
-	return next;
+	return pwrite(fileno(fs->virDrive), src, len, loc);
 }
 
 /**
- * Locates the next free cluster using the file allocation table and
- * stores the address in the boot cluster of the drive.
+ * Reads a contiguous region of the virtual drive, starting at the 
+ * given offset, into several buffers. When the cluster cache is not 
+ * used in DRIVE_MODE_STDIO the region is read with a single preadv.
  *
- * @param virDrive A pointer to the file pointer of the virtual drive
+ * @param  fs     The file system
+ * @param  iov    The buffers to store the data read, filled in order
+ * @param  iovcnt The number of buffers, at most DRIVE_IOV_MAX
+ * @param  loc    The offset (in bytes) from the beginning of the drive
+ * @return        The number of bytes read, or -1 if the read failed
  */
-void findAndSetNextFreeCluster()
+ssize_t readVirDriveV(BC_FS *fs, BC_IOVEC *iov, int iovcnt, off_t loc)
 {
-	u_int clusterAddr = bootRecord->rootDirStart + 1;
-	u_int entriesPerCluster = bootRecord->bytesPerCluster / 4;
-	u_int maxEntries = bootRecord->clustersPerFat * entriesPerCluster; 
-	while(fileAllocTable[clusterAddr] != 0x0)
+	ssize_t len = 0;
+	int i;
+
+	if(fs->virDriveMode == DRIVE_MODE_STDIO && !fs->clusterCacheSlots)
 	{
-		if(clusterAddr >= maxEntries)
+		struct iovec vec[DRIVE_IOV_MAX];
+		for(i = 0; i < iovcnt; i++)
 		{
-			/* FAT is full, handle error */
-			fprintf(stderr, "FAT is full\n");
+			vec[i].iov_base = iov[i].base;
+			vec[i].iov_len = iov[i].len;
 		}
-		clusterAddr++;
-	} 
-	bootRecord->nextFreeCluster = clusterAddr;
-}
+		return preadv(fileno(fs->virDrive), vec, iovcnt, loc);
+	}
+
+	for(i = 0; i < iovcnt; i++)
+	{
+		readVirDrive(fs, iov[i].base, loc, iov[i].len);
+		loc += iov[i].len;
+		len += iov[i].len;
+	}
+
+	return len;
+}
+
+/**
+ * Writes several buffers to a contiguous region of the virtual drive
+ * starting at the given offset. When the cluster cache is not used in
+ * DRIVE_MODE_STDIO the region is written with a single pwritev.
+ *
+ * @param  fs     The file system
+ * @param  iov    The buffers holding the data to write, in order
+ * @param  iovcnt The number of buffers, at most DRIVE_IOV_MAX
+ * @param  loc    The offset (in bytes) from the beginning of the drive
+ * @return        The number of bytes written, or -1 if the write failed
+ */
+ssize_t writeVirDriveV(BC_FS *fs, BC_IOVEC *iov, int iovcnt, off_t loc)
+{
+	ssize_t len = 0;
+	int i;
+
+	if(fs->virDriveMode == DRIVE_MODE_STDIO && !fs->clusterCacheSlots)
+	{
+		struct iovec vec[DRIVE_IOV_MAX];
+		for(i = 0; i < iovcnt; i++)
+		{
+			vec[i].iov_base = iov[i].base;
+			vec[i].iov_len = iov[i].len;
+		}
+		return pwritev(fileno(fs->virDrive), vec, iovcnt, loc);
+	}
+
+	for(i = 0; i < iovcnt; i++)
+	{
+		writeVirDrive(fs, iov[i].base, loc, iov[i].len);
+		loc += iov[i].len;
+		len += iov[i].len;
+	}
 
+	return len;
+}
 
 /** 
  * ======================================================================== 
- * |              Directory Table Entry Operations                        | 
+ * |                        Async I/O Operations                          | 
  * ======================================================================== 
+ * 
+ *     This section holds the engine which lets the data of file reads 
+ *     and writes be transferred asynchronously. A read or write of a 
+ *     file is turned into one drive request for each run of physically
+ *     contiguous clusters it covers. The requests are collected in a 
+ *     batch (a BC_AIO) while the file's cluster chain is walked, and the
+ *     whole batch is then handed to the engine at once, so a fragmented
+ *     file costs one submission rather than one blocking access per run.
  *
- *     The section holds all of the operations which can be performed on
- *     the directory clusters of the virtual drive. Each directory 
- *     entry will consist of 64 bytes. This will allow for 8 entries
- *     per cluster. The layout of the data contained in each directory 
- *     entry is as follows:
+ *     On Linux the engine is an io_uring ring, driven through its system
+ *     calls. Where a ring cannot be set up, a pool of AIO_WORKERS threads
+ *     carries the requests out with preadv and pwritev instead. The 
+ *     engine is only started for drives mounted with DRIVE_ASYNC_IO, and
+ *     is only used while the drive is in DRIVE_MODE_STDIO without the 
+ *     cluster cache, since the cache and the mapping are served from 
+ *     memory. Otherwise every request is carried out as it is queued.
  *
- *        (bytes) | value 
- *       ---------------------------------------------------------------
- *        (0)     | A byte holding the attributes of the file/directory:
- *                    Bit 0: 0 for unused entry, 1 for used entry
- *                    Bit 1: 0 for R/O, 1 for R/W
- *                    Bit 2: 1 for hidden file/directory
- *                    Bit 3: 1 for system file
- *                    Bit 4: 1 for subdirectory
- *                    The remaining bits are unused
- *        (1-43)  | The file/directory name (42 chars max)
- *        (44-47) | The file/directory extension (3 chars max)
- *        (48-51) | Creation date/time
- *                    Bits 0-5:   Year - 1985
- *                    Bits 6-9:   Month
- *                    Bits 10-14: Day
- *                    Bits 15-19: Hour
- *                    Bits 20-25: Minute
- *                    Bits 26-31: Second
- *        (52-55) | Last modified date/time
- *                    Bits 0-5:   Year - 1985
- *                    Bits 6-9:   Month
- *                    Bits 10-14: Day
- *                    Bits 15-19: Hour
- *                    Bits 20-25: Minute
- *                    Bits 26-31: Second
- *        (56-59) | Starting cluster of file (empty file: 0)
- *        (60-63) | The file size in bytes
+ *     The engine is guarded by aioLock. A request completes by lowering 
+ *     the pending count of its batch and signalling aioDone. With a ring,
+ *     one waiting thread at a time blocks in the kernel for completions
+ *     (the ring's reaping flag); the others wait on aioDone. The requests
+ *     of a batch are not ordered with respect to one another or to other
+ *     batches, so the regions of a file which are read and written at 
+ *     the same time must not overlap.
+ */
+
+/**
+ * Starts the async I/O engine of a file system, using an io_uring ring
+ * where possible and a pool of worker threads otherwise. The engine is 
+ * not started if the drive is mapped or uses the cluster cache.
  *
- *     The entries will be organized within a directory cluster chain
- *     with entry addresses ranging from 0 upwards. The entry address
- *     refers to an entries position relative to the entire directory
- *     cluster chain.
+ * @param fs The file system
+ */
+void initAsyncEngine(BC_FS *fs)
+{
+	u_int i;
+
+	fs->aioMode = AIO_MODE_NONE;
+	if(fs->virDriveMode != DRIVE_MODE_STDIO || fs->clusterCacheSlots)
+		return;
+
+	if(setupAsyncRing(fs))
+	{
+		fs->aioMode = AIO_MODE_URING;
+		return;
+	}
+
+	fs->aioQueue = NULL;
+	fs->aioQueueTail = &fs->aioQueue;
+	fs->aioStop = 0;
+	for(i = 0; i < AIO_WORKERS; i++)
+	{
+		if(pthread_create(&fs->aioWorkers[i], NULL, asyncWorker, fs) != 0)
+		{
+			fprintf(stderr, "Could not start async I/O workers, using synchronous I/O\n");
+			pthread_mutex_lock(&fs->aioLock);
+			fs->aioStop = 1;
+			pthread_cond_broadcast(&fs->aioWork);
+			pthread_mutex_unlock(&fs->aioLock);
+			while(i > 0)
+				pthread_join(fs->aioWorkers[--i], NULL);
+			return;
+		}
+	}
+	fs->aioMode = AIO_MODE_THREADS;
+}
+
+/**
+ * Stops the async I/O engine of a file system. The worker threads finish
+ * the requests queued to them before they exit. Any async read or write
+ * must have been waited for before this call.
+ *
+ * @param fs The file system
  */
+void destroyAsyncEngine(BC_FS *fs)
+{
+	u_int i;
 
+	if(fs->aioMode == AIO_MODE_URING)
+	{
+		AsyncRing *ring = &fs->aioRing;
+		munmap(ring->sqes, ring->sqesSize);
+		if(ring->cqMap != ring->sqMap)
+			munmap(ring->cqMap, ring->cqMapSize);
+		munmap(ring->sqMap, ring->sqMapSize);
+		close(ring->fd);
+	}
+	else if(fs->aioMode == AIO_MODE_THREADS)
+	{
+		pthread_mutex_lock(&fs->aioLock);
+		fs->aioStop = 1;
+		pthread_cond_broadcast(&fs->aioWork);
+		pthread_mutex_unlock(&fs->aioLock);
+		for(i = 0; i < AIO_WORKERS; i++)
+			pthread_join(fs->aioWorkers[i], NULL);
+	}
+	fs->aioMode = AIO_MODE_NONE;
+}
 
 /**
- * Creates a directory entry for a file in the given directory cluster
+ * Sets up an io_uring ring for the async I/O engine and maps its 
+ * submission and completion queues. The ring is only used if the kernel
+ * keeps completions which do not fit in the completion queue, so that
+ * any number of requests may be in flight.
  *
- * @param  clusterAddr The starting cluster of the directory
- * @param  attr        The attributes of the file (one byte)
- *                       Bit 0: 0 for unused entry, 1 for used entry
- *                       Bit 1: 0 for R/O, 1 for R/W
- *                       Bit 2: 1 for hidden file
- *                       Bit 3: 1 for system file
- *                       Bit 4: 1 for subdirectory
- *                       The remaining bits are unused
- * @param  name        The name of the file/directory (maximum 12 characters)
- * @param  ext         The extension of the file (maximum 3 characters)
- * @return             The entry address of the new file
+ * @param  fs The file system
+ * @return    1 if the ring was set up, 0 otherwise
  */
-u_int createDirFileEntry(u_int clusterAddr, char attr, char *name, char *ext)
+int setupAsyncRing(BC_FS *fs)
 {
-	u_int startCluster = bootRecord->nextFreeCluster;
-	fileAllocTable[startCluster] = 0xffffffff;
-	findAndSetNextFreeCluster(virDrive);
-	bootRecord->freeClusters--;
+#ifdef __NR_io_uring_setup
+	AsyncRing *ring = &fs->aioRing;
+	struct io_uring_params params;
 
-	u_int entryAddr = getFirstFreeDirEntryAddr(clusterAddr);
-	u_int loc = getDirEntryLoc(clusterAddr, entryAddr);
-	u_int currentTime = encodeTimeBytes();
-	
-	DirEntry fileEntry;
-	fileEntry.attr = attr;
-	strncpy(fileEntry.fileName, name, FILE_NAME_MAX);
-	strncpy(fileEntry.fileExt, ext, FILE_EXT_SIZE);
-	fileEntry.createDate = currentTime;
-	fileEntry.modifiedDate = currentTime;
-	fileEntry.startCluster = startCluster;
-	fileEntry.fileSize = 0;
-	fseek(virDrive, loc, SEEK_SET);
-	fwrite(&fileEntry, sizeof(DirEntry), 1, virDrive);
+	memset(&params, 0, sizeof(params));
+	int fd = syscall(__NR_io_uring_setup, AIO_QUEUE_DEPTH, &params);
+	if(fd < 0)
+		return 0;
+	if(!(params.features & IORING_FEAT_NODROP))
+	{
+		close(fd);
+		return 0;
+	}
 
-	return entryAddr;
+	ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(u_int);
+	ring->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if(ring->cqMapSize > ring->sqMapSize)
+			ring->sqMapSize = ring->cqMapSize;
+		ring->cqMapSize = ring->sqMapSize;
+	}
+
+	ring->sqMap = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(ring->sqMap == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+	ring->cqMap = ring->sqMap;
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		ring->cqMap = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if(ring->cqMap == MAP_FAILED)
+		{
+			munmap(ring->sqMap, ring->sqMapSize);
+			close(fd);
+			return 0;
+		}
+	}
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+	{
+		if(ring->cqMap != ring->sqMap)
+			munmap(ring->cqMap, ring->cqMapSize);
+		munmap(ring->sqMap, ring->sqMapSize);
+		close(fd);
+		return 0;
+	}
+
+	char *sq = ring->sqMap;
+	char *cq = ring->cqMap;
+	ring->fd = fd;
+	ring->entries = params.sq_entries;
+	ring->sqHead = (u_int*) (sq + params.sq_off.head);
+	ring->sqTail = (u_int*) (sq + params.sq_off.tail);
+	ring->sqMask = *(u_int*) (sq + params.sq_off.ring_mask);
+	ring->sqArray = (u_int*) (sq + params.sq_off.array);
+	ring->cqHead = (u_int*) (cq + params.cq_off.head);
+	ring->cqTail = (u_int*) (cq + params.cq_off.tail);
+	ring->cqMask = *(u_int*) (cq + params.cq_off.ring_mask);
+	ring->cqes = cq + params.cq_off.cqes;
+	ring->reaping = 0;
+
+	return 1;
+#else
+	return 0;
+#endif
 }
 
 /**
- * Creates a directory entry for a subdirectory in the given directory cluster
+ * The body of a worker thread of the async I/O engine. Each worker takes
+ * requests from the queue and carries them out until the engine is 
+ * stopped and the queue is empty.
  *
- * @param  clusterAddr The starting cluster of the parent directory
- * @param  attr        The attributes of the directory (one byte)
- *                       Bit 0: 0 for unused entry, 1 for used entry
- *                       Bit 1: 0 for R/O, 1 for R/W
- *                       Bit 2: 1 for hidden directory
- *                       Bit 3: 1 for system directory
- *                       Bit 4: 1 for subdirectory
- *                       The remaining bits are unused
- * @param  name        The name of the directory (maximum 42 characters)
- * @return             The starting cluster address of the subdirectory
+ * @param  arg The file system
+ * @return     NULL
  */
-u_int createDirSubEntry(u_int clusterAddr, char attr, char *name)
+void *asyncWorker(void *arg)
 {
-	u_int startCluster = bootRecord->nextFreeCluster;
-	fileAllocTable[startCluster] = 0xffffffff;
-	findAndSetNextFreeCluster(virDrive);
-	bootRecord->freeClusters--;
+	BC_FS *fs = arg;
 
-	u_int entryAddr = getFirstFreeDirEntryAddr(clusterAddr);
-	u_int loc = getDirEntryLoc(clusterAddr, entryAddr);
-	u_int currentTime = encodeTimeBytes();
+	pthread_mutex_lock(&fs->aioLock);
+	for(;;)
+	{
+		while(!fs->aioQueue && !fs->aioStop)
+			pthread_cond_wait(&fs->aioWork, &fs->aioLock);
+		AsyncOp *op = fs->aioQueue;
+		if(!op)
+			break;
+		fs->aioQueue = op->next;
+		if(!fs->aioQueue)
+			fs->aioQueueTail = &fs->aioQueue;
+		pthread_mutex_unlock(&fs->aioLock);
 
-	DirEntry subEntry;
-	subEntry.attr = attr;
-	strncpy(subEntry.fileName, name, FILE_NAME_MAX);
-	subEntry.createDate = currentTime;
-	subEntry.modifiedDate = currentTime;
-	subEntry.startCluster = startCluster;
-	subEntry.fileSize = 0;
-	fseek(virDrive, loc, SEEK_SET);
-	fwrite(&subEntry, sizeof(DirEntry), 1, virDrive);
+		int res = runAsyncOp(fs, op);
 
-	return entryAddr;
+		pthread_mutex_lock(&fs->aioLock);
+		completeAsyncOp(op, res);
+		pthread_cond_broadcast(&fs->aioDone);
+	}
+	pthread_mutex_unlock(&fs->aioLock);
+
+	return NULL;
 }
 
 /**
- * Deletes a directory entry
+ * Initializes a batch of drive requests
  *
- * @param dirCluster The starting cluster of the directory
- * @param entryAddr  The address of the entry to delete
+ * @param  fs  The file system
+ * @param  aio The batch
+ * @return     1 if the requests of the batch go to the async I/O engine,
+ *             0 if they must be carried out as they are made
  */
-void deleteDirEntry(u_int dirCluster, u_int entryAddr)
+int initAsyncBatch(BC_FS *fs, BC_AIO *aio)
 {
-	u_int loc = getDirEntryLoc(dirCluster, entryAddr);
-	fseek(virDrive, loc, SEEK_SET);
-	int i;
-	for(i = 0; i < DIR_ENTRY_BYTES; i++)
-		fputc(0x00, virDrive);
+	memset(aio, 0, sizeof(*aio));
+	aio->fs = fs;
+	aio->queuedTail = &aio->queued;
+
+	return fs->aioMode != AIO_MODE_NONE && fs->virDriveMode == DRIVE_MODE_STDIO && !fs->clusterCacheSlots;
 }
 
 /**
- * Determines if a file exists in the given directory cluster.
+ * Adds a request for a contiguous region of the virtual drive to a 
+ * batch. The buffers are not copied, so they must stay valid until the
+ * batch has completed. If the request cannot be allocated, the batch 
+ * is marked as failed with ENOMEM.
  *
- * @param  clusterAddr The directory cluster to search
- * @param  fileName    The name of the file to locate
- * @param  fileExt     The extension of the file to locate
- * @return             1 if found, 0 otherwise
+ * @param aio    The batch
+ * @param iov    The buffers of the request, in order
+ * @param iovcnt The number of buffers, at most DRIVE_IOV_MAX
+ * @param loc    The offset (in bytes) from the beginning of the drive
+ * @param write  1 to write the buffers to the drive, 0 to read
  */
-u_int dirFileEntryExists(u_int clusterAddr, char *fileName, char *fileExt)
+void queueAsyncIO(BC_AIO *aio, BC_IOVEC *iov, int iovcnt, off_t loc, int write)
 {
-	u_int found = 0;
-	u_int end = 0;
-	u_int entryAddr = 0;
-	u_int currentCluster = clusterAddr;
-	u_int nextCluster = 0;
-	DirEntry *entry;
+	int i;
 
-	while(!found && !end)
+	AsyncOp *op = malloc(sizeof(AsyncOp) + iovcnt * sizeof(struct iovec));
+	if(!op)
 	{
-		entry = getDirEntry(clusterAddr, entryAddr);
-		if(strcmp(entry->fileName, fileName) == 0 && strcmp(entry->fileExt, fileExt) == 0)
-			found = 1;
-		else
-		{
-			entryAddr++;
-			if(entryAddr % DIR_ENTRIES_PER_CLUSTER == 0)
-			{
-				nextCluster = fileAllocTable[currentCluster];
-				if(nextCluster == 0xffffffff)
-					end = 1;
-				currentCluster = nextCluster;
-			}
-		}
-		free(entry);
+		fprintf(stderr, "Error allocating space for an async I/O request\n");
+		aio->error = ENOMEM;
+		return;
+	}
+	op->aio = aio;
+	op->write = write;
+	op->iovcnt = iovcnt;
+	op->len = 0;
+	op->loc = loc;
+	op->next = NULL;
+	for(i = 0; i < iovcnt; i++)
+	{
+		op->vec[i].iov_base = iov[i].base;
+		op->vec[i].iov_len = iov[i].len;
+		op->len += iov[i].len;
 	}
 
-	return found;
+	*aio->queuedTail = op;
+	aio->queuedTail = &op->next;
+	aio->queuedCount++;
 }
 
 /**
- * Returns the directory entry address of a file in the given directory cluster.
+ * Hands the queued requests of a batch to the async I/O engine as one
+ * submission
  *
- * @param  clusterAddr The directory cluster to search
- * @param  fileName    The name of the file to locate
- * @param  fileExt     The extension of the file to locate
- * @return             The file's directory entry address
+ * @param aio The batch
  */
-u_int getDirFileEntryAddr(u_int clusterAddr, char *fileName, char *fileExt)
+void submitAsyncBatch(BC_AIO *aio)
 {
-	u_int found = 0;
-	u_int end = 0;
-	u_int entryAddr = 0;
-	u_int currentCluster = clusterAddr;
-	u_int nextCluster = 0;
-	DirEntry *entry;
+	BC_FS *fs = aio->fs;
 
-	while(!found)
-	{
-		entry = getDirEntry(clusterAddr, entryAddr);
-		if(strcmp(entry->fileName, fileName) == 0 && strcmp(entry->fileExt, fileExt) == 0)
-			found = 1;
-		else
-		{
-			entryAddr++;
-			if(entryAddr % DIR_ENTRIES_PER_CLUSTER == 0)
-			{
-				nextCluster = fileAllocTable[currentCluster];
-				if(nextCluster == 0xffffffff)
-					end = 1;
-				currentCluster = nextCluster;
-			}
-		}
-		free(entry);
-	}
+	if(!aio->queued)
+		return;
 
-	if(end)
+	pthread_mutex_lock(&fs->aioLock);
+	aio->pending += aio->queuedCount;
+	if(fs->aioMode == AIO_MODE_URING)
+		submitAsyncRing(fs, aio->queued);
+	else
 	{
-		fprintf(stderr, "Could not locate file in getDirFileEntryAddr()\n");
-		fprintf(stderr, "Call dirFileEntryExists() beforehand to ensure file existence\n");
-		fprintf(stderr, "Exit\n");
-		exit(1);
+		*fs->aioQueueTail = aio->queued;
+		fs->aioQueueTail = aio->queuedTail;
+		pthread_cond_broadcast(&fs->aioWork);
 	}
+	pthread_mutex_unlock(&fs->aioLock);
 
-	return entryAddr;
+	aio->queued = NULL;
+	aio->queuedTail = &aio->queued;
+	aio->queuedCount = 0;
 }
 
 /**
- * Returns a string containing a listing of the contents of a
- * directory. 
+ * Waits for the submitted requests of a batch to complete
  *
- * @param  dirPath     The absolute path of the directory
- * @return             A string containing the directory listing
+ * @param aio The batch
  */
-char *getDirectoryListing(char *dirPath)
+void waitAsyncBatch(BC_AIO *aio)
 {
-	char *listing;
-	char *dir = (char*) calloc(FILE_NAME_MAX, sizeof(char));
-	u_int clusterAddr;
-	DirEntry *entry;
+	BC_FS *fs = aio->fs;
 
-	if(strcmp_igncase(dirPath, "root") == 0)
-	{
-		clusterAddr = bootRecord->rootDirStart;
-	}
-	else if(strchr(dirPath, '/') != NULL)
+	pthread_mutex_lock(&fs->aioLock);
+	while(aio->pending)
 	{
-		clusterAddr = bootRecord->rootDirStart;
-		char **path = chop(dirPath, '/');
-		char **p = path;
-		int i = 0;
-		while(p[i] != NULL && p[i+1] != NULL)
+		if(fs->aioMode == AIO_MODE_URING && !fs->aioRing.reaping)
 		{
-			clusterAddr = getDirectoryClusterAddress(clusterAddr, p[i]);
-			if(clusterAddr == 0)
+			reapAsyncRing(fs);
+			if(!aio->pending)
 				break;
-			i++;
+
+			/* Block in the kernel for a completion, letting other 
+			   threads submit meanwhile */
+			fs->aioRing.reaping = 1;
+			pthread_mutex_unlock(&fs->aioLock);
+#ifdef __NR_io_uring_enter
+			syscall(__NR_io_uring_enter, fs->aioRing.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+#endif
+			pthread_mutex_lock(&fs->aioLock);
+			fs->aioRing.reaping = 0;
+			reapAsyncRing(fs);
+			pthread_cond_broadcast(&fs->aioDone);
 		}
-		strcpy(dir, p[i]);
-		if(clusterAddr)
-			clusterAddr = getDirectoryClusterAddress(clusterAddr, dir);
-	}
-	else
-	{
-		strcpy(dir, dirPath);
-		clusterAddr = getDirectoryClusterAddress(bootRecord->rootDirStart, dir);
+		else
+			pthread_cond_wait(&fs->aioDone, &fs->aioLock);
 	}
+	pthread_mutex_unlock(&fs->aioLock);
 
+	if(aio->error)
+		fprintf(stderr, "Error transferring file data: %s\n", strerror(aio->error));
+}
 
-	if(clusterAddr == 0)
+/**
+ * Carries out the requests of a batch made by a synchronous read or 
+ * write and waits for them. A batch holding a single request is carried
+ * out by the calling thread, as a round trip through the engine gains 
+ * nothing for it.
+ *
+ * @param  aio The batch
+ * @return     The number of bytes transferred, or 0 if any request of
+ *             the batch failed or was cut short
+ */
+u_int finishAsyncBatch(BC_AIO *aio)
+{
+	if(aio->queuedCount == 1 && !aio->pending)
 	{
-		/* Directory not found */
-		listing = calloc(25, sizeof(char));
-		strcpy(listing, "Directory not found\n");
+		AsyncOp *op = aio->queued;
+		aio->queued = NULL;
+		aio->queuedTail = &aio->queued;
+		aio->queuedCount = 0;
+		aio->pending = 1;
+		completeAsyncOp(op, runAsyncOp(aio->fs, op));
+		if(aio->error)
+			fprintf(stderr, "Error transferring file data: %s\n", strerror(aio->error));
 	}
 	else
 	{
-		int end = 0;
-		u_int count = 0;
-		u_int entryAddr = 0;
-		u_int currentCluster = clusterAddr;
+		submitAsyncBatch(aio);
+		waitAsyncBatch(aio);
+	}
 
-		/* Determine the number of files/directories in the directory */
-		while(!end)
+	return aio->error ? 0 : aio->transferred;
+}
+
+/**
+ * Places a list of requests on the submission queue of the io_uring 
+ * ring and submits them. The caller must hold aioLock.
+ *
+ * @param fs The file system
+ * @param op The first request of the list
+ */
+void submitAsyncRing(BC_FS *fs, AsyncOp *op)
+{
+#ifdef __NR_io_uring_setup
+	AsyncRing *ring = &fs->aioRing;
+	u_int tail = *ring->sqTail;
+	u_int toSubmit = 0;
+
+	while(op)
+	{
+		if(tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->entries)
 		{
-			entry = getDirEntry(clusterAddr, entryAddr);
-			entryAddr++;
-			if(entry->attr & 0x01)
-				count++;
-			if(entryAddr % DIR_ENTRIES_PER_CLUSTER == 0)
-			{
-				currentCluster = fileAllocTable[currentCluster];
-				if(currentCluster == 0xffffffff) /* No more entries to check */
-					end = 1;
-			}
-			free(entry);
+			enterAsyncRing(fs, toSubmit);
+			toSubmit = 0;
+			tail = *ring->sqTail;
+			continue;
 		}
 
-		/* Allocate space for the listing string */
-		listing = calloc(100 * (count + 3), sizeof(char));
-		strcpy(listing, "    File Name          | File Size |  Date/Time Created  |  Date/Time Modified | Start Cluster \n");
-		strcat(listing, "  ==============================================================================================\n");
+		AsyncOp *next = op->next;
+		u_int index = tail & ring->sqMask;
+		struct io_uring_sqe *sqe = (struct io_uring_sqe*) ring->sqes + index;
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = fileno(fs->virDrive);
+		sqe->addr = (uintptr_t) op->vec;
+		sqe->len = op->iovcnt;
+		sqe->off = op->loc;
+		sqe->user_data = (uintptr_t) op;
+		ring->sqArray[index] = index;
+		tail++;
+		__atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+		toSubmit++;
+		op = next;
+	}
+	if(toSubmit)
+		enterAsyncRing(fs, toSubmit);
+#endif
+}
 
-		/* Reset iteration variables */
+/**
+ * Submits the requests placed on the submission queue of the io_uring 
+ * ring. If the kernel refuses them for good, the requests it has not
+ * taken are carried out by the calling thread. The caller must hold
+ * aioLock.
+ *
+ * @param fs       The file system
+ * @param toSubmit The number of requests placed on the queue
+ */
+void enterAsyncRing(BC_FS *fs, u_int toSubmit)
+{
+#ifdef __NR_io_uring_enter
+	AsyncRing *ring = &fs->aioRing;
+
+	while(toSubmit > 0)
+	{
+		int ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 0, 0, NULL, 0);
+		if(ret > 0)
+		{
+			toSubmit -= ret;
+			continue;
+		}
+		if(ret < 0 && errno == EINTR)
+			continue;
+		if(ret < 0 && (errno == EAGAIN || errno == EBUSY))
+		{
+			/* Make room by taking the completions waiting in the ring */
+			if(!ring->reaping)
+				reapAsyncRing(fs);
+			else
+				pthread_cond_wait(&fs->aioDone, &fs->aioLock);
+			continue;
+		}
+
+		fprintf(stderr, "Could not submit async I/O: %s\n", strerror(errno));
+		u_int head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+		u_int tail = *ring->sqTail;
+		while(head != tail)
+		{
+			struct io_uring_sqe *sqe = (struct io_uring_sqe*) ring->sqes + (head & ring->sqMask);
+			AsyncOp *op = (AsyncOp*) (uintptr_t) sqe->user_data;
+			completeAsyncOp(op, runAsyncOp(fs, op));
+			head++;
+		}
+		__atomic_store_n(ring->sqTail, *ring->sqHead, __ATOMIC_RELEASE);
+		pthread_cond_broadcast(&fs->aioDone);
+		break;
+	}
+#endif
+}
+
+/**
+ * Completes the requests whose results are waiting on the completion 
+ * queue of the io_uring ring. The caller must hold aioLock.
+ *
+ * @param fs The file system
+ */
+void reapAsyncRing(BC_FS *fs)
+{
+#ifdef __NR_io_uring_setup
+	AsyncRing *ring = &fs->aioRing;
+	u_int head = *ring->cqHead;
+	u_int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+
+	while(head != tail)
+	{
+		struct io_uring_cqe *cqe = (struct io_uring_cqe*) ring->cqes + (head & ring->cqMask);
+		completeAsyncOp((AsyncOp*) (uintptr_t) cqe->user_data, cqe->res);
+		head++;
+	}
+	__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+#endif
+}
+
+/**
+ * Carries out a drive request in the calling thread
+ *
+ * @param  fs The file system
+ * @param  op The request
+ * @return    The number of bytes transferred, or a negated errno value
+ */
+int runAsyncOp(BC_FS *fs, AsyncOp *op)
+{
+	ssize_t res;
+
+	if(op->write)
+		res = pwritev(fileno(fs->virDrive), op->vec, op->iovcnt, op->loc);
+	else
+		res = preadv(fileno(fs->virDrive), op->vec, op->iovcnt, op->loc);
+
+	return res < 0 ? -errno : res;
+}
+
+/**
+ * Records the result of a drive request in its batch and frees the 
+ * request. A request which transferred fewer bytes than it asked for
+ * marks the batch as failed with EIO. The caller must hold aioLock if
+ * the batch was submitted to the engine.
+ *
+ * @param op  The request
+ * @param res The number of bytes transferred, or a negated errno value
+ */
+void completeAsyncOp(AsyncOp *op, int res)
+{
+	BC_AIO *aio = op->aio;
+
+	if(res < 0)
+	{
+		if(!aio->error)
+			aio->error = -res;
+	}
+	else
+	{
+		aio->transferred += res;
+		if((u_int) res < op->len && !aio->error)
+			aio->error = EIO;
+	}
+	aio->pending--;
+	free(op);
+}
+
+/** 
+ * ======================================================================== 
+ * |                     Cluster Cache Operations                         | 
+ * ======================================================================== 
+ * 
+ *     This section holds the operations of the cluster cache which sits
+ *     between the file system and the drive file in DRIVE_MODE_STDIO.
+ *     The cache holds a fixed number of slots, each holding the contents
+ *     of one cluster. The slots are kept in a doubly linked list ordered
+ *     from most recently used (head) to least recently used (tail). When
+ *     a cluster which is not cached is accessed, the least recently used
+ *     slot is evicted and reused. Writes only modify the cached copy and
+ *     mark the slot dirty; a dirty slot is written back to the drive 
+ *     file when it is evicted or when the cache is flushed.
+ *
+ *     The cluster cache index holds, for every cluster on the drive, 
+ *     the index of the slot caching it plus one, or 0 if the cluster 
+ *     is not cached.
+ *
+ *     The cache is guarded by cacheLock, which is taken by 
+ *     readVirDrive(), writeVirDrive(), flushClusterCache() and 
+ *     zeroCacheSlot(). The other operations of the cache expect the 
+ *     caller to hold it.
+ */
+
+/**
+ * Initializes the cluster cache with the given number of slots. The
+ * cache is left disabled if the number of slots is 0 or if the drive
+ * is in DRIVE_MODE_MMAP.
+ *
+ * @param fs    The file system
+ * @param slots The number of clusters the cache can hold
+ */
+void initClusterCache(BC_FS *fs, u_int slots)
+{
+	u_int i;
+
+	fs->clusterCacheSlots = 0;
+	if(slots == 0 || fs->virDriveMode == DRIVE_MODE_MMAP)
+		return;
+
+	fs->clusterCache = calloc(slots, sizeof(*fs->clusterCache));
+	fs->clusterCacheIndex = calloc(fs->bootRecord->clustersOnDrive, sizeof(u_int));
+	char *data = calloc(slots, fs->bootRecord->bytesPerCluster);
+	if(!fs->clusterCache || !fs->clusterCacheIndex || !data)
+	{
+		fprintf(stderr, "Error allocating space for the cluster cache\n");
+		free(fs->clusterCache);
+		free(fs->clusterCacheIndex);
+		free(data);
+		return;
+	}
+
+	for(i = 0; i < slots; i++)
+	{
+		fs->clusterCache[i].clusterAddr = 0xffffffff;
+		fs->clusterCache[i].dirty = 0;
+		fs->clusterCache[i].prev = i - 1;
+		fs->clusterCache[i].next = i + 1;
+		fs->clusterCache[i].data = data + i * fs->bootRecord->bytesPerCluster;
+	}
+	fs->clusterCache[0].prev = 0xffffffff;
+	fs->clusterCache[slots - 1].next = 0xffffffff;
+	fs->clusterCacheHead = 0;
+	fs->clusterCacheTail = slots - 1;
+	fs->clusterCacheSlots = slots;
+}
+
+/**
+ * Writes back all dirty clusters and frees the cluster cache
+ *
+ * @param fs The file system
+ */
+void destroyClusterCache(BC_FS *fs)
+{
+	if(fs->clusterCacheSlots)
+	{
+		flushClusterCache(fs);
+		free(fs->clusterCache[0].data);
+		free(fs->clusterCache);
+		free(fs->clusterCacheIndex);
+		fs->clusterCache = NULL;
+		fs->clusterCacheIndex = NULL;
+		fs->clusterCacheSlots = 0;
+	}
+}
+
+/**
+ * Writes back all dirty clusters of the cluster cache to the drive file
+ *
+ * @param fs The file system
+ */
+void flushClusterCache(BC_FS *fs)
+{
+	u_int i;
+
+	pthread_mutex_lock(&fs->cacheLock);
+	for(i = 0; i < fs->clusterCacheSlots; i++)
+		writeBackCacheSlot(fs, &fs->clusterCache[i]);
+	pthread_mutex_unlock(&fs->cacheLock);
+}
+
+/**
+ * Returns the cache slot holding the given cluster. If the cluster is
+ * not cached, the least recently used slot is evicted (written back if
+ * dirty) and reused for the cluster. The returned slot becomes the most
+ * recently used slot.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The address of the cluster
+ * @param  load        1 to read the cluster from the drive file if it is
+ *                     not cached, 0 if the caller will overwrite the
+ *                     whole cluster
+ * @return             The cache slot holding the cluster
+ */
+CacheSlot *getCacheSlot(BC_FS *fs, u_int clusterAddr, int load)
+{
+	u_int slotIndex;
+	CacheSlot *slot;
+
+	if(fs->clusterCacheIndex[clusterAddr])
+	{
+		slotIndex = fs->clusterCacheIndex[clusterAddr] - 1;
+		touchCacheSlot(fs, slotIndex);
+		return &fs->clusterCache[slotIndex];
+	}
+
+	/* Evict the least recently used slot */
+	slotIndex = fs->clusterCacheTail;
+	slot = &fs->clusterCache[slotIndex];
+	if(slot->clusterAddr != 0xffffffff)
+	{
+		writeBackCacheSlot(fs, slot);
+		fs->clusterCacheIndex[slot->clusterAddr] = 0;
+	}
+
+	slot->clusterAddr = clusterAddr;
+	if(load)
+		readVirDriveDirect(fs, slot->data, getClusterLoc(fs, clusterAddr), fs->bootRecord->bytesPerCluster);
+	fs->clusterCacheIndex[clusterAddr] = slotIndex + 1;
+	touchCacheSlot(fs, slotIndex);
+
+	return slot;
+}
+
+/**
+ * Writes a cache slot back to the drive file if it is dirty
+ *
+ * @param fs   The file system
+ * @param slot The cache slot to write back
+ */
+void writeBackCacheSlot(BC_FS *fs, CacheSlot *slot)
+{
+	if(slot->dirty)
+	{
+		writeVirDriveDirect(fs, slot->data, getClusterLoc(fs, slot->clusterAddr), fs->bootRecord->bytesPerCluster);
+		slot->dirty = 0;
+	}
+}
+
+/**
+ * Zeroes the cached copy of a cluster, if the cluster is cached, after
+ * the cluster has been zeroed on the drive file. The slot is left 
+ * clean, as it matches the drive file.
+ *
+ * @param fs          The file system
+ * @param clusterAddr The address of the cluster
+ */
+void zeroCacheSlot(BC_FS *fs, u_int clusterAddr)
+{
+	if(!fs->clusterCacheSlots)
+		return;
+
+	pthread_mutex_lock(&fs->cacheLock);
+	if(fs->clusterCacheIndex[clusterAddr])
+	{
+		CacheSlot *slot = &fs->clusterCache[fs->clusterCacheIndex[clusterAddr] - 1];
+		memset(slot->data, 0x00, fs->bootRecord->bytesPerCluster);
+		slot->dirty = 0;
+	}
+	pthread_mutex_unlock(&fs->cacheLock);
+}
+
+/**
+ * Moves a cache slot to the head (most recently used end) of the
+ * cache's LRU list
+ *
+ * @param fs        The file system
+ * @param slotIndex The index of the slot
+ */
+void touchCacheSlot(BC_FS *fs, u_int slotIndex)
+{
+	CacheSlot *slot = &fs->clusterCache[slotIndex];
+
+	if(slotIndex == fs->clusterCacheHead)
+		return;
+
+	/* Unlink the slot */
+	fs->clusterCache[slot->prev].next = slot->next;
+	if(slot->next != 0xffffffff)
+		fs->clusterCache[slot->next].prev = slot->prev;
+	else
+		fs->clusterCacheTail = slot->prev;
+
+	/* Relink the slot at the head */
+	slot->prev = 0xffffffff;
+	slot->next = fs->clusterCacheHead;
+	fs->clusterCache[fs->clusterCacheHead].prev = slotIndex;
+	fs->clusterCacheHead = slotIndex;
+}
+
+/** 
+ * ======================================================================== 
+ * |                    Boot Record Operations                            | 
+ * ======================================================================== 
+ * 
+ *     This section holds all of the operations which can be performed on 
+ *     the boot record of the virtual drive. The boot cluster will have 
+ *     a size of one cluster. The layout of the data contained 
+ *     in the boot record/cluster is as follows:
+ *     
+ *        (bytes) | property 
+ *       ---------------------------------------------------------------
+ *        (0)      | A byte designating the virtual drive as initialized
+ *        (1-24)   | A label for the virtual drive
+ *        (25-27)  | Padding
+ *        (28-31)  | The number of bytes per cluster
+ *        (32-35)  | The number of reserved clusters
+ *        (36-39)  | The number of clusters on the virtual drive
+ *        (40-43)  | The number of clusters per file allocation table
+ *        (44-47)  | The first cluster of the root directory
+ *        (48-51)  | The number of free clusters
+ *        (52-55)  | The next free cluster
+ *        (56-59)  | The size of the virtual drive in bytes (0xffffffff 
+ *                   if the size does not fit in 32 bits)
+ *        (60-63)  | The version of the boot record
+ *        (64-71)  | The 64 bit size of the virtual drive in bytes
+ *        (72-511) | This space is unused
+ *
+ *     Drives formatted before version 2 of the boot record have zeroes
+ *     in bytes 60-71; their 64 bit size is taken from the 32 bit size
+ *     when the boot record is read. Byte offsets on the drive are 64 
+ *     bit (off_t) throughout, so a version 2 drive may be larger than 
+ *     4 GiB. Cluster addresses and FAT entries remain 32 bit, which
+ *     allows up to 2 TiB with 512 byte clusters (and 256 TiB with 64 KB
+ *     clusters).
+ *
+ *     The boot record will be represented in the file system application 
+ *     as a struct containing all of the properties listed above. 
+ */
+
+
+/**
+ * Initializes a boot record struct for the virtual drive.
+ * NOTE: This function does not write the boot record struct to
+ * the virtual drive.
+ *
+ * @param  fs          The file system
+ * @param  driveLabel  A string containing the label for the drive
+ * @param  clusterSize The number of bytes per cluster (0 for CLUSTER_SIZE)
+ * @return             An pointer to an initialized boot record struct
+ */
+BootRecord *initBootRecord(BC_FS *fs, char *driveLabel, u_int clusterSize)
+{
+	BootRecord *boot = calloc(1, sizeof(*boot));
+
+	/* Get size of the drive in bytes */
+	struct stat st;
+	uint64_t dSize = 0;
+	if(fstat(fileno(fs->virDrive), &st) == 0)
+		dSize = st.st_size;
+
+	/* Cluster addresses must fit in a FAT entry below 0xffffffff */
+	if(clusterSize == 0)
+		clusterSize = CLUSTER_SIZE;
+	if(clusterSize < CLUSTER_SIZE_MIN || clusterSize > CLUSTER_SIZE_MAX || (clusterSize & (clusterSize - 1)))
+	{
+		fprintf(stderr, "Invalid cluster size of %u bytes, ", clusterSize);
+		fprintf(stderr, "using %d bytes\n", CLUSTER_SIZE);
+		clusterSize = CLUSTER_SIZE;
+	}
+
+	uint64_t clusters = dSize / clusterSize;
+	if(clusters > 0xfffffffe)
+		clusters = 0xfffffffe;
+
+	boot->init = 1;
+	strncpy(boot->label, driveLabel, DRIVE_LABEL_MAX);
+	boot->bytesPerCluster = clusterSize;
+	boot->reservedClusters = 1;
+	boot->clustersOnDrive = clusters;
+	boot->clustersPerFat = ceil((double) boot->clustersOnDrive * FAT_ENTRY_BYTES / clusterSize);
+	boot->rootDirStart = boot->clustersPerFat + 1;
+	boot->freeClusters = boot->clustersOnDrive - (boot->clustersPerFat + 2);
+	boot->nextFreeCluster = boot->clustersPerFat + 2;
+	boot->driveSize = dSize > 0xffffffff ? 0xffffffff : dSize;
+	boot->version = BOOT_RECORD_VERSION;
+	boot->driveSize64 = dSize;
+
+	return boot;
+}
+
+/**
+ * Writes the boot record struct of the file system to the virtual drive
+ *
+ * @param fs The file system
+ */
+void writeBootRecord(BC_FS *fs)
+{
+	pthread_mutex_lock(&fs->fatLock);
+	writeVirDrive(fs, fs->bootRecord, 0, sizeof(BootRecord));
+	pthread_mutex_unlock(&fs->fatLock);
+}
+
+/**
+ * Reads the boot record from the drive and stores it in the
+ * boot record struct of the file system
+ *
+ * @param fs The file system
+ */
+void readBootRecord(BC_FS *fs)
+{
+	readVirDrive(fs, fs->bootRecord, 0, sizeof(BootRecord));
+	if(fs->bootRecord->version < 2)
+		fs->bootRecord->driveSize64 = fs->bootRecord->driveSize;
+}
+
+/** 
+ * ======================================================================== 
+ * |               File Allocation Table Operations                       | 
+ * ======================================================================== 
+ *
+ *     This section holds all of the operations that can be performed on
+ *     the file allocation table clusters on the virtual drive. Each 
+ *     file allocation table entry will consist of 4 bytes. This will
+ *     allow for 128 entries per cluster. Each file allocation table
+ *     entry can hold one of three types of values:
+ *     
+ *       - The address of the next cluster in the chain
+ *       - The end of chain identifier 0xffffffff
+ *       - The empty cluster identifier 0x0
+ *       
+ *     File allocation table cluster addresses (clusterAddr) refer to the 
+ *     position of the cluster on disk. The cluster addresses are defined 
+ *     as follows:
+ *     
+ *       -   0: The boot cluster
+ *       -   1: The first cluster of the file allocation table
+ *       -   2: The second cluster of the file allocation table
+ *         ...
+ *       -   n: The last cluster of the file allocation table
+ *              Note: n = (((drive size / cluster size) * entry size) / cluster size) + 1
+ *       - n+1: The root directory cluster
+ *       - n+2: The first cluster of the data region
+ *         ...
+ *       -   x: The last cluster of the data region
+ *              Note: x = (drive size / cluster size) - 1
+ *
+ *     Alongside the file allocation table, an in-memory free cluster map
+ *     holds one bit per cluster on the drive, set if the cluster is free,
+ *     and a count of the free entries in each cluster of the table is 
+ *     kept. Both are built in one pass when the table is read, which also
+ *     checks the free cluster count of the boot record, and are kept up 
+ *     to date by setFATEntry(), which must be used for every change to 
+ *     the table other than linking reserved clusters (see below). Searches skip the clusters covered by a cluster of the 
+ *     table with no free entries.
+ *     Free clusters are located a 64-bit word of the map at a time, 
+ *     starting from the next free cluster hint in the boot record, which
+ *     rotates forward through the data region as clusters are allocated.
+ *
+ *     When a chain is extended by several clusters at once, the clusters
+ *     are taken as a run of physically contiguous free clusters where
+ *     possible, so that the file's data can be transferred with a single
+ *     large read or write instead of one per cluster.
+ *
+ *     The clusters of the file allocation table which hold entries that
+ *     have changed since the table was last written are marked dirty by
+ *     setFATEntry(). Only the dirty clusters are written by writeFAT().
+ *
+ *     The table, the maps and the counters of the boot record are 
+ *     guarded by the recursive fatLock, which is taken by setFATEntry()
+ *     and by each operation which searches the free cluster map and then
+ *     allocates, so a search and the allocation it finds are atomic.
+ *
+ *     To keep writers of different files from contending on fatLock, 
+ *     the data clusters of an open file are taken from a run of free 
+ *     clusters reserved for the file by reserveClusters(). A reserved 
+ *     cluster is cleared from the free cluster map and counted as used,
+ *     but its entry stays 0 until linkReservedClusters() links it onto
+ *     the file's chain. The entries of reserved clusters belong to the
+ *     file holding the reservation, so they are set without fatLock, 
+ *     with atomic stores, and the dirty marks of the table are atomic.
+ *     Reserved clusters which are not used are returned to the map by
+ *     unreserveClusters() when the file is closed or the file system 
+ *     is synced. The table on the drive never holds a reservation, so 
+ *     a drive which is not closed cleanly loses none.
+ *
+ *     With DRIVE_LAZY_ZERO, deleting a file only frees its FAT entries
+ *     and marks its clusters in the pending zero map. A marked cluster
+ *     is zeroed when it is allocated again, or by reclaimClusters(), 
+ *     which punches holes in the drive file over runs of marked 
+ *     clusters. Clusters are zeroed without fatLock held: the cluster
+ *     being allocated, or the run being reclaimed, is first taken out 
+ *     of the free cluster map so that no other thread can take it. 
+ *     With DRIVE_BACKGROUND_RECLAIM a thread started at mount calls 
+ *     reclaimClusters() every RECLAIM_INTERVAL_MS, RECLAIM_BATCH 
+ *     clusters at a time. Every marked cluster is reclaimed when the 
+ *     file system is synced, so the drive file never holds the data of
+ *     a deleted file once it is closed.
+ */
+
+/**
+ * Initializes the file allocation table clusters of a virtual drive.
+ * Must only be called on a freshly formatted drive.
+ *
+ * @param fs The file system
+ */
+u_int *initFATClusters(BC_FS *fs)
+{
+	u_int i;
+	u_int n = fs->bootRecord->clustersPerFat;
+	u_int *fat = (u_int*) calloc(sizeof(u_int), fs->bootRecord->clustersOnDrive);
+
+	/* The drive has just been zeroed, so only the clusters of the table
+	   holding the entries set below need to be written */
+	free(fs->fatClusterDirty);
+	fs->fatClusterDirty = calloc(fs->bootRecord->clustersPerFat, sizeof(char));
+	u_int entriesPerCluster = fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES;
+	for(i = 0; i <= fs->bootRecord->rootDirStart / entriesPerCluster; i++)
+		fs->fatClusterDirty[i] = 1;
+	
+	/* Boot Cluster */
+	fat[0] = 0xffffffff;
+	/* FAT Clusters */
+	for(i = 1; i < n; i++)
+		fat[i] = i + 1;
+	fat[n] = 0xffffffff;
+	/* Root Dir Cluster */
+	fat[fs->bootRecord->rootDirStart] = 0xffffffff;
+
+	return fat;
+}
+
+/**
+ * Writes the dirty clusters of the file allocation table to the virtual
+ * drive. Runs of consecutive dirty clusters are written with one write.
+ *
+ * @param fs The file system
+ */
+void writeFAT(BC_FS *fs)
+{
+	u_int i = 0;
+	size_t j;
+	size_t tableBytes = sizeof(u_int) * (size_t) fs->bootRecord->clustersOnDrive;
+	u_int clusterSize = fs->bootRecord->bytesPerCluster;
+	off_t loc = getClusterLoc(fs, fs->bootRecord->reservedClusters);
+
+	pthread_mutex_lock(&fs->fatLock);
+	while(i < fs->bootRecord->clustersPerFat)
+	{
+		if(!__atomic_load_n(&fs->fatClusterDirty[i], __ATOMIC_SEQ_CST))
+		{
+			i++;
+			continue;
+		}
+
+		u_int first = i;
+		while(i < fs->bootRecord->clustersPerFat && __atomic_load_n(&fs->fatClusterDirty[i], __ATOMIC_SEQ_CST))
+			__atomic_store_n(&fs->fatClusterDirty[i++], 0, __ATOMIC_SEQ_CST);
+
+		/* The last cluster of the table may only be partly used */
+		size_t start = (size_t) first * clusterSize;
+		size_t end = (size_t) i * clusterSize;
+		if(end > tableBytes)
+			end = tableBytes;
+
+		/* Entries of reserved clusters are linked without fatLock, so
+		   the entries are copied out with atomic loads */
+		u_int *entries = malloc(end - start);
+		for(j = 0; j < (end - start) / FAT_ENTRY_BYTES; j++)
+			entries[j] = __atomic_load_n(&fs->fileAllocTable[start / FAT_ENTRY_BYTES + j], __ATOMIC_SEQ_CST);
+		writeVirDrive(fs, entries, loc + start, end - start);
+		free(entries);
+	}
+	pthread_mutex_unlock(&fs->fatLock);
+}
+
+/**
+ * Reads the file allocation table from the virtual drive and builds
+ * the free cluster map, checking the boot record against it
+ *
+ * @param fs The file system
+ */
+void readFAT(BC_FS *fs)
+{
+	off_t loc = getClusterLoc(fs, fs->bootRecord->reservedClusters);
+	readVirDrive(fs, fs->fileAllocTable, loc, sizeof(u_int) * fs->bootRecord->clustersOnDrive);
+	free(fs->fatClusterDirty);
+	fs->fatClusterDirty = calloc(fs->bootRecord->clustersPerFat, sizeof(char));
+	buildFreeClusterMap(fs);
+}
+
+/**
+ * Adds a cluster to the end of a cluster chain. The cluster address 
+ * that is passed in must be the ending cluster of the chain.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The cluster address of the entry that is being extended
+ * @return             The new end of chain cluster address, or 0 if the
+ *                     drive is full
+ */
+u_int addClusterToChain(BC_FS *fs, u_int clusterAddr)
+{
+	u_int next = allocateCluster(fs);
+	if(next)
+		setFATEntry(fs, clusterAddr, next);
+
+	return next;
+}
+
+/**
+ * Locates the next free cluster at or after the current next free 
+ * cluster hint and stores the address in the boot cluster of the drive.
+ * The hint is set to 0 if the drive is full.
+ *
+ * @param fs The file system
+ */
+void findAndSetNextFreeCluster(BC_FS *fs)
+{
+	fs->bootRecord->nextFreeCluster = findFreeCluster(fs, fs->bootRecord->nextFreeCluster);
+}
+
+/**
+ * Sets an entry of the file allocation table, keeping the free cluster
+ * map, the free cluster counts of the FAT clusters and the free cluster
+ * count of the boot record in step. A cluster of a deleted file which
+ * is allocated again is no longer waiting to be zeroed; the caller 
+ * zeroes it (see zeroClusters()) once it has released fatLock.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The address of the cluster whose entry is set
+ * @param  value       The new value of the entry
+ * @return             1 if the cluster was allocated and must be zeroed
+ *                     by the caller, otherwise 0
+ */
+int setFATEntry(BC_FS *fs, u_int clusterAddr, u_int value)
+{
+	int zero = 0;
+	uint64_t bit = 1ULL << (clusterAddr % 64);
+	u_int fatCluster = clusterAddr / (fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES);
+
+	pthread_mutex_lock(&fs->fatLock);
+	u_int old = fs->fileAllocTable[clusterAddr];
+	__atomic_store_n(&fs->fileAllocTable[clusterAddr], value, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&fs->fatClusterDirty[fatCluster], 1, __ATOMIC_SEQ_CST);
+	if(old == 0x0 && value != 0x0)
+	{
+		fs->freeClusterMap[clusterAddr / 64] &= ~bit;
+		fs->fatClusterFree[fatCluster]--;
+		fs->bootRecord->freeClusters--;
+
+		/* A reallocated cluster of a deleted file is zeroed first */
+		if(fs->pendingZeroMap[clusterAddr / 64] & bit)
+		{
+			fs->pendingZeroMap[clusterAddr / 64] &= ~bit;
+			fs->pendingZeroCount--;
+			zero = 1;
+		}
+	}
+	else if(old != 0x0 && value == 0x0)
+	{
+		fs->freeClusterMap[clusterAddr / 64] |= bit;
+		fs->fatClusterFree[fatCluster]++;
+		fs->bootRecord->freeClusters++;
+	}
+	pthread_mutex_unlock(&fs->fatLock);
+
+	return zero;
+}
+
+/**
+ * Extends a cluster chain by a number of clusters. The clusters are 
+ * taken from the first run of contiguous free clusters long enough to
+ * hold all of them; if there is none, the longest runs available are 
+ * chained one after the other. If fewer clusters than requested are
+ * free, the chain is extended by the clusters that are free. The 
+ * cluster address that is passed in must be the ending cluster of the 
+ * chain.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The cluster address of the entry that is being extended
+ * @param  count       The number of clusters to add to the chain
+ * @return             The address of the first cluster added, or 0 if the
+ *                     drive is full
+ */
+u_int extendClusterChain(BC_FS *fs, u_int clusterAddr, u_int count)
+{
+	u_int i;
+	u_int first = 0;
+	u_int runStart;
+	u_int run;
+
+	pthread_mutex_lock(&fs->fatLock);
+	if(count > fs->bootRecord->freeClusters)
+		count = fs->bootRecord->freeClusters;
+
+	while(count > 0)
+	{
+		run = findFreeRun(fs, count, &runStart);
+		if(run == 0)
+			break;
+
+		/* Chain the run in order and link it onto the end of the chain,
+		   noting the span of it which must be zeroed */
+		u_int zeroStart = 0;
+		u_int zeroEnd = 0;
+		for(i = 0; i < run; i++)
+		{
+			if(setFATEntry(fs, runStart + i, i < run - 1 ? runStart + i + 1 : 0xffffffff))
+			{
+				if(!zeroEnd)
+					zeroStart = runStart + i;
+				zeroEnd = runStart + i + 1;
+			}
+		}
+		setFATEntry(fs, clusterAddr, runStart);
+
+		if(!first)
+			first = runStart;
+		clusterAddr = runStart + run - 1;
+		count -= run;
+
+		if(zeroEnd)
+		{
+			pthread_mutex_unlock(&fs->fatLock);
+			zeroClusters(fs, zeroStart, zeroEnd - zeroStart);
+			pthread_mutex_lock(&fs->fatLock);
+		}
+	}
+
+	if(!first)
+	{
+		pthread_mutex_unlock(&fs->fatLock);
+		fprintf(stderr, "FAT is full\n");
+		return 0;
+	}
+
+	fs->bootRecord->nextFreeCluster = clusterAddr;
+	findAndSetNextFreeCluster(fs);
+	pthread_mutex_unlock(&fs->fatLock);
+
+	return first;
+}
+
+/**
+ * Reserves a run of free clusters for an open file. The run is the 
+ * first run of at least the given length, or the longest run if there
+ * is none. Its clusters are cleared from the free cluster map and 
+ * counted as used, but their entries are left at 0 for 
+ * linkReservedClusters(). Any which are waiting to be zeroed are 
+ * zeroed once fatLock is released, as the run is then the caller's.
+ *
+ * @param  fs       The file system
+ * @param  count    The desired number of clusters
+ * @param  runStart Set to the cluster address of the start of the run
+ * @return          The number of clusters reserved, or 0 if the drive 
+ *                  is full
+ */
+u_int reserveClusters(BC_FS *fs, u_int count, u_int *runStart)
+{
+	u_int i;
+	u_int entriesPerCluster = fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES;
+
+	u_int zeroStart = 0;
+	u_int zeroEnd = 0;
+
+	pthread_mutex_lock(&fs->fatLock);
+	u_int run = findFreeRun(fs, count, runStart);
+	for(i = *runStart; i < *runStart + run; i++)
+	{
+		uint64_t bit = 1ULL << (i % 64);
+		fs->freeClusterMap[i / 64] &= ~bit;
+		fs->fatClusterFree[i / entriesPerCluster]--;
+		if(fs->pendingZeroMap[i / 64] & bit)
+		{
+			fs->pendingZeroMap[i / 64] &= ~bit;
+			fs->pendingZeroCount--;
+			if(!zeroEnd)
+				zeroStart = i;
+			zeroEnd = i + 1;
+		}
+	}
+	fs->bootRecord->freeClusters -= run;
+	if(run)
+	{
+		fs->bootRecord->nextFreeCluster = *runStart + run - 1;
+		findAndSetNextFreeCluster(fs);
+	}
+	pthread_mutex_unlock(&fs->fatLock);
+
+	/* The span from the first waiting cluster to the last lies in the
+	   run, so it is zeroed whole */
+	if(zeroEnd)
+		zeroClusters(fs, zeroStart, zeroEnd - zeroStart);
+
+	return run;
+}
+
+/**
+ * Returns reserved clusters which were never linked into a chain to 
+ * the free cluster map
+ *
+ * @param fs        The file system
+ * @param startAddr The address of the first cluster to return
+ * @param count     The number of clusters to return
+ */
+void unreserveClusters(BC_FS *fs, u_int startAddr, u_int count)
+{
+	u_int i;
+	u_int entriesPerCluster = fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES;
+
+	pthread_mutex_lock(&fs->fatLock);
+	for(i = startAddr; i < startAddr + count; i++)
+	{
+		fs->freeClusterMap[i / 64] |= 1ULL << (i % 64);
+		fs->fatClusterFree[i / entriesPerCluster]++;
+	}
+	fs->bootRecord->freeClusters += count;
+	pthread_mutex_unlock(&fs->fatLock);
+}
+
+/**
+ * Links a run of reserved clusters, in order, onto the end of a 
+ * cluster chain without taking fatLock. The cluster address that is 
+ * passed in must be the ending cluster of the chain when the caller 
+ * looked, and the run must belong to the caller. The run is linked 
+ * with a compare and swap on the ending entry, so if another handle on
+ * the same file has extended the chain in the meantime the run is not
+ * linked and its entries are put back to 0.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The cluster address of the entry that is being extended
+ * @param  startAddr   The address of the first cluster of the run
+ * @param  count       The number of clusters in the run
+ * @return             1 if the run was linked, 0 if the chain had 
+ *                     already been extended
+ */
+int linkReservedClusters(BC_FS *fs, u_int clusterAddr, u_int startAddr, u_int count)
+{
+	u_int endOfChain = 0xffffffff;
+	u_int i;
+	u_int entriesPerCluster = fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES;
+
+	/* Each entry is stored before its cluster of the table is marked 
+	   dirty, so writeFAT() never clears a mark without writing the 
+	   entry */
+	for(i = startAddr; i < startAddr + count; i++)
+	{
+		__atomic_store_n(&fs->fileAllocTable[i], i + 1 < startAddr + count ? i + 1 : 0xffffffff, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&fs->fatClusterDirty[i / entriesPerCluster], 1, __ATOMIC_SEQ_CST);
+	}
+	if(!__atomic_compare_exchange_n(&fs->fileAllocTable[clusterAddr], &endOfChain, startAddr, 0, 
+	                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+	{
+		for(i = startAddr; i < startAddr + count; i++)
+		{
+			__atomic_store_n(&fs->fileAllocTable[i], 0x0, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&fs->fatClusterDirty[i / entriesPerCluster], 1, __ATOMIC_SEQ_CST);
+		}
+		return 0;
+	}
+	__atomic_store_n(&fs->fatClusterDirty[clusterAddr / entriesPerCluster], 1, __ATOMIC_SEQ_CST);
+
+	return 1;
+}
+
+/**
+ * Returns the number of free clusters on the drive. Clusters reserved
+ * by open files are counted as used.
+ *
+ * @param  fs The file system
+ * @return The number of free clusters
+ */
+u_int getFreeClusterCount(BC_FS *fs)
+{
+	return fs->bootRecord->freeClusters;
+}
+
+/**
+ * Returns the number of bytes of free space on the drive
+ *
+ * @param  fs The file system
+ * @return The free space in bytes
+ */
+uint64_t getFreeBytes(BC_FS *fs)
+{
+	return (uint64_t) fs->bootRecord->freeClusters * fs->bootRecord->bytesPerCluster;
+}
+
+/**
+ * Marks a cluster of a deleted file to be zeroed later
+ *
+ * @param fs          The file system
+ * @param clusterAddr The address of the cluster
+ */
+void markClusterForZeroing(BC_FS *fs, u_int clusterAddr)
+{
+	uint64_t bit = 1ULL << (clusterAddr % 64);
+
+	pthread_mutex_lock(&fs->fatLock);
+	if(!(fs->pendingZeroMap[clusterAddr / 64] & bit))
+	{
+		fs->pendingZeroMap[clusterAddr / 64] |= bit;
+		fs->pendingZeroCount++;
+	}
+	pthread_mutex_unlock(&fs->fatLock);
+}
+
+/**
+ * Zeroes clusters of deleted files which are waiting to be zeroed, in
+ * order of cluster address. Each run of waiting clusters is zeroed
+ * with one hole punched in the drive file. This may be called at any 
+ * time, such as when the file system is idle, to spread the zeroing 
+ * out; it is called by the background reclaimer, if there is one, and
+ * for all waiting clusters on sync.
+ *
+ * fatLock is not held while a run is zeroed. The run is taken out of
+ * the free cluster map first, as reserveClusters() does, so it cannot
+ * be allocated until it has been zeroed and is put back. Waiting 
+ * clusters which are not free yet, as their file is still being 
+ * deleted, are left for a later call.
+ *
+ * @param  fs          The file system
+ * @param  maxClusters The most clusters to zero
+ * @return             The number of clusters zeroed
+ */
+u_int reclaimClusters(BC_FS *fs, u_int maxClusters)
+{
+	u_int n = 0;
+	u_int zeroed = 0;
+	u_int words = (fs->bootRecord->clustersOnDrive + 63) / 64;
+	u_int entriesPerCluster = fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES;
+
+	pthread_mutex_lock(&fs->fatLock);
+	while(n < words && zeroed < maxClusters && fs->pendingZeroCount)
+	{
+		uint64_t ready = fs->pendingZeroMap[n] & fs->freeClusterMap[n];
+		if(!ready)
+		{
+			n++;
+			continue;
+		}
+
+		/* Take the run of waiting clusters starting in this word out of
+		   the free cluster map */
+		u_int start = n * 64 + __builtin_ctzll(ready);
+		u_int count = 0;
+		while(zeroed + count < maxClusters && start + count < fs->bootRecord->clustersOnDrive)
+		{
+			u_int i = start + count;
+			uint64_t bit = 1ULL << (i % 64);
+			if(!(fs->pendingZeroMap[i / 64] & fs->freeClusterMap[i / 64] & bit))
+				break;
+			fs->pendingZeroMap[i / 64] &= ~bit;
+			fs->freeClusterMap[i / 64] &= ~bit;
+			fs->fatClusterFree[i / entriesPerCluster]--;
+			count++;
+		}
+		fs->pendingZeroCount -= count;
+		fs->bootRecord->freeClusters -= count;
+		pthread_mutex_unlock(&fs->fatLock);
+
+		zeroClusters(fs, start, count);
+		unreserveClusters(fs, start, count);
+		zeroed += count;
+
+		pthread_mutex_lock(&fs->fatLock);
+	}
+	pthread_mutex_unlock(&fs->fatLock);
+
+	return zeroed;
+}
+
+/**
+ * Zeroes a run of clusters on the drive. Any cached copies of the 
+ * clusters are zeroed first, so that a dirty copy is never written 
+ * back over the run, then a hole is punched in the drive file over the
+ * run where the file system supports it. Otherwise each cluster is 
+ * formatted.
+ *
+ * @param fs        The file system
+ * @param startAddr The address of the first cluster of the run
+ * @param count     The number of clusters in the run
+ */
+void zeroClusters(BC_FS *fs, u_int startAddr, u_int count)
+{
+	u_int i;
+	off_t loc = getClusterLoc(fs, startAddr);
+	off_t len = getClusterLoc(fs, startAddr + count) - loc;
+
+	for(i = 0; i < count; i++)
+		zeroCacheSlot(fs, startAddr + i);
+	if(fallocate(fileno(fs->virDrive), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, loc, len) == 0)
+		return;
+
+	for(i = 0; i < count; i++)
+		formatCluster(fs, startAddr + i);
+}
+
+/**
+ * Starts the background reclaimer of a file system, a thread which 
+ * zeroes the clusters of deleted files while the file system is in use
+ * (see reclaimWorker())
+ *
+ * @param fs The file system
+ */
+void startReclaimer(BC_FS *fs)
+{
+	fs->reclaimStop = 0;
+	if(pthread_create(&fs->reclaimThread, NULL, reclaimWorker, fs) != 0)
+	{
+		fprintf(stderr, "Could not start the background reclaimer, deleted clusters are zeroed on sync\n");
+		return;
+	}
+	fs->reclaimRunning = 1;
+}
+
+/**
+ * Stops the background reclaimer of a file system, if it is running, 
+ * and waits for it to exit. Clusters still waiting to be zeroed are 
+ * left for the next sync.
+ *
+ * @param fs The file system
+ */
+void stopReclaimer(BC_FS *fs)
+{
+	if(!fs->reclaimRunning)
+		return;
+
+	pthread_mutex_lock(&fs->reclaimLock);
+	__atomic_store_n(&fs->reclaimStop, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&fs->reclaimWake);
+	pthread_mutex_unlock(&fs->reclaimLock);
+	pthread_join(fs->reclaimThread, NULL);
+	fs->reclaimRunning = 0;
+}
+
+/**
+ * The body of the background reclaimer. Every RECLAIM_INTERVAL_MS the
+ * thread zeroes the clusters waiting to be zeroed, RECLAIM_BATCH at a 
+ * time, until it is stopped. Allocations only wait for the reclaimer 
+ * while it takes a run out of the free cluster map or puts it back, 
+ * not while the run is zeroed (see reclaimClusters()).
+ *
+ * @param  arg The file system
+ * @return     NULL
+ */
+void *reclaimWorker(void *arg)
+{
+	BC_FS *fs = arg;
+	struct timespec wake;
+
+	pthread_mutex_lock(&fs->reclaimLock);
+	while(!fs->reclaimStop)
+	{
+		clock_gettime(CLOCK_REALTIME, &wake);
+		wake.tv_nsec += RECLAIM_INTERVAL_MS * 1000000L;
+		wake.tv_sec += wake.tv_nsec / 1000000000L;
+		wake.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&fs->reclaimWake, &fs->reclaimLock, &wake);
+		if(fs->reclaimStop)
+			break;
+		pthread_mutex_unlock(&fs->reclaimLock);
+
+		while(reclaimClusters(fs, RECLAIM_BATCH) == RECLAIM_BATCH && 
+		      !__atomic_load_n(&fs->reclaimStop, __ATOMIC_RELAXED))
+			sched_yield();
+
+		pthread_mutex_lock(&fs->reclaimLock);
+	}
+	pthread_mutex_unlock(&fs->reclaimLock);
+
+	return NULL;
+}
+
+/**
+ * Returns the number of contiguous free clusters starting at the given
+ * cluster address, counting no further than the given maximum.
+ *
+ * @param  fs        The file system
+ * @param  startAddr The cluster address of the start of the run
+ * @param  maxCount  The maximum length of the run to count
+ * @return           The number of contiguous free clusters
+ */
+u_int countFreeRun(BC_FS *fs, u_int startAddr, u_int maxCount)
+{
+	u_int count = 0;
+	u_int addr = startAddr;
+
+	/* Clusters past the end of the drive are never marked free, so the
+	   run always ends at the end of the drive */
+	while(count < maxCount && addr < fs->bootRecord->clustersOnDrive)
+	{
+		u_int shift = addr % 64;
+		uint64_t used = ~fs->freeClusterMap[addr / 64] >> shift;
+		u_int run = used ? (u_int) __builtin_ctzll(used) : 64 - shift;
+		count += run;
+		addr += run;
+		if(run < 64 - shift)
+			break;
+	}
+
+	return count < maxCount ? count : maxCount;
+}
+
+/**
+ * Locates a run of contiguous free clusters, searching from the next
+ * free cluster hint. The first run of at least the given length is
+ * returned; if there is no such run, the longest run is returned.
+ *
+ * @param  fs       The file system
+ * @param  count    The desired length of the run
+ * @param  runStart Set to the cluster address of the start of the run
+ * @return          The length of the run (at most count), or 0 if the
+ *                  drive is full
+ */
+u_int findFreeRun(BC_FS *fs, u_int count, u_int *runStart)
+{
+	u_int best = 0;
+	u_int wrapped = 0;
+	u_int first = findFreeCluster(fs, fs->bootRecord->nextFreeCluster);
+	u_int addr = first;
+	u_int prev;
+
+	*runStart = 0;
+	while(addr)
+	{
+		u_int run = countFreeRun(fs, addr, count);
+		if(run > best)
+		{
+			best = run;
+			*runStart = addr;
+		}
+		if(best >= count)
+			break;
+
+		/* Move on to the next run, stopping once the search has wrapped 
+		   back around to where it started */
+		prev = addr;
+		addr = findFreeCluster(fs, addr + run);
+		if(addr <= prev)
+			wrapped = 1;
+		if(wrapped && addr >= first)
+			break;
+	}
+
+	return best;
+}
+
+/**
+ * Allocates a free cluster as a new end of chain cluster and advances 
+ * the next free cluster hint.
+ *
+ * @param  fs The file system
+ * @return The address of the allocated cluster, or 0 if the drive is full
+ */
+u_int allocateCluster(BC_FS *fs)
+{
+	pthread_mutex_lock(&fs->fatLock);
+	u_int clusterAddr = findFreeCluster(fs, fs->bootRecord->nextFreeCluster);
+	if(clusterAddr == 0)
+	{
+		pthread_mutex_unlock(&fs->fatLock);
+		fprintf(stderr, "FAT is full\n");
+		return 0;
+	}
+
+	int zero = setFATEntry(fs, clusterAddr, 0xffffffff);
+	fs->bootRecord->nextFreeCluster = clusterAddr;
+	findAndSetNextFreeCluster(fs);
+	pthread_mutex_unlock(&fs->fatLock);
+
+	/* The cluster is no longer free, so no other thread can take it 
+	   while it is zeroed */
+	if(zero)
+		zeroClusters(fs, clusterAddr, 1);
+
+	return clusterAddr;
+}
+
+/**
+ * Builds the free cluster map and the free cluster count of each FAT 
+ * cluster from the file allocation table, in one pass over the table.
+ * Only clusters of the data region are ever marked free. The pending
+ * zero map is cleared. 
+ *
+ * The free cluster count and the next free cluster hint held in the
+ * boot record are checked against the table. If they do not agree, a
+ * message is printed and the boot record is corrected.
+ *
+ * @param  fs The file system
+ * @return The number of free clusters
+ */
+u_int buildFreeClusterMap(BC_FS *fs)
+{
+	u_int i;
+	u_int n;
+	u_int freeCount = 0;
+	u_int words = (fs->bootRecord->clustersOnDrive + 63) / 64;
+	u_int entriesPerCluster = fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES;
+
+	free(fs->freeClusterMap);
+	fs->freeClusterMap = calloc(words, sizeof(uint64_t));
+	free(fs->fatClusterFree);
+	fs->fatClusterFree = calloc(fs->bootRecord->clustersPerFat, sizeof(u_int));
+	free(fs->pendingZeroMap);
+	fs->pendingZeroMap = calloc(words, sizeof(uint64_t));
+	fs->pendingZeroCount = 0;
+
+	for(n = 0; n < words; n++)
+	{
+		/* Build a word of the map without branching, so the compiler 
+		   can vectorise the comparisons */
+		u_int base = n * 64;
+		u_int end = base + 64 < fs->bootRecord->clustersOnDrive ? base + 64 : fs->bootRecord->clustersOnDrive;
+		uint64_t bits = 0;
+		for(i = base; i < end; i++)
+			bits |= (uint64_t) (fs->fileAllocTable[i] == 0x0) << (i - base);
+
+		/* The boot cluster, the FAT and the root directory are never free */
+		if(base <= fs->bootRecord->rootDirStart)
+			bits &= fs->bootRecord->rootDirStart - base >= 63 ? 0 : ~0ULL << (fs->bootRecord->rootDirStart - base + 1);
+
+		fs->freeClusterMap[n] = bits;
+		u_int count = __builtin_popcountll(bits);
+		fs->fatClusterFree[base / entriesPerCluster] += count;
+		freeCount += count;
+	}
+
+	if(fs->bootRecord->freeClusters != freeCount)
+	{
+		fprintf(stderr, "Boot record holds %u free clusters ", fs->bootRecord->freeClusters);
+		fprintf(stderr, "but the FAT has %u, using the FAT\n", freeCount);
+		fs->bootRecord->freeClusters = freeCount;
+	}
+	if(freeCount > 0 && (fs->bootRecord->nextFreeCluster <= fs->bootRecord->rootDirStart ||
+	   fs->bootRecord->nextFreeCluster >= fs->bootRecord->clustersOnDrive))
+	{
+		fprintf(stderr, "Boot record holds an invalid next free cluster %u\n", fs->bootRecord->nextFreeCluster);
+		fs->bootRecord->nextFreeCluster = findFreeCluster(fs, fs->bootRecord->rootDirStart + 1);
+	}
+
+	return freeCount;
+}
+
+/**
+ * Returns the address of the first free cluster at or after the given
+ * cluster address, wrapping around to the start of the data region.
+ *
+ * @param  fs        The file system
+ * @param  startAddr The cluster address to start searching from
+ * @return           The address of a free cluster, or 0 if the drive is full
+ */
+u_int findFreeCluster(BC_FS *fs, u_int startAddr)
+{
+	u_int n;
+	u_int words = (fs->bootRecord->clustersOnDrive + 63) / 64;
+
+	if(startAddr <= fs->bootRecord->rootDirStart || startAddr >= fs->bootRecord->clustersOnDrive)
+		startAddr = fs->bootRecord->rootDirStart + 1;
+
+	/* Mask off the clusters before the start address in the first word,
+	   they are checked last when the search wraps around */
+	u_int word = startAddr / 64;
+	u_int wordsPerFatCluster = fs->bootRecord->bytesPerCluster / FAT_ENTRY_BYTES / 64;
+	uint64_t bits = fs->freeClusterMap[word] & (~0ULL << (startAddr % 64));
+	for(n = 0; n <= words + wordsPerFatCluster; n++)
+	{
+		if(bits)
+			return word * 64 + __builtin_ctzll(bits);
+		word = (word + 1) % words;
+
+		/* Skip over the clusters covered by FAT clusters with no free
+		   entries */
+		while(word % wordsPerFatCluster == 0 && fs->fatClusterFree[word / wordsPerFatCluster] == 0 &&
+		      n <= words)
+		{
+			n += wordsPerFatCluster;
+			word += wordsPerFatCluster;
+			if(word >= words)
+				word = 0;
+		}
+		bits = fs->freeClusterMap[word];
+	}
+
+	return 0;
+}
+
+
+/** 
+ * ======================================================================== 
+ * |              Directory Table Entry Operations                        | 
+ * ======================================================================== 
+ *
+ *     The section holds all of the operations which can be performed on
+ *     the directory clusters of the virtual drive. Each directory 
+ *     entry will consist of 64 bytes. This will allow for 8 entries
+ *     per 512 byte cluster (getDirEntriesPerCluster() gives the number
+ *     for the drive's cluster size). The layout of the data contained 
+ *     in each directory entry is as follows:
+ *
+ *        (bytes) | value 
+ *       ---------------------------------------------------------------
+ *        (0)     | A byte holding the attributes of the file/directory:
+ *                    Bit 0: 0 for unused entry, 1 for used entry
+ *                    Bit 1: 0 for R/O, 1 for R/W
+ *                    Bit 2: 1 for hidden file/directory
+ *                    Bit 3: 1 for system file
+ *                    Bit 4: 1 for subdirectory
+ *                    Bit 5: 1 for directory header
+ *                    Bit 6: 1 for a version 2 entry
+ *                    The remaining bits are unused
+ *        (1-43)  | The file/directory name (42 chars max). In a 
+ *                  version 2 entry the name is at most 38 chars and
+ *                  bytes 40-43 hold the high 32 bits of the file size
+ *        (44-47) | The file/directory extension (3 chars max)
+ *        (48-51) | Creation date/time
+ *                    Bits 0-5:   Year - 1985
+ *                    Bits 6-9:   Month
+ *                    Bits 10-14: Day
+ *                    Bits 15-19: Hour
+ *                    Bits 20-25: Minute
+ *                    Bits 26-31: Second
+ *        (52-55) | Last modified date/time
+ *                    Bits 0-5:   Year - 1985
+ *                    Bits 6-9:   Month
+ *                    Bits 10-14: Day
+ *                    Bits 15-19: Hour
+ *                    Bits 20-25: Minute
+ *                    Bits 26-31: Second
+ *        (56-59) | Starting cluster of file (empty file: 0)
+ *        (60-63) | The file size in bytes (the low 32 bits of the file
+ *                  size in a version 2 entry)
+ *
+ *     The entries will be organized within a directory cluster chain
+ *     with entry addresses ranging from 0 upwards. The entry address
+ *     refers to an entries position relative to the entire directory
+ *     cluster chain.
+ *
+ *     Directories created by this version of the file system (including
+ *     the root directory of a newly formatted drive) hold a directory 
+ *     header in entry 0. The header is a hidden system entry with bit 5 
+ *     of its attributes set and an empty name. Its starting cluster 
+ *     field holds the root cluster of the directory's B-tree (0 if the
+ *     directory has none yet) and its file size field holds the lowest 
+ *     entry address which may be unused. Directories without a header 
+ *     are searched by scanning their entries, as before.
+ */
+
+
+/**
+ * Creates a directory entry for a file in the given directory cluster
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The starting cluster of the directory
+ * @param  attr        The attributes of the file (one byte)
+ *                       Bit 0: 0 for unused entry, 1 for used entry
+ *                       Bit 1: 0 for R/O, 1 for R/W
+ *                       Bit 2: 1 for hidden file
+ *                       Bit 3: 1 for system file
+ *                       Bit 4: 1 for subdirectory
+ *                       The remaining bits are unused
+ * @param  name        The name of the file/directory (maximum 12 characters)
+ * @param  ext         The extension of the file (maximum 3 characters)
+ * @return             The entry address of the new file, or 0xffffffff
+ *                     if the drive is full
+ */
+u_int createDirFileEntry(BC_FS *fs, u_int clusterAddr, char attr, char *name, char *ext)
+{
+	u_int startCluster = allocateCluster(fs);
+	if(!startCluster)
+		return 0xffffffff;
+
+	u_int entryAddr = getFirstFreeDirEntryAddr(fs, clusterAddr);
+	if(entryAddr == 0xffffffff)
+	{
+		setFATEntry(fs, startCluster, 0x0);
+		return 0xffffffff;
+	}
+	off_t loc = getDirEntryLoc(fs, clusterAddr, entryAddr);
+	u_int currentTime = encodeTimeBytes();
+	
+	DirEntry fileEntry;
+	memset(&fileEntry, 0, sizeof(fileEntry));
+	fileEntry.attr = attr;
+	strncpy(fileEntry.fileName, name, FILE_NAME_MAX);
+	strncpy(fileEntry.fileExt, ext, FILE_EXT_SIZE);
+	fileEntry.createDate = currentTime;
+	fileEntry.modifiedDate = currentTime;
+	fileEntry.startCluster = startCluster;
+	fileEntry.fileSize = 0;
+	writeVirDrive(fs, &fileEntry, loc, sizeof(DirEntry));
+	addDirIndexEntry(fs, clusterAddr, &fileEntry, entryAddr);
+	addDirBTreeEntry(fs, clusterAddr, &fileEntry, entryAddr, loc / fs->bootRecord->bytesPerCluster);
+
+	return entryAddr;
+}
+
+/**
+ * Creates a directory entry for a subdirectory in the given directory cluster
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The starting cluster of the parent directory
+ * @param  attr        The attributes of the directory (one byte)
+ *                       Bit 0: 0 for unused entry, 1 for used entry
+ *                       Bit 1: 0 for R/O, 1 for R/W
+ *                       Bit 2: 1 for hidden directory
+ *                       Bit 3: 1 for system directory
+ *                       Bit 4: 1 for subdirectory
+ *                       The remaining bits are unused
+ * @param  name        The name of the directory (maximum 42 characters)
+ * @return             The entry address of the subdirectory, or 0xffffffff
+ *                     if the drive is full
+ */
+u_int createDirSubEntry(BC_FS *fs, u_int clusterAddr, char attr, char *name)
+{
+	u_int startCluster = allocateCluster(fs);
+	if(!startCluster)
+		return 0xffffffff;
+	formatCluster(fs, startCluster);
+	initDirHeader(fs, startCluster);
+
+	u_int entryAddr = getFirstFreeDirEntryAddr(fs, clusterAddr);
+	if(entryAddr == 0xffffffff)
+	{
+		setFATEntry(fs, startCluster, 0x0);
+		return 0xffffffff;
+	}
+	off_t loc = getDirEntryLoc(fs, clusterAddr, entryAddr);
+	u_int currentTime = encodeTimeBytes();
+
+	DirEntry subEntry;
+	memset(&subEntry, 0, sizeof(subEntry));
+	subEntry.attr = attr;
+	strncpy(subEntry.fileName, name, FILE_NAME_MAX);
+	subEntry.createDate = currentTime;
+	subEntry.modifiedDate = currentTime;
+	subEntry.startCluster = startCluster;
+	subEntry.fileSize = 0;
+	writeVirDrive(fs, &subEntry, loc, sizeof(DirEntry));
+	invalidatePathCache(fs, 0);
+	addDirIndexEntry(fs, clusterAddr, &subEntry, entryAddr);
+	addDirBTreeEntry(fs, clusterAddr, &subEntry, entryAddr, loc / fs->bootRecord->bytesPerCluster);
+
+	return entryAddr;
+}
+
+/**
+ * Deletes a directory entry
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ * @param entryAddr  The address of the entry to delete
+ */
+void deleteDirEntry(BC_FS *fs, u_int dirCluster, u_int entryAddr)
+{
+	off_t loc = getDirEntryLoc(fs, dirCluster, entryAddr);
+	DirEntry entry;
+
+	readVirDrive(fs, &entry, loc, sizeof(entry));
+	if(entry.attr & 0x10)
+		invalidatePathCache(fs, 1);
+	removeDirIndexEntry(fs, dirCluster, entry.fileName, entry.fileExt);
+	removeDirBTreeEntry(fs, dirCluster, &entry, entryAddr);
+
+	char empty[DIR_ENTRY_BYTES] = { 0 };
+	writeVirDrive(fs, empty, loc, DIR_ENTRY_BYTES);
+}
+
+/**
+ * Determines if a file exists in the given directory cluster.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The directory cluster to search
+ * @param  fileName    The name of the file to locate
+ * @param  fileExt     The extension of the file to locate
+ * @return             1 if found, 0 otherwise
+ */
+u_int dirFileEntryExists(BC_FS *fs, u_int clusterAddr, char *fileName, char *fileExt)
+{
+	return findDirFileEntry(fs, clusterAddr, fileName, fileExt) != 0xffffffff;
+}
+
+/**
+ * Returns the directory entry address of a file in the given directory cluster.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The directory cluster to search
+ * @param  fileName    The name of the file to locate
+ * @param  fileExt     The extension of the file to locate
+ * @return             The file's directory entry address
+ */
+u_int getDirFileEntryAddr(BC_FS *fs, u_int clusterAddr, char *fileName, char *fileExt)
+{
+	u_int entryAddr = findDirFileEntry(fs, clusterAddr, fileName, fileExt);
+
+	if(entryAddr == 0xffffffff)
+	{
+		fprintf(stderr, "Could not locate file in getDirFileEntryAddr()\n");
+		fprintf(stderr, "Call dirFileEntryExists() beforehand to ensure file existence\n");
+		fprintf(stderr, "Exit\n");
+		exit(1);
+	}
+
+	return entryAddr;
+}
+
+/**
+ * Locates a file in the given directory cluster. If directory indexing
+ * is enabled, the directory's index is searched without a lock (and 
+ * built on the first search of the directory, which must be made 
+ * without holding the directory's lock). Otherwise the directory's B-tree is searched
+ * if it has one, or the directory is scanned one cluster at a time.
+ *
+ * @param  fs          The file system
+ * @param  clusterAddr The directory cluster to search
+ * @param  fileName    The name of the file to locate
+ * @param  fileExt     The extension of the file to locate
+ * @return             The file's directory entry address, or 0xffffffff
+ *                     if the file does not exist
+ */
+u_int findDirFileEntry(BC_FS *fs, u_int clusterAddr, char *fileName, char *fileExt)
+{
+	u_int i;
+	u_int entryAddr = 0;
+	u_int currentCluster = clusterAddr;
+
+	if(fs->dirIndexEnabled)
+	{
+		DirIndexEntry indexEntry;
+		return lookupDirIndex(fs, clusterAddr, fileName, fileExt, &indexEntry) ? indexEntry.entryAddr : 0xffffffff;
+	}
+
+	DirEntry header;
+	if(readDirHeader(fs, clusterAddr, &header) && header.startCluster)
+	{
+		DirEntry entry;
+		return lookupDirBTree(fs, header.startCluster, fileName, fileExt, &entry);
+	}
+
+	char *cluster = malloc(fs->bootRecord->bytesPerCluster);
+	while(currentCluster != 0xffffffff)
+	{
+		readVirDrive(fs, cluster, getClusterLoc(fs, currentCluster), fs->bootRecord->bytesPerCluster);
+		for(i = 0; i < getDirEntriesPerCluster(fs); i++, entryAddr++)
+		{
+			DirEntry *entry = (DirEntry*) (cluster + i * DIR_ENTRY_BYTES);
+			if((entry->attr & 0x1) &&
+			   strncmp(entry->fileName, fileName, FILE_NAME_MAX) == 0 && 
+			   strncmp(entry->fileExt, fileExt, FILE_EXT_SIZE) == 0)
+			{
+				free(cluster);
+				return entryAddr;
+			}
+		}
+		currentCluster = fs->fileAllocTable[currentCluster];
+	}
+	free(cluster);
+
+	return 0xffffffff;
+}
+
+/**
+ * Returns a string containing a listing of the contents of a
+ * directory. 
+ *
+ * @param  fs          The file system
+ * @param  dirPath     The absolute path of the directory
+ * @return             A string containing the directory listing
+ */
+char *getDirectoryListing(BC_FS *fs, char *dirPath)
+{
+	char *listing;
+	u_int clusterAddr;
+	DirEntry *entry;
+
+	/* List the current sizes of files which are open */
+	syncFileMetadata(fs);
+
+	if(strcmp_igncase(dirPath, "root") == 0)
+	{
+		clusterAddr = fs->bootRecord->rootDirStart;
+	}
+	else
+	{
+		char **path = chop(dirPath, '/');
+		int i = 0;
+		while(path[i] != NULL)
+			i++;
+		clusterAddr = resolveDirPath(fs, path, i, 0);
+		while(i > 0)
+			free(path[--i]);
+		free(path);
+	}
+
+	if(clusterAddr == 0)
+	{
+		/* Directory not found */
+		listing = calloc(25, sizeof(char));
+		strcpy(listing, "Directory not found\n");
+	}
+	else
+	{
+		int end = 0;
+		u_int count = 0;
+		u_int entryAddr = 0;
+		u_int currentCluster = clusterAddr;
+
+		lockDir(fs, clusterAddr, 0);
+
+		/* Determine the number of files/directories in the directory */
+		while(!end)
+		{
+			entry = getDirEntry(fs, clusterAddr, entryAddr);
+			entryAddr++;
+			if((entry->attr & 0x01) && !(entry->attr & 0x20))
+				count++;
+			if(entryAddr % getDirEntriesPerCluster(fs) == 0)
+			{
+				currentCluster = fs->fileAllocTable[currentCluster];
+				if(currentCluster == 0xffffffff) /* No more entries to check */
+					end = 1;
+			}
+			free(entry);
+		}
+
+		/* Allocate space for the listing string */
+		listing = calloc(100 * (count + 3), sizeof(char));
+		strcpy(listing, "    File Name          | File Size |  Date/Time Created  |  Date/Time Modified | Start Cluster \n");
+		strcat(listing, "  ==============================================================================================\n");
+
+		/* Reset iteration variables */
 		u_int i = 0;
 		end = 0;
 		entryAddr = 0;
 		currentCluster = clusterAddr;
 
-		/* Record file info for each directory listing */
-		while(!end && i < count)
+		/* Record file info for each directory listing */
+		while(!end && i < count)
+		{
+			entry = getDirEntry(fs, clusterAddr, entryAddr);
+			entryAddr++;
+			if((entry->attr & 0x01) && !(entry->attr & 0x20))
+			{
+				char fileName[47];
+				char timeStr[20];
+				char fileInfo[100];
+				char temp[50];
+				strcpy(fileInfo, "    ");
+				strncpy(fileName, entry->fileName, FILE_NAME_MAX);
+				if((entry->attr & 0x10) ^ 0x10)
+				{
+					strncat(fileName, ".", 1);
+					strncat(fileName, entry->fileExt, FILE_EXT_SIZE);
+				}
+				sprintf(temp, "%-18s", fileName);
+				strcat(fileInfo, temp);
+
+				if((entry->attr & 0x10) ^ 0x10)
+					sprintf(temp, " | %9llu", (unsigned long long) getDirEntrySize(entry));
+				else
+					sprintf(temp, " |     -    ");
+				strcat(fileInfo, temp);
+
+				struct tm *createTime = decodeTimeBytes(entry->createDate);
+
+				sprintf(timeStr, "%04d-%02d-%02d %02d:%02d:%02d",
+					    createTime->tm_year,
+					    createTime->tm_mon,
+					    createTime->tm_mday,
+					    createTime->tm_hour,
+					    createTime->tm_min,
+					    createTime->tm_sec);
+				free(createTime);
+				sprintf(temp, " | %19s", timeStr);
+				strcat(fileInfo, temp);
+
+				struct tm *modifiedTime = decodeTimeBytes(entry->modifiedDate);
+
+				sprintf(timeStr, "%04d-%02d-%02d %02d:%02d:%02d",
+					    modifiedTime->tm_year,
+					    modifiedTime->tm_mon,
+					    modifiedTime->tm_mday,
+					    modifiedTime->tm_hour,
+					    modifiedTime->tm_min,
+					    modifiedTime->tm_sec);
+				free(modifiedTime);
+				sprintf(temp, " | %19s", timeStr);
+				strcat(fileInfo, temp);
+
+				sprintf(temp, " | %13u", entry->startCluster);
+				strcat(fileInfo, temp);
+
+				strcat(listing, fileInfo);
+				strcat(listing, "\n");
+			
+				if(entryAddr % getDirEntriesPerCluster(fs) == 0)
+				{
+					currentCluster = fs->fileAllocTable[currentCluster];
+					if(currentCluster == 0xffffffff) /* No more entries to check */
+						end = 1;
+				}
+				i++;
+			}
+			free(entry);
+		}
+		strcat(listing, "  ==============================================================================================\n");
+		unlockDir(fs, clusterAddr);
+	}
+
+	return listing;
+}
+
+/**
+ * Returns the directory cluster address of a directory. Searches through a 
+ * given directory for a subdirectory of a given name. Returns 0 if no matching 
+ * directory is found.
+ *
+ * @param  fs                 The file system
+ * @param  currentClusterAddr The cluster address of the directory to search
+ * @param  dirName            The name of the directory to locate
+ * @return                    The cluster address of the directory to locate
+ */
+u_int getDirectoryClusterAddress(BC_FS *fs, u_int currentClusterAddr, char *dirName)
+{
+	if(fs->dirIndexEnabled)
+	{
+		DirIndexEntry indexEntry;
+		if(lookupDirIndex(fs, currentClusterAddr, dirName, "", &indexEntry) && (indexEntry.attr & 0x10))
+			return indexEntry.startCluster;
+		return 0;
+	}
+
+	DirEntry header;
+	if(readDirHeader(fs, currentClusterAddr, &header) && header.startCluster)
+	{
+		DirEntry subEntry;
+		if(lookupDirBTree(fs, header.startCluster, dirName, "", &subEntry) != 0xffffffff && (subEntry.attr & 0x10))
+			return subEntry.startCluster;
+		return 0;
+	}
+
+	int end = 0;
+	int found = 0;
+	u_int entryAddr = 0;
+	u_int currentCluster = currentClusterAddr;
+	u_int nextCluster = 0;
+	u_int dirClusterAddress = 0;
+	DirEntry *entry;
+
+	while(!found && !end)
+	{
+		entry = getDirEntry(fs, currentClusterAddr, entryAddr);
+		entryAddr++;
+		if(entry->attr & 0x10) /* Subdirectory */
+		{
+			if(strcmp(entry->fileName, dirName) == 0)
+			{
+				found = 1;
+				dirClusterAddress = entry->startCluster;
+			}
+		}
+	
+		if(entryAddr % getDirEntriesPerCluster(fs) == 0)
+		{
+			nextCluster = fs->fileAllocTable[currentCluster];
+			if(nextCluster == 0xffffffff)
+				end = 1;
+			currentCluster = nextCluster;
+		}
+		free(entry);
+	}
+
+	return dirClusterAddress;
+}
+
+/**
+ * Returns 4 bytes containing a time stamp of the current time. The layout
+ * of the time stamp is as follows:
+ *    Bits 0-5:   Year - 1985
+ *    Bits 6-9:   Month
+ *    Bits 10-14: Day
+ *    Bits 15-19: Hour
+ *    Bits 20-25: Minute
+ *    Bits 26-31: Second
+ *
+ * @return A time stamp encoded in 4 bytes
+ */
+u_int encodeTimeBytes()
+{
+	return encodeTime(time(NULL));
+}
+
+/**
+ * Returns 4 bytes containing a time stamp of the given calendar time,
+ * in the layout described for encodeTimeBytes().
+ *
+ * @param  calTime A calendar time
+ * @return         A time stamp encoded in 4 bytes
+ */
+u_int encodeTime(time_t calTime)
+{
+	u_int timeBytes = 0;
+
+	struct tm localBuf;
+	struct tm *localTime = localtime_r(&calTime, &localBuf);
+
+	timeBytes ^= ((localTime->tm_year - 85) & 0x3f);
+	timeBytes <<= 4;
+	timeBytes ^= ((localTime->tm_mon + 1) & 0xf);
+	timeBytes <<= 5;
+	timeBytes ^= (localTime->tm_mday & 0x1f);
+	timeBytes <<= 5;
+	timeBytes ^= ((localTime->tm_hour + 1) & 0x1f);
+	timeBytes <<= 6;
+	timeBytes ^= (localTime->tm_min & 0x3f);
+	timeBytes <<= 6;
+	timeBytes ^= (localTime->tm_sec & 0x3f);
+	
+	return timeBytes;
+}
+
+/**
+ * Returns a pointer to a struct containing the decoded components
+ * of a 4 byte time stamp.
+ *
+ * @param  timeBytes A time stamp encoded in 4 bytes
+ * @return           A struct containing the decoded components
+ *                   of a calendar time
+ */
+struct tm *decodeTimeBytes(u_int timeBytes)
+{
+	struct tm *decodedTime = malloc(sizeof(*decodedTime));
+
+	decodedTime->tm_sec = timeBytes & 0x3f;
+	timeBytes >>= 6;
+	decodedTime->tm_min = timeBytes & 0x3f;
+	timeBytes >>= 6;
+	decodedTime->tm_hour = timeBytes & 0x1f;
+	timeBytes >>= 5;
+	decodedTime->tm_mday = timeBytes & 0x1f;
+	timeBytes >>= 5;
+	decodedTime->tm_mon = timeBytes & 0xf;
+	timeBytes >>= 4;
+	decodedTime->tm_year = (timeBytes & 0x3f) + 1985;
+
+	return decodedTime;
+}
+
+/**
+ * Returns the number of directory entries held by each cluster of a 
+ * directory
+ *
+ * @param  fs The file system
+ * @return The number of directory entries per cluster
+ */
+u_int getDirEntriesPerCluster(BC_FS *fs)
+{
+	return fs->bootRecord->bytesPerCluster / DIR_ENTRY_BYTES;
+}
+
+/**
+ * Returns the offset (in bytes) from the beginning of the virtual drive
+ * to the start of the starting data cluster.
+ *
+ * @param  fs The file system
+ * @return  The drive offset of the starting data cluster in bytes
+ */
+off_t getDataStartLoc(BC_FS *fs)
+{
+	/* Skip over boot cluster and FAT */
+	return getClusterLoc(fs, fs->bootRecord->reservedClusters + fs->bootRecord->clustersPerFat);
+}
+
+/**
+ * Returns the offset (in bytes) from the beginning of the virtual drive
+ * to the start of the given directory cluster entry.
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster address of the directory cluster 
+ *                    containing the entry
+ * @param  entryAddr  The address of the entry within the directory cluster
+ * @return            The drive offset of the given entry in bytes
+ */
+off_t getDirEntryLoc(BC_FS *fs, u_int dirCluster, u_int entryAddr)
+{
+	u_int entry = 0;
+	off_t loc = 0;
+	u_int currentCluster = dirCluster;
+	u_int nextCluster = 0;
+
+	/* Skip to the given dir cluster */
+	loc += getClusterLoc(fs, currentCluster);
+
+	while(entry < entryAddr)
+	{
+		entry++;
+		loc += DIR_ENTRY_BYTES;
+		if(entry % getDirEntriesPerCluster(fs) == 0)
+		{
+			nextCluster = fs->fileAllocTable[currentCluster];
+			if(nextCluster == 0xffffffff)
+				loc = 0;
+			else
+				loc = getClusterLoc(fs, nextCluster);
+			currentCluster = nextCluster;
+		}
+	}
+	assert(loc);
+
+	return loc;
+}
+
+/**
+ * Returns the entry of the first free directory entry for a given
+ * directory cluster. If the given directory cluster is full, the directory 
+ * cluster chain will be extended.
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster of the directory
+ * @return            The entry address of the first free directory entry,
+ *                    or 0xffffffff if the directory is full and cannot be
+ *                    extended
+ */
+u_int getFirstFreeDirEntryAddr(BC_FS *fs, u_int dirCluster)
+{
+	u_int i;
+	u_int entryAddr = 0;
+	u_int currentCluster = dirCluster;
+	u_int nextCluster = 0;
+	DirEntry header;
+
+	/* Skip the clusters before the free entry hint of the directory header */
+	if(readDirHeader(fs, dirCluster, &header))
+	{
+		while(entryAddr + getDirEntriesPerCluster(fs) <= header.fileSize && 
+			  fs->fileAllocTable[currentCluster] != 0xffffffff)
+		{
+			currentCluster = fs->fileAllocTable[currentCluster];
+			entryAddr += getDirEntriesPerCluster(fs);
+		}
+	}
+
+	char *cluster = malloc(fs->bootRecord->bytesPerCluster);
+	while(1)
+	{
+		readVirDrive(fs, cluster, getClusterLoc(fs, currentCluster), fs->bootRecord->bytesPerCluster);
+		for(i = 0; i < getDirEntriesPerCluster(fs); i++, entryAddr++)
+		{
+			DirEntry *entry = (DirEntry*) (cluster + i * DIR_ENTRY_BYTES);
+			if((entry->attr & 0x1) ^ 0x1)
+			{
+				free(cluster);
+				return entryAddr;
+			}
+		}
+
+		nextCluster = fs->fileAllocTable[currentCluster];
+		if(nextCluster == 0xffffffff)
+		{
+			/* The new cluster's entries must all read as unused */
+			nextCluster = addClusterToChain(fs, currentCluster);
+			if(!nextCluster) /* Drive is full */
+			{
+				free(cluster);
+				return 0xffffffff;
+			}
+			formatCluster(fs, nextCluster);
+		}
+		currentCluster = nextCluster;
+	}
+}
+
+/**
+ * Returns a directory entry from a given directory
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The address of the directory cluster containing the entry
+ * @param  entryAddr  The address of the entry within the directory cluster
+ * @return            The directory entry struct
+ */
+DirEntry *getDirEntry(BC_FS *fs, u_int dirCluster, u_int entryAddr)
+{
+	DirEntry *entry = calloc(1, sizeof(*entry));
+	off_t loc = getDirEntryLoc(fs, dirCluster, entryAddr);
+	readVirDrive(fs, entry, loc, sizeof(*entry));
+
+	return entry;
+}
+
+/**
+ * Returns the size of the file of a directory entry. Version 2 entries 
+ * hold the high 32 bits of the size in the last bytes of the name.
+ *
+ * @param  entry The directory entry
+ * @return       The size of the file in bytes
+ */
+uint64_t getDirEntrySize(DirEntry *entry)
+{
+	uint64_t size = entry->fileSize;
+	if(entry->attr & 0x40)
+	{
+		uint32_t high;
+		memcpy(&high, entry->fileName + FILE_NAME_MAX_V2 + 1, sizeof(high));
+		size |= (uint64_t) high << 32;
+	}
+
+	return size;
+}
+
+/**
+ * Sets the size of the file of a directory entry. A size which does 
+ * not fit in 32 bits makes the entry a version 2 entry, which needs a
+ * name of at most FILE_NAME_MAX_V2 characters.
+ *
+ * @param  entry The directory entry
+ * @param  size  The size of the file in bytes
+ * @return       1 if the size was set, 0 if the name of the entry is
+ *               too long to hold the size
+ */
+int setDirEntrySize(DirEntry *entry, uint64_t size)
+{
+	uint32_t high = size >> 32;
+
+	if(high && strlen(entry->fileName) > FILE_NAME_MAX_V2)
+		return 0;
+
+	entry->fileSize = (u_int) size;
+	if(high || (entry->attr & 0x40))
+	{
+		memcpy(entry->fileName + FILE_NAME_MAX_V2 + 1, &high, sizeof(high));
+		if(high)
+			entry->attr |= 0x40;
+		else
+			entry->attr &= ~0x40;
+	}
+
+	return 1;
+}
+
+/**
+ * Sets a directory entry in a given directory
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The address of the directory cluster containing the entry
+ * @param  entryAddr  The address of the entry within the directory cluster
+ * @param  entry      The directory entry
+ */
+void setDirEntry(BC_FS *fs, u_int dirCluster, u_int entryAddr, DirEntry *entry)
+{
+	off_t loc = getDirEntryLoc(fs, dirCluster, entryAddr);
+	writeVirDrive(fs, entry, loc, sizeof(*entry));
+}
+
+/** 
+ * ======================================================================== 
+ * |                   Directory Index Operations                         | 
+ * ======================================================================== 
+ *
+ *     This section holds the operations of the optional in-memory 
+ *     directory index (enabled with DRIVE_DIR_INDEX). The index of a 
+ *     directory is a hash table, keyed by file name and extension, of 
+ *     the directory's used entries. Each index entry records the entry 
+ *     address, attributes and starting cluster of the directory entry,
+ *     so that a file or subdirectory can be located without reading the
+ *     directory. Subdirectories are keyed by their name and an empty 
+ *     extension.
+ *
+ *     The index of a directory is built the first time the directory is
+ *     searched, by a single pass over the directory's clusters. After 
+ *     that it is kept up to date by createDirFileEntry(), 
+ *     createDirSubEntry() and deleteDirEntry() under the directory's
+ *     write lock. The indexes themselves are held in a hash table keyed
+ *     by the starting cluster of their directory. An index is never 
+ *     removed once it has been built, so the table is searched without 
+ *     a lock; indexes are added to it and changed under dirIndexLock.
+ *
+ *     Searches of an index take no lock and write nothing shared but a
+ *     counter of their own. The hash table of an index is an immutable 
+ *     snapshot: a change copies the table (sharing the entries of every
+ *     bucket but the one changed) and publishes the copy by swapping 
+ *     the index's snapshot pointer. A search runs between 
+ *     enterDirSnapshot() and leaveDirSnapshot(), which count the search
+ *     against the current epoch in one of DIR_SNAPSHOT_SLOTS counters 
+ *     chosen by thread. The memory a change replaces is retired, and 
+ *     once DIR_SNAPSHOT_RETIRE_MAX allocations have been retired 
+ *     reclaimDirSnapshots() advances the epoch, waits for the searches
+ *     counted against the previous epoch to finish and frees them.
+ */
+
+/**
+ * Returns the hash of a file name and extension (FNV-1a)
+ *
+ * @param  fileName The name of the file
+ * @param  fileExt  The extension of the file
+ * @return          The hash of the name and extension
+ */
+u_int hashDirEntryName(char *fileName, char *fileExt)
+{
+	u_int i;
+	u_int hash = 2166136261u;
+
+	for(i = 0; i < FILE_NAME_MAX && fileName[i]; i++)
+		hash = (hash ^ (unsigned char) fileName[i]) * 16777619u;
+	hash = (hash ^ '.') * 16777619u;
+	for(i = 0; i < FILE_EXT_SIZE && fileExt[i]; i++)
+		hash = (hash ^ (unsigned char) fileExt[i]) * 16777619u;
+
+	return hash;
+}
+
+/**
+ * Returns the index of the given directory if it has been built
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster of the directory
+ * @return            The directory's index, or NULL if it has not been built
+ */
+DirIndex *findDirIndex(BC_FS *fs, u_int dirCluster)
+{
+	DirIndex *index = __atomic_load_n(&fs->dirIndexes[dirCluster % DIR_INDEX_BUCKETS], __ATOMIC_ACQUIRE);
+	while(index && index->dirCluster != dirCluster)
+		index = index->next;
+
+	return index;
+}
+
+/**
+ * Returns the index of the given directory, building it from the 
+ * directory's clusters if it has not been built. The build takes the
+ * directory's lock, so the caller must not hold it.
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster of the directory
+ * @return            The directory's index
+ */
+DirIndex *getDirIndex(BC_FS *fs, u_int dirCluster)
+{
+	u_int i;
+	u_int count = 0;
+	u_int buckets = 16;
+	u_int entryAddr = 0;
+	u_int currentCluster = dirCluster;
+	DirIndexEntry *entries = NULL;
+	DirIndex *index = findDirIndex(fs, dirCluster);
+
+	if(index)
+		return index;
+
+	/* Build the index under the directory's read lock and the index 
+	   lock, unless another thread searching the directory has built it
+	   in the meantime */
+	lockDir(fs, dirCluster, 0);
+	pthread_mutex_lock(&fs->dirIndexLock);
+	index = findDirIndex(fs, dirCluster);
+	if(index)
+	{
+		pthread_mutex_unlock(&fs->dirIndexLock);
+		unlockDir(fs, dirCluster);
+		return index;
+	}
+
+	char *cluster = malloc(fs->bootRecord->bytesPerCluster);
+	while(currentCluster != 0xffffffff)
+	{
+		readVirDrive(fs, cluster, getClusterLoc(fs, currentCluster), fs->bootRecord->bytesPerCluster);
+		for(i = 0; i < getDirEntriesPerCluster(fs); i++, entryAddr++)
 		{
-			entry = getDirEntry(clusterAddr, entryAddr);
-			entryAddr++;
-			if(entry->attr & 0x01)
+			DirEntry *entry = (DirEntry*) (cluster + i * DIR_ENTRY_BYTES);
+			if((entry->attr & 0x1) && !(entry->attr & 0x20))
 			{
-				char fileName[47];
-				char timeStr[20];
-				char fileInfo[100];
-				char temp[50];
-				strcpy(fileInfo, "    ");
-				strncpy(fileName, entry->fileName, FILE_NAME_MAX);
-				if((entry->attr & 0x10) ^ 0x10)
+				DirIndexEntry *indexEntry = calloc(1, sizeof(*indexEntry));
+				memcpy(indexEntry->fileName, entry->fileName, sizeof(indexEntry->fileName) - 1);
+				memcpy(indexEntry->fileExt, entry->fileExt, sizeof(indexEntry->fileExt) - 1);
+				indexEntry->attr = entry->attr;
+				indexEntry->startCluster = entry->startCluster;
+				indexEntry->entryAddr = entryAddr;
+				indexEntry->next = entries;
+				entries = indexEntry;
+				count++;
+			}
+		}
+		currentCluster = fs->fileAllocTable[currentCluster];
+	}
+	free(cluster);
+
+	/* Size the table for the entries found, at two entries per bucket */
+	while(buckets * 2 < count)
+		buckets *= 2;
+	DirSnapshot *snapshot = calloc(1, sizeof(*snapshot) + buckets * sizeof(DirIndexEntry*));
+	snapshot->buckets = buckets;
+	while(entries)
+	{
+		DirIndexEntry *indexEntry = entries;
+		entries = indexEntry->next;
+		insertDirSnapshotEntry(snapshot, indexEntry);
+	}
+
+	index = calloc(1, sizeof(*index));
+	index->dirCluster = dirCluster;
+	index->snapshot = snapshot;
+	index->next = fs->dirIndexes[dirCluster % DIR_INDEX_BUCKETS];
+	__atomic_store_n(&fs->dirIndexes[dirCluster % DIR_INDEX_BUCKETS], index, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fs->dirIndexLock);
+	unlockDir(fs, dirCluster);
+
+	return index;
+}
+
+/**
+ * Searches the index of a directory for a file, building the index if
+ * it has not been built. Once the index is built the search takes no
+ * lock.
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster of the directory
+ * @param  fileName   The name of the file to locate
+ * @param  fileExt    The extension of the file to locate
+ * @param  found      Set to a copy of the file's index entry if it is found
+ * @return            1 if the file was found, 0 otherwise
+ */
+int lookupDirIndex(BC_FS *fs, u_int dirCluster, char *fileName, char *fileExt, DirIndexEntry *found)
+{
+	DirIndex *index = getDirIndex(fs, dirCluster);
+
+	u_int token = enterDirSnapshot(fs);
+	DirSnapshot *snapshot = __atomic_load_n(&index->snapshot, __ATOMIC_ACQUIRE);
+	DirIndexEntry *indexEntry = lookupDirSnapshot(snapshot, fileName, fileExt);
+	if(indexEntry)
+	{
+		*found = *indexEntry;
+		found->next = NULL;
+	}
+	leaveDirSnapshot(fs, token);
+
+	return indexEntry != NULL;
+}
+
+/**
+ * Returns the index entry of a file in a directory index snapshot
+ *
+ * @param  snapshot The snapshot to search
+ * @param  fileName The name of the file to locate
+ * @param  fileExt  The extension of the file to locate
+ * @return          The file's index entry, or NULL if the file does not exist
+ */
+DirIndexEntry *lookupDirSnapshot(DirSnapshot *snapshot, char *fileName, char *fileExt)
+{
+	DirIndexEntry *indexEntry = snapshot->table[hashDirEntryName(fileName, fileExt) % snapshot->buckets];
+	while(indexEntry)
+	{
+		if(strncmp(indexEntry->fileName, fileName, FILE_NAME_MAX) == 0 && 
+		   strncmp(indexEntry->fileExt, fileExt, FILE_EXT_SIZE) == 0)
+			return indexEntry;
+		indexEntry = indexEntry->next;
+	}
+
+	return NULL;
+}
+
+/**
+ * Inserts an index entry at the head of its bucket of a snapshot which
+ * has not been published. The entries already in the bucket are not 
+ * changed.
+ *
+ * @param snapshot   The snapshot
+ * @param indexEntry The index entry
+ */
+void insertDirSnapshotEntry(DirSnapshot *snapshot, DirIndexEntry *indexEntry)
+{
+	u_int bucket = hashDirEntryName(indexEntry->fileName, indexEntry->fileExt) % snapshot->buckets;
+	indexEntry->next = snapshot->table[bucket];
+	snapshot->table[bucket] = indexEntry;
+	snapshot->count++;
+}
+
+/**
+ * Returns a copy of a published snapshot for a change to be made to. 
+ * The copy shares the entries of the snapshot. When the snapshot holds
+ * twice as many entries as it has buckets the copy is given twice the
+ * buckets instead, with copies of all the entries, and the entries of 
+ * the snapshot are retired.
+ *
+ * @param  fs       The file system
+ * @param  snapshot The published snapshot
+ * @return          The copy
+ */
+DirSnapshot *copyDirSnapshot(BC_FS *fs, DirSnapshot *snapshot)
+{
+	u_int i;
+	u_int buckets = snapshot->buckets;
+
+	if(snapshot->count >= buckets * 2)
+		buckets *= 2;
+
+	DirSnapshot *copy = calloc(1, sizeof(*copy) + buckets * sizeof(DirIndexEntry*));
+	copy->buckets = buckets;
+	if(buckets == snapshot->buckets)
+	{
+		memcpy(copy->table, snapshot->table, buckets * sizeof(DirIndexEntry*));
+		copy->count = snapshot->count;
+		return copy;
+	}
+
+	for(i = 0; i < snapshot->buckets; i++)
+	{
+		DirIndexEntry *indexEntry;
+		for(indexEntry = snapshot->table[i]; indexEntry; indexEntry = indexEntry->next)
+		{
+			DirIndexEntry *moved = malloc(sizeof(*moved));
+			*moved = *indexEntry;
+			insertDirSnapshotEntry(copy, moved);
+			retireDirSnapshotMemory(fs, indexEntry);
+		}
+	}
+
+	return copy;
+}
+
+/**
+ * Removes a file from a snapshot which has not been published. The 
+ * entries ahead of the file in its bucket are copied, since they are
+ * shared with the published snapshot, and the originals and the 
+ * file's entry are retired.
+ *
+ * @param fs       The file system
+ * @param snapshot The snapshot
+ * @param fileName The name of the file
+ * @param fileExt  The extension of the file
+ */
+void unlinkDirSnapshotEntry(BC_FS *fs, DirSnapshot *snapshot, char *fileName, char *fileExt)
+{
+	u_int bucket = hashDirEntryName(fileName, fileExt) % snapshot->buckets;
+	DirIndexEntry *removed = lookupDirSnapshot(snapshot, fileName, fileExt);
+	if(!removed)
+		return;
+
+	DirIndexEntry *head = removed->next;
+	DirIndexEntry **link = &head;
+	DirIndexEntry *indexEntry;
+	for(indexEntry = snapshot->table[bucket]; indexEntry != removed; indexEntry = indexEntry->next)
+	{
+		DirIndexEntry *copy = malloc(sizeof(*copy));
+		*copy = *indexEntry;
+		copy->next = removed->next;
+		*link = copy;
+		link = &copy->next;
+		retireDirSnapshotMemory(fs, indexEntry);
+	}
+	retireDirSnapshotMemory(fs, removed);
+
+	snapshot->table[bucket] = head;
+	snapshot->count--;
+}
+
+/**
+ * Publishes a changed snapshot as the snapshot of an index and retires
+ * the snapshot it replaces. The caller must hold dirIndexLock.
+ *
+ * @param fs       The file system
+ * @param index    The directory index
+ * @param snapshot The changed snapshot
+ */
+void publishDirSnapshot(BC_FS *fs, DirIndex *index, DirSnapshot *snapshot)
+{
+	DirSnapshot *old = index->snapshot;
+
+	__atomic_store_n(&index->snapshot, snapshot, __ATOMIC_RELEASE);
+	retireDirSnapshotMemory(fs, old);
+	if(fs->retiredCount >= DIR_SNAPSHOT_RETIRE_MAX)
+		reclaimDirSnapshots(fs);
+}
+
+/**
+ * Retires memory which has been removed from the published snapshots,
+ * to be freed once no search can still be reading it. The caller must
+ * hold dirIndexLock.
+ *
+ * @param fs  The file system
+ * @param ptr The memory to retire
+ */
+void retireDirSnapshotMemory(BC_FS *fs, void *ptr)
+{
+	if(fs->retiredCount == fs->retiredSize)
+	{
+		fs->retiredSize = fs->retiredSize ? fs->retiredSize * 2 : DIR_SNAPSHOT_RETIRE_MAX;
+		fs->retiredSnapshots = realloc(fs->retiredSnapshots, fs->retiredSize * sizeof(void*));
+	}
+	fs->retiredSnapshots[fs->retiredCount++] = ptr;
+}
+
+/**
+ * Frees the retired snapshot memory. The epoch is advanced, so new 
+ * searches are counted against the new epoch, and the searches counted
+ * against the previous epoch (which may have been reading the retired
+ * memory) are waited for. The caller must hold dirIndexLock.
+ *
+ * @param fs The file system
+ */
+void reclaimDirSnapshots(BC_FS *fs)
+{
+	u_int i;
+	u_int parity = fs->snapshotEpoch & 1;
+
+	__atomic_store_n(&fs->snapshotEpoch, fs->snapshotEpoch + 1, __ATOMIC_SEQ_CST);
+	for(i = 0; i < DIR_SNAPSHOT_SLOTS; i++)
+		while(__atomic_load_n(&fs->snapshotReaders[i].count[parity], __ATOMIC_ACQUIRE))
+			sched_yield();
+
+	for(i = 0; i < fs->retiredCount; i++)
+		free(fs->retiredSnapshots[i]);
+	fs->retiredCount = 0;
+}
+
+/**
+ * Starts a search of the directory index snapshots. The search is 
+ * counted against the current epoch in the counter of the calling 
+ * thread's slot, checking the epoch again in case it was advanced 
+ * before the search was counted.
+ *
+ * @param  fs The file system
+ * @return    A token to pass to leaveDirSnapshot()
+ */
+u_int enterDirSnapshot(BC_FS *fs)
+{
+	u_int slot = ((uint64_t) pthread_self() * 0x9e3779b97f4a7c15ULL) >> 58;
+
+	for(;;)
+	{
+		u_int epoch = __atomic_load_n(&fs->snapshotEpoch, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&fs->snapshotReaders[slot].count[epoch & 1], 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&fs->snapshotEpoch, __ATOMIC_SEQ_CST) == epoch)
+			return slot * 2 + (epoch & 1);
+		__atomic_fetch_sub(&fs->snapshotReaders[slot].count[epoch & 1], 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Ends a search of the directory index snapshots started by
+ * enterDirSnapshot()
+ *
+ * @param fs    The file system
+ * @param token The token returned by enterDirSnapshot()
+ */
+void leaveDirSnapshot(BC_FS *fs, u_int token)
+{
+	__atomic_fetch_sub(&fs->snapshotReaders[token / 2].count[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds a new directory entry to the index of its directory, if the 
+ * directory's index has been built
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ * @param entry      The directory entry
+ * @param entryAddr  The address of the entry within the directory
+ */
+void addDirIndexEntry(BC_FS *fs, u_int dirCluster, DirEntry *entry, u_int entryAddr)
+{
+	pthread_mutex_lock(&fs->dirIndexLock);
+	DirIndex *index = findDirIndex(fs, dirCluster);
+	if(index)
+	{
+		DirIndexEntry *indexEntry = calloc(1, sizeof(*indexEntry));
+		memcpy(indexEntry->fileName, entry->fileName, sizeof(indexEntry->fileName) - 1);
+		memcpy(indexEntry->fileExt, entry->fileExt, sizeof(indexEntry->fileExt) - 1);
+		indexEntry->attr = entry->attr;
+		indexEntry->startCluster = entry->startCluster;
+		indexEntry->entryAddr = entryAddr;
+
+		DirSnapshot *snapshot = copyDirSnapshot(fs, index->snapshot);
+		insertDirSnapshotEntry(snapshot, indexEntry);
+		publishDirSnapshot(fs, index, snapshot);
+	}
+	pthread_mutex_unlock(&fs->dirIndexLock);
+}
+
+/**
+ * Removes a file from the index of its directory, if the directory's
+ * index has been built
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ * @param fileName   The name of the file
+ * @param fileExt    The extension of the file
+ */
+void removeDirIndexEntry(BC_FS *fs, u_int dirCluster, char *fileName, char *fileExt)
+{
+	pthread_mutex_lock(&fs->dirIndexLock);
+	DirIndex *index = findDirIndex(fs, dirCluster);
+	if(index && lookupDirSnapshot(index->snapshot, fileName, fileExt))
+	{
+		DirSnapshot *snapshot = copyDirSnapshot(fs, index->snapshot);
+		unlinkDirSnapshotEntry(fs, snapshot, fileName, fileExt);
+		publishDirSnapshot(fs, index, snapshot);
+	}
+	pthread_mutex_unlock(&fs->dirIndexLock);
+}
+
+/**
+ * Frees all directory indexes and the retired snapshot memory. No
+ * search may be running.
+ *
+ * @param fs The file system
+ */
+void destroyDirIndexes(BC_FS *fs)
+{
+	u_int i;
+	u_int j;
+
+	for(i = 0; i < DIR_INDEX_BUCKETS; i++)
+	{
+		while(fs->dirIndexes[i])
+		{
+			DirIndex *index = fs->dirIndexes[i];
+			fs->dirIndexes[i] = index->next;
+			for(j = 0; j < index->snapshot->buckets; j++)
+			{
+				while(index->snapshot->table[j])
 				{
-					strncat(fileName, ".", 1);
-					strncat(fileName, entry->fileExt, FILE_EXT_SIZE);
+					DirIndexEntry *indexEntry = index->snapshot->table[j];
+					index->snapshot->table[j] = indexEntry->next;
+					free(indexEntry);
 				}
-				sprintf(temp, "%-18s", fileName);
-				strcat(fileInfo, temp);
+			}
+			free(index->snapshot);
+			free(index);
+		}
+	}
+
+	for(i = 0; i < fs->retiredCount; i++)
+		free(fs->retiredSnapshots[i]);
+	free(fs->retiredSnapshots);
+	fs->retiredSnapshots = NULL;
+	fs->retiredCount = 0;
+	fs->retiredSize = 0;
+	free(fs->snapshotReaders);
+	fs->snapshotReaders = NULL;
+}
+
+/** 
+ * ======================================================================== 
+ * |                   Directory B-Tree Operations                        | 
+ * ======================================================================== 
+ *
+ *     This section holds the operations on the B-trees of large 
+ *     directories. A directory with a directory header is given a B-tree
+ *     once its entries reach DIR_BTREE_THRESHOLD entry addresses. The
+ *     directory's entries stay where they are in the directory cluster
+ *     chain, so the directory can still be read by scanning its entries.
+ *     The B-tree is a B+ tree of clusters which maps the hash of each
+ *     entry's name and extension to the entry, letting an entry be 
+ *     located by reading one cluster per level of the tree and without
+ *     walking the directory cluster chain. 
+ *
+ *     Each node of the tree is one cluster, laid out as follows:
+ *
+ *        (bytes)  | value 
+ *       ---------------------------------------------------------------
+ *        (0-3)    | 1 for a leaf node, 0 for an internal node
+ *        (4-7)    | The number of keys in the node
+ *        (8-11)   | Leaf node: the cluster of the next leaf (0 if last)
+ *                   Internal node: the child holding keys below key 0
+ *        (12-15)  | This space is unused
+ *        (16-...) | The keys of the node in ascending order, 12 bytes each
+ *                     (0-3)  The hash of the entry's name and extension
+ *                     (4-7)  The entry address of the entry
+ *                     (8-11) Leaf node: the directory cluster holding 
+ *                                       the entry
+ *                            Internal node: the child holding keys 
+ *                                           from this key up to the
+ *                                           next key
+ *
+ *     Keys are ordered by hash and then by entry address, which makes
+ *     every key unique. Names which share a hash are told apart by 
+ *     reading their entries. Deleting an entry removes its key from its
+ *     leaf without merging nodes, so nodes may be left underfull.
+ */
+
+/**
+ * Writes an empty directory header into entry 0 of a directory
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ */
+void initDirHeader(BC_FS *fs, u_int dirCluster)
+{
+	DirEntry header;
+	memset(&header, 0, sizeof(header));
+	header.attr = 0x2d;
+	header.createDate = encodeTimeBytes();
+	header.modifiedDate = header.createDate;
+	header.fileSize = 1;
+	writeDirHeader(fs, dirCluster, &header);
+}
+
+/**
+ * Reads the directory header of a directory
+ *
+ * @param  fs         The file system
+ * @param  dirCluster The starting cluster of the directory
+ * @param  header     Set to the directory header
+ * @return            1 if the directory has a header, 0 otherwise
+ */
+int readDirHeader(BC_FS *fs, u_int dirCluster, DirEntry *header)
+{
+	readVirDrive(fs, header, getClusterLoc(fs, dirCluster), sizeof(*header));
+
+	return (header->attr & 0x21) == 0x21;
+}
+
+/**
+ * Writes the directory header of a directory
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ * @param header     The directory header
+ */
+void writeDirHeader(BC_FS *fs, u_int dirCluster, DirEntry *header)
+{
+	writeVirDrive(fs, header, getClusterLoc(fs, dirCluster), sizeof(*header));
+}
+
+/**
+ * Records a new directory entry in the directory's header and B-tree. 
+ * The free entry hint is moved past the entry and, if the directory 
+ * has reached DIR_BTREE_THRESHOLD entries, its B-tree is built.
+ *
+ * @param fs           The file system
+ * @param dirCluster   The starting cluster of the directory
+ * @param entry        The new directory entry
+ * @param entryAddr    The address of the entry within the directory
+ * @param entryCluster The directory cluster holding the entry
+ */
+void addDirBTreeEntry(BC_FS *fs, u_int dirCluster, DirEntry *entry, u_int entryAddr, u_int entryCluster)
+{
+	DirEntry header;
+	if(!readDirHeader(fs, dirCluster, &header))
+		return;
+
+	if(header.fileSize <= entryAddr)
+		header.fileSize = entryAddr + 1;
+
+	if(header.startCluster)
+		insertDirBTreeEntry(fs, &header, entry, entryAddr, entryCluster);
+	else if(entryAddr >= DIR_BTREE_THRESHOLD)
+		buildDirBTree(fs, dirCluster, &header);
+
+	writeDirHeader(fs, dirCluster, &header);
+}
+
+/**
+ * Inserts a directory entry into the B-tree whose root is recorded in
+ * the given directory header. If the root is split, the new root is 
+ * recorded in the header. If the drive is too full to split a node, 
+ * the B-tree is freed and the header records that the directory has no
+ * B-tree. The header is not written.
+ *
+ * @param fs           The file system
+ * @param header       The directory header
+ * @param entry        The directory entry
+ * @param entryAddr    The address of the entry within the directory
+ * @param entryCluster The directory cluster holding the entry
+ */
+void insertDirBTreeEntry(BC_FS *fs, DirEntry *header, DirEntry *entry, u_int entryAddr, u_int entryCluster)
+{
+	BTreeKey key;
+	BTreeKey promoted;
+
+	key.hash = hashDirEntryName(entry->fileName, entry->fileExt);
+	key.entryAddr = entryAddr;
+	key.ptr = entryCluster;
+
+	int split = insertBTreeKey(fs, header->startCluster, &key, &promoted);
+	if(split == 1)
+	{
+		/* The root was split, grow the tree by one level */
+		u_int rootCluster = allocateCluster(fs);
+		if(rootCluster)
+		{
+			BTreeNode *root = calloc(1, fs->bootRecord->bytesPerCluster);
+			root->leaf = 0;
+			root->count = 1;
+			root->link = header->startCluster;
+			root->keys[0] = promoted;
+			writeBTreeNode(fs, rootCluster, root);
+			free(root);
+			header->startCluster = rootCluster;
+		}
+		else
+			split = -1;
+	}
+
+	if(split == -1)
+	{
+		/* The drive is full, fall back to scanning the directory */
+		freeDirBTree(fs, header->startCluster);
+		header->startCluster = 0;
+	}
+}
+
+/**
+ * Removes a deleted directory entry from the directory's B-tree and
+ * moves the directory's free entry hint back to the entry.
+ *
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ * @param entry      The directory entry being deleted
+ * @param entryAddr  The address of the entry within the directory
+ */
+void removeDirBTreeEntry(BC_FS *fs, u_int dirCluster, DirEntry *entry, u_int entryAddr)
+{
+	u_int pos;
+	DirEntry header;
+	if(!readDirHeader(fs, dirCluster, &header))
+		return;
 
-				if((entry->attr & 0x10) ^ 0x10)
-					sprintf(temp, " | %9u", entry->fileSize);
-				else
-					sprintf(temp, " |     -    ");
-				strcat(fileInfo, temp);
+	if(entryAddr < header.fileSize)
+		header.fileSize = entryAddr;
 
-				struct tm *createTime = decodeTimeBytes(entry->createDate);
+	if(header.startCluster)
+	{
+		BTreeKey key;
+		key.hash = hashDirEntryName(entry->fileName, entry->fileExt);
+		key.entryAddr = entryAddr;
 
-				sprintf(timeStr, "%04d-%02d-%02d %02d:%02d:%02d",
-					    createTime->tm_year,
-					    createTime->tm_mon,
-					    createTime->tm_mday,
-					    createTime->tm_hour,
-					    createTime->tm_min,
-					    createTime->tm_sec);
-				free(createTime);
-				sprintf(temp, " | %19s", timeStr);
-				strcat(fileInfo, temp);
+		/* Descend to the leaf which holds the key */
+		u_int nodeCluster = header.startCluster;
+		BTreeNode *node = readBTreeNode(fs, nodeCluster);
+		while(!node->leaf)
+		{
+			nodeCluster = findBTreeChild(node, &key);
+			free(node);
+			node = readBTreeNode(fs, nodeCluster);
+		}
 
-				struct tm *modifiedTime = decodeTimeBytes(entry->modifiedDate);
+		for(pos = 0; pos < node->count; pos++)
+		{
+			if(compareBTreeKeys(&node->keys[pos], &key) == 0)
+			{
+				memmove(&node->keys[pos], &node->keys[pos + 1], (node->count - pos - 1) * sizeof(BTreeKey));
+				node->count--;
+				writeBTreeNode(fs, nodeCluster, node);
+				break;
+			}
+		}
+		free(node);
+	}
 
-				sprintf(timeStr, "%04d-%02d-%02d %02d:%02d:%02d",
-					    modifiedTime->tm_year,
-					    modifiedTime->tm_mon,
-					    modifiedTime->tm_mday,
-					    modifiedTime->tm_hour,
-					    modifiedTime->tm_min,
-					    modifiedTime->tm_sec);
-				free(modifiedTime);
-				sprintf(temp, " | %19s", timeStr);
-				strcat(fileInfo, temp);
+	writeDirHeader(fs, dirCluster, &header);
+}
 
-				sprintf(temp, " | %13u", entry->startCluster);
-				strcat(fileInfo, temp);
+/**
+ * Searches a directory B-tree for a file
+ *
+ * @param  fs       The file system
+ * @param  root     The root cluster of the B-tree
+ * @param  fileName The name of the file to locate
+ * @param  fileExt  The extension of the file to locate
+ * @param  entry    Set to the file's directory entry if it is found
+ * @return          The file's directory entry address, or 0xffffffff
+ *                  if the file does not exist
+ */
+u_int lookupDirBTree(BC_FS *fs, u_int root, char *fileName, char *fileExt, DirEntry *entry)
+{
+	u_int pos;
+	u_int nodeCluster = root;
+	BTreeKey key;
 
-				strcat(listing, fileInfo);
-				strcat(listing, "\n");
-			
-				if(entryAddr % DIR_ENTRIES_PER_CLUSTER == 0)
-				{
-					currentCluster = fileAllocTable[currentCluster];
-					if(currentCluster == 0xffffffff) /* No more entries to check */
-						end = 1;
-				}
-				i++;
-			}
-			free(entry);
+	/* No key is smaller than this key with the same hash, since entry 0
+	   of a directory with a B-tree is always its header */
+	key.hash = hashDirEntryName(fileName, fileExt);
+	key.entryAddr = 0;
+
+	BTreeNode *node = readBTreeNode(fs, nodeCluster);
+	while(!node->leaf)
+	{
+		nodeCluster = findBTreeChild(node, &key);
+		free(node);
+		node = readBTreeNode(fs, nodeCluster);
+	}
+
+	/* Check each key with a matching hash, which may continue into the
+	   following leaves */
+	pos = 0;
+	while(pos < node->count && compareBTreeKeys(&node->keys[pos], &key) < 0)
+		pos++;
+	while(1)
+	{
+		if(pos == node->count)
+		{
+			if(node->link == 0)
+				break;
+			nodeCluster = node->link;
+			free(node);
+			node = readBTreeNode(fs, nodeCluster);
+			pos = 0;
+			continue;
 		}
-		strcat(listing, "  ==============================================================================================\n");
+		if(node->keys[pos].hash != key.hash)
+			break;
+
+		u_int entryAddr = node->keys[pos].entryAddr;
+		off_t loc = getClusterLoc(fs, node->keys[pos].ptr);
+		loc += (entryAddr % getDirEntriesPerCluster(fs)) * DIR_ENTRY_BYTES;
+		readVirDrive(fs, entry, loc, sizeof(*entry));
+		if((entry->attr & 0x1) &&
+		   strncmp(entry->fileName, fileName, FILE_NAME_MAX) == 0 && 
+		   strncmp(entry->fileExt, fileExt, FILE_EXT_SIZE) == 0)
+		{
+			free(node);
+			return entryAddr;
+		}
+		pos++;
 	}
+	free(node);
 
-	return listing;
+	return 0xffffffff;
 }
 
 /**
- * Returns the directory cluster address of a directory. Searches through a 
- * given directory for a subdirectory of a given name. Returns 0 if no matching 
- * directory is found.
+ * Builds the B-tree of a directory from the directory's entries and
+ * records its root in the given directory header. The header is not
+ * written.
  *
- * @param  currentClusterAddr The cluster address of the directory to search
- * @param  dirName            The name of the directory to locate
- * @return                    The cluster address of the directory to locate
+ * @param fs         The file system
+ * @param dirCluster The starting cluster of the directory
+ * @param header     The directory header
  */
-u_int getDirectoryClusterAddress(u_int currentClusterAddr, char *dirName)
+void buildDirBTree(BC_FS *fs, u_int dirCluster, DirEntry *header)
 {
-	int end = 0;
-	int found = 0;
+	u_int i;
 	u_int entryAddr = 0;
-	u_int currentCluster = currentClusterAddr;
-	u_int nextCluster = 0;
-	u_int dirClusterAddress = 0;
-	DirEntry *entry;
+	u_int currentCluster = dirCluster;
 
-	while(!found && !end)
+	u_int rootCluster = allocateCluster(fs);
+	if(!rootCluster)
+		return;
+
+	BTreeNode *root = calloc(1, fs->bootRecord->bytesPerCluster);
+	root->leaf = 1;
+	writeBTreeNode(fs, rootCluster, root);
+	free(root);
+	header->startCluster = rootCluster;
+
+	char *cluster = malloc(fs->bootRecord->bytesPerCluster);
+	while(currentCluster != 0xffffffff && header->startCluster)
 	{
-		entry = getDirEntry(currentClusterAddr, entryAddr);
-		entryAddr++;
-		if(entry->attr & 0x10) /* Subdirectory */
+		readVirDrive(fs, cluster, getClusterLoc(fs, currentCluster), fs->bootRecord->bytesPerCluster);
+		for(i = 0; i < getDirEntriesPerCluster(fs) && header->startCluster; i++, entryAddr++)
 		{
-			if(strcmp(entry->fileName, dirName) == 0)
-			{
-				found = 1;
-				dirClusterAddress = entry->startCluster;
-			}
+			DirEntry *entry = (DirEntry*) (cluster + i * DIR_ENTRY_BYTES);
+			if((entry->attr & 0x1) && !(entry->attr & 0x20))
+				insertDirBTreeEntry(fs, header, entry, entryAddr, currentCluster);
 		}
-	
-		if(entryAddr % DIR_ENTRIES_PER_CLUSTER == 0)
+		currentCluster = fs->fileAllocTable[currentCluster];
+	}
+	free(cluster);
+}
+
+/**
+ * Frees every cluster of a B-tree
+ *
+ * @param fs          The file system
+ * @param nodeCluster The root cluster of the B-tree
+ */
+void freeDirBTree(BC_FS *fs, u_int nodeCluster)
+{
+	u_int i;
+	BTreeNode *node = readBTreeNode(fs, nodeCluster);
+
+	if(!node->leaf)
+	{
+		freeDirBTree(fs, node->link);
+		for(i = 0; i < node->count; i++)
+			freeDirBTree(fs, node->keys[i].ptr);
+	}
+	free(node);
+	setFATEntry(fs, nodeCluster, 0x0);
+}
+
+/**
+ * Returns the number of keys which fit in one B-tree node
+ *
+ * @param  fs The file system
+ * @return The maximum number of keys in a node
+ */
+u_int getBTreeNodeCapacity(BC_FS *fs)
+{
+	return (fs->bootRecord->bytesPerCluster - sizeof(BTreeNode)) / sizeof(BTreeKey);
+}
+
+/**
+ * Reads a B-tree node. The returned node has room for one key more
+ * than its capacity, so that a key can be inserted before it is split.
+ * The caller is responsible for freeing the node.
+ *
+ * @param  fs          The file system
+ * @param  nodeCluster The cluster of the node
+ * @return             The node
+ */
+BTreeNode *readBTreeNode(BC_FS *fs, u_int nodeCluster)
+{
+	BTreeNode *node = malloc(fs->bootRecord->bytesPerCluster + sizeof(BTreeKey));
+	readVirDrive(fs, node, getClusterLoc(fs, nodeCluster), fs->bootRecord->bytesPerCluster);
+
+	return node;
+}
+
+/**
+ * Writes a B-tree node
+ *
+ * @param fs          The file system
+ * @param nodeCluster The cluster of the node
+ * @param node        The node
+ */
+void writeBTreeNode(BC_FS *fs, u_int nodeCluster, BTreeNode *node)
+{
+	writeVirDrive(fs, node, getClusterLoc(fs, nodeCluster), fs->bootRecord->bytesPerCluster);
+}
+
+/**
+ * Compares two B-tree keys by hash and then by entry address
+ *
+ * @param  a The first key
+ * @param  b The second key
+ * @return   A negative value, 0 or a positive value if the first key is
+ *           less than, equal to or greater than the second key
+ */
+int compareBTreeKeys(BTreeKey *a, BTreeKey *b)
+{
+	if(a->hash != b->hash)
+		return a->hash < b->hash ? -1 : 1;
+	if(a->entryAddr != b->entryAddr)
+		return a->entryAddr < b->entryAddr ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * Returns the child of an internal B-tree node whose subtree holds 
+ * the given key
+ *
+ * @param  node The internal node
+ * @param  key  The key
+ * @return      The cluster of the child
+ */
+u_int findBTreeChild(BTreeNode *node, BTreeKey *key)
+{
+	u_int pos = 0;
+	while(pos < node->count && compareBTreeKeys(&node->keys[pos], key) <= 0)
+		pos++;
+
+	return pos == 0 ? node->link : node->keys[pos - 1].ptr;
+}
+
+/**
+ * Inserts a key into the subtree rooted at the given node. If the node
+ * overflows, it is split in two and the key which separates the two
+ * halves is returned to be inserted into the node's parent.
+ *
+ * @param  fs          The file system
+ * @param  nodeCluster The cluster of the node
+ * @param  key         The key to insert
+ * @param  promoted    Set to the separating key if the node was split; 
+ *                     its pointer is the new right half of the node
+ * @return             0 if the node was not split, 1 if it was split,
+ *                     -1 if a cluster for a split could not be allocated
+ */
+int insertBTreeKey(BC_FS *fs, u_int nodeCluster, BTreeKey *key, BTreeKey *promoted)
+{
+	u_int pos = 0;
+	u_int capacity = getBTreeNodeCapacity(fs);
+	BTreeKey childPromoted;
+	BTreeNode *node = readBTreeNode(fs, nodeCluster);
+
+	while(pos < node->count && compareBTreeKeys(&node->keys[pos], key) <= 0)
+		pos++;
+
+	if(!node->leaf)
+	{
+		u_int child = pos == 0 ? node->link : node->keys[pos - 1].ptr;
+		int split = insertBTreeKey(fs, child, key, &childPromoted);
+		if(split != 1)
 		{
-			nextCluster = fileAllocTable[currentCluster];
-			if(nextCluster == 0xffffffff)
-				end = 1;
-			currentCluster = nextCluster;
+			free(node);
+			return split;
 		}
-		free(entry);
+		key = &childPromoted;
 	}
 
-	return dirClusterAddress;
+	memmove(&node->keys[pos + 1], &node->keys[pos], (node->count - pos) * sizeof(BTreeKey));
+	node->keys[pos] = *key;
+	node->count++;
+
+	if(node->count <= capacity)
+	{
+		writeBTreeNode(fs, nodeCluster, node);
+		free(node);
+		return 0;
+	}
+
+	/* Split the node, moving its upper half into a new node */
+	u_int rightCluster = allocateCluster(fs);
+	if(!rightCluster)
+	{
+		free(node);
+		return -1;
+	}
+
+	BTreeNode *right = calloc(1, fs->bootRecord->bytesPerCluster);
+	u_int mid = node->count / 2;
+	right->leaf = node->leaf;
+	if(node->leaf)
+	{
+		/* The first key of the right leaf separates the leaves */
+		right->count = node->count - mid;
+		memcpy(right->keys, &node->keys[mid], right->count * sizeof(BTreeKey));
+		right->link = node->link;
+		node->link = rightCluster;
+		*promoted = right->keys[0];
+	}
+	else
+	{
+		/* The middle key moves up, its child becomes the right node's
+		   leftmost child */
+		right->count = node->count - mid - 1;
+		memcpy(right->keys, &node->keys[mid + 1], right->count * sizeof(BTreeKey));
+		right->link = node->keys[mid].ptr;
+		*promoted = node->keys[mid];
+	}
+	promoted->ptr = rightCluster;
+	node->count = mid;
+
+	writeBTreeNode(fs, nodeCluster, node);
+	writeBTreeNode(fs, rightCluster, right);
+	free(node);
+	free(right);
+
+	return 1;
 }
 
+/** 
+ * ======================================================================== 
+ * |                      Path Cache Operations                           | 
+ * ======================================================================== 
+ *
+ *     This section holds the operations of the path cache, which maps 
+ *     directory paths (such as "directory1/directory2") to the starting
+ *     cluster of the directory. Every prefix of a path resolved by
+ *     resolveDirPath() is cached, so repeated opens under the same 
+ *     directories do not walk the directory tree from the root. A path 
+ *     which does not exist is cached as a negative entry with a cluster
+ *     address of 0.
+ *
+ *     Directories are never moved, so positive entries stay valid until
+ *     a subdirectory entry is deleted, which drops the whole cache. 
+ *     Creating a subdirectory drops the negative entries. The cache is
+ *     dropped when it grows past PATH_CACHE_MAX entries. The cache is
+ *     guarded by pathCacheLock. Entries for a directory are only added
+ *     while the lock of its parent is held, so an entry never outlives
+ *     a change to the parent which makes it stale. The cache is not 
+ *     used when directory indexes are enabled.
+ */
+
 /**
- * Returns 4 bytes containing a time stamp of the current time. The layout
- * of the time stamp is as follows:
- *    Bits 0-5:   Year - 1985
- *    Bits 6-9:   Month
- *    Bits 10-14: Day
- *    Bits 15-19: Hour
- *    Bits 20-25: Minute
- *    Bits 26-31: Second
+ * Returns the starting cluster of the directory at the given path. 
+ * The path is given as an array of directory names starting from the
+ * root directory.
  *
- * @return A time stamp encoded in 4 bytes
+ * @param  fs     The file system
+ * @param  path   The directory names of the path
+ * @param  depth  The number of names of the path to resolve (0 for the
+ *                root directory)
+ * @param  create 1 to create any directories of the path which do not
+ *                exist, 0 otherwise
+ * @return        The starting cluster of the directory, or 0 if it does
+ *                not exist (or could not be created)
  */
-u_int encodeTimeBytes()
+u_int resolveDirPath(BC_FS *fs, char **path, u_int depth, int create)
 {
-	u_int timeBytes = 0;
+	u_int i;
+	u_int len = 0;
+	u_int clusterAddr = fs->bootRecord->rootDirStart;
+	u_int nextClusterAddr;
 
-	time_t calTime = time(NULL);
-	struct tm *localTime = localtime(&calTime);
+	if(depth == 0)
+		return clusterAddr;
 
-	timeBytes ^= ((localTime->tm_year - 85) & 0x3f);
-	timeBytes <<= 4;
-	timeBytes ^= ((localTime->tm_mon + 1) & 0xf);
-	timeBytes <<= 5;
-	timeBytes ^= (localTime->tm_mday & 0x1f);
-	timeBytes <<= 5;
-	timeBytes ^= ((localTime->tm_hour + 1) & 0x1f);
-	timeBytes <<= 6;
-	timeBytes ^= (localTime->tm_min & 0x3f);
-	timeBytes <<= 6;
-	timeBytes ^= (localTime->tm_sec & 0x3f);
-	
-	return timeBytes;
+	/* With directory indexes each directory is searched without a lock,
+	   which costs no more than a search of the path cache, so the path
+	   cache is not used */
+	if(fs->dirIndexEnabled)
+	{
+		for(i = 0; i < depth && clusterAddr; i++)
+		{
+			nextClusterAddr = getDirectoryClusterAddress(fs, clusterAddr, path[i]);
+			if(nextClusterAddr == 0 && create)
+			{
+				lockDir(fs, clusterAddr, 1);
+				nextClusterAddr = getDirectoryClusterAddress(fs, clusterAddr, path[i]);
+				if(nextClusterAddr == 0)
+					nextClusterAddr = createDirPathEntry(fs, clusterAddr, path[i]);
+				unlockDir(fs, clusterAddr);
+			}
+			clusterAddr = nextClusterAddr;
+		}
+
+		return clusterAddr;
+	}
+
+	for(i = 0; i < depth; i++)
+		len += strlen(path[i]) + 1;
+	char *dirPath = calloc(len, sizeof(char));
+
+	/* Check for the whole path first */
+	for(i = 0; i < depth; i++)
+	{
+		if(i)
+			strcat(dirPath, "/");
+		strcat(dirPath, path[i]);
+	}
+	if(lookupPathCache(fs, dirPath, &nextClusterAddr) && (nextClusterAddr || !create))
+	{
+		free(dirPath);
+		return nextClusterAddr;
+	}
+
+	/* Walk the path, using the cache for each prefix of the path */
+	dirPath[0] = '\0';
+	for(i = 0; i < depth; i++)
+	{
+		if(i)
+			strcat(dirPath, "/");
+		strcat(dirPath, path[i]);
+
+		if(!lookupPathCache(fs, dirPath, &nextClusterAddr) || (!nextClusterAddr && create))
+		{
+			lockDir(fs, clusterAddr, 0);
+			nextClusterAddr = getDirectoryClusterAddress(fs, clusterAddr, path[i]);
+			if(nextClusterAddr == 0 && create)
+			{
+				/* Search again under the write lock, in case another 
+				   thread has created the directory in the meantime */
+				unlockDir(fs, clusterAddr);
+				lockDir(fs, clusterAddr, 1);
+				nextClusterAddr = getDirectoryClusterAddress(fs, clusterAddr, path[i]);
+			}
+			if(nextClusterAddr == 0 && create) /* If directory is not found, create it */
+			{
+				nextClusterAddr = createDirPathEntry(fs, clusterAddr, path[i]);
+				if(nextClusterAddr == 0)
+				{
+					unlockDir(fs, clusterAddr);
+					free(dirPath);
+
+					return 0;
+				}
+			}
+			addPathCacheEntry(fs, dirPath, nextClusterAddr);
+			unlockDir(fs, clusterAddr);
+		}
+
+		clusterAddr = nextClusterAddr;
+		if(clusterAddr == 0)
+			break;
+	}
+	free(dirPath);
+
+	return clusterAddr;
 }
 
 /**
- * Returns a pointer to a struct containing the decoded components
- * of a 4 byte time stamp.
+ * Creates a directory of a path being resolved by resolveDirPath().
+ * The caller must hold the write lock of the parent directory.
  *
- * @param  timeBytes A time stamp encoded in 4 bytes
- * @return           A struct containing the decoded components
- *                   of a calendar time
+ * @param  fs          The file system
+ * @param  clusterAddr The starting cluster of the parent directory
+ * @param  dirName     The name of the directory to create
+ * @return             The starting cluster of the new directory, or 0
+ *                     if the drive is full
  */
-struct tm *decodeTimeBytes(u_int timeBytes)
+u_int createDirPathEntry(BC_FS *fs, u_int clusterAddr, char *dirName)
 {
-	struct tm *decodedTime = malloc(sizeof(*decodedTime));
+	u_int entryAddr = createDirSubEntry(fs, clusterAddr, 0x13, dirName);
+	if(entryAddr == 0xffffffff)
+	{
+		fprintf(stderr, "Could not create directory: drive is full\n");
+		return 0;
+	}
 
-	decodedTime->tm_sec = timeBytes & 0x3f;
-	timeBytes >>= 6;
-	decodedTime->tm_min = timeBytes & 0x3f;
-	timeBytes >>= 6;
-	decodedTime->tm_hour = timeBytes & 0x1f;
-	timeBytes >>= 5;
-	decodedTime->tm_mday = timeBytes & 0x1f;
-	timeBytes >>= 5;
-	decodedTime->tm_mon = timeBytes & 0xf;
-	timeBytes >>= 4;
-	decodedTime->tm_year = (timeBytes & 0x3f) + 1985;
+	DirEntry *entry = getDirEntry(fs, clusterAddr, entryAddr);
+	u_int startCluster = entry->startCluster;
+	free(entry);
 
-	return decodedTime;
+	return startCluster;
 }
 
-/**
- * Returns the offset (in bytes) from the beginning of the virtual drive
- * to the start of the starting data cluster.
+/**
+ * Returns the hash of a directory path (FNV-1a)
  *
- * @return  The drive offset of the starting data cluster in bytes
+ * @param  dirPath The directory path
+ * @return         The hash of the path
  */
-u_int getDataStartLoc()
+u_int hashDirPath(char *dirPath)
 {
-	u_int loc = 0;
-	/* Skip over boot cluster */
-	loc += bootRecord->bytesPerCluster * bootRecord->reservedClusters;
-	/* Skip over FAT */
-	loc += bootRecord->bytesPerCluster * bootRecord->clustersPerFat;
+	u_int hash = 2166136261u;
+	while(*dirPath)
+		hash = (hash ^ (unsigned char) *dirPath++) * 16777619u;
 
-	return loc;
+	return hash;
 }
 
 /**
- * Returns the offset (in bytes) from the beginning of the virtual drive
- * to the start of the given directory cluster entry.
+ * Looks up a directory path in the path cache
  *
- * @param  dirCluster The starting cluster address of the directory cluster 
- *                    containing the entry
- * @param  entryAddr  The address of the entry within the directory cluster
- * @return            The drive offset of the given entry in bytes
+ * @param  fs          The file system
+ * @param  dirPath     The directory path
+ * @param  clusterAddr Set to the cached starting cluster of the directory
+ *                     (0 if the directory is cached as not existing)
+ * @return             1 if the path is cached, 0 otherwise
  */
-u_int getDirEntryLoc(u_int dirCluster, u_int entryAddr)
+int lookupPathCache(BC_FS *fs, char *dirPath, u_int *clusterAddr)
 {
-	u_int entry = 0;
-	u_int loc = 0;
-	u_int currentCluster = dirCluster;
-	u_int nextCluster = 0;
-
-	/* Skip to the given dir cluster */
-	loc += bootRecord->bytesPerCluster * currentCluster;
+	int found = 0;
 
-	while(entry < entryAddr)
+	pthread_rwlock_rdlock(&fs->pathCacheLock);
+	PathCacheEntry *cacheEntry = fs->pathCache[hashDirPath(dirPath) % PATH_CACHE_BUCKETS];
+	while(cacheEntry)
 	{
-		entry++;
-		loc += DIR_ENTRY_BYTES;
-		if(entry % DIR_ENTRIES_PER_CLUSTER == 0)
+		if(strcmp(cacheEntry->dirPath, dirPath) == 0)
 		{
-			nextCluster = fileAllocTable[currentCluster];
-			if(nextCluster == 0xffffffff)
-				loc = 0;
-			else
-				loc = bootRecord->bytesPerCluster * nextCluster;
-			currentCluster = nextCluster;
+			*clusterAddr = cacheEntry->clusterAddr;
+			found = 1;
+			break;
 		}
+		cacheEntry = cacheEntry->next;
 	}
-	assert(loc);
+	pthread_rwlock_unlock(&fs->pathCacheLock);
 
-	return loc;
+	return found;
 }
 
 /**
- * Returns the entry of the first free directory entry for a given
- * directory cluster. If the given directory cluster is full, the directory 
- * cluster chain will be extended.
+ * Adds a directory path to the path cache, replacing any entry already
+ * cached for the path
  *
- * @param  dirCluster The starting cluster of the directory
- * @return            The entry address of the first free directory entry
+ * @param fs          The file system
+ * @param dirPath     The directory path
+ * @param clusterAddr The starting cluster of the directory, or 0 if the
+ *                    directory does not exist
  */
-u_int getFirstFreeDirEntryAddr(u_int dirCluster)
+void addPathCacheEntry(BC_FS *fs, char *dirPath, u_int clusterAddr)
 {
-	int found = 0;
-	u_int entryAddr = 0;
-	u_int currentCluster = dirCluster;
-	u_int nextCluster = 0;
-	DirEntry *entry;
+	u_int bucket = hashDirPath(dirPath) % PATH_CACHE_BUCKETS;
 
-	while(!found)
+	pthread_rwlock_wrlock(&fs->pathCacheLock);
+	PathCacheEntry *cacheEntry = fs->pathCache[bucket];
+	while(cacheEntry)
 	{
-		entry = getDirEntry(currentCluster, entryAddr);
-		if((entry->attr & 0x1) ^ 0x1)
-			found = 1;
-		else
+		if(strcmp(cacheEntry->dirPath, dirPath) == 0)
 		{
-			entryAddr++;
-		
-			if(entryAddr % DIR_ENTRIES_PER_CLUSTER == 0)
-			{
-				nextCluster = fileAllocTable[currentCluster];
-				if(nextCluster == 0xffffffff)
-					nextCluster = addClusterToChain(currentCluster);
-				currentCluster = nextCluster;
-			}
+			cacheEntry->clusterAddr = clusterAddr;
+			pthread_rwlock_unlock(&fs->pathCacheLock);
+			return;
 		}
+		cacheEntry = cacheEntry->next;
 	}
 
-	return entryAddr;
+	if(fs->pathCacheCount >= PATH_CACHE_MAX)
+		clearPathCache(fs, 1);
+
+	cacheEntry = malloc(sizeof(*cacheEntry));
+	cacheEntry->dirPath = str_copy(dirPath);
+	cacheEntry->clusterAddr = clusterAddr;
+	cacheEntry->next = fs->pathCache[bucket];
+	fs->pathCache[bucket] = cacheEntry;
+	fs->pathCacheCount++;
+	pthread_rwlock_unlock(&fs->pathCacheLock);
 }
 
 /**
- * Returns a directory entry from a given directory
+ * Drops entries from the path cache
  *
- * @param  dirCluster The address of the directory cluster containing the entry
- * @param  entryAddr  The address of the entry within the directory cluster
- * @return            The directory entry struct
+ * @param fs       The file system
+ * @param positive 1 to drop every entry, 0 to drop only the negative
+ *                 entries
  */
-DirEntry *getDirEntry(u_int dirCluster, u_int entryAddr)
+void invalidatePathCache(BC_FS *fs, int positive)
 {
-	DirEntry *entry = calloc(1, sizeof(*entry));
-	u_int loc = getDirEntryLoc(dirCluster, entryAddr);
-	fseek(virDrive, loc, SEEK_SET);
-	fread(entry, sizeof(*entry), 1, virDrive);
-
-	return entry;
+	pthread_rwlock_wrlock(&fs->pathCacheLock);
+	clearPathCache(fs, positive);
+	pthread_rwlock_unlock(&fs->pathCacheLock);
 }
 
 /**
- * Sets a directory entry in a given directory
+ * Drops entries from the path cache. The caller must hold the path 
+ * cache lock for writing.
  *
- * @param  dirCluster The address of the directory cluster containing the entry
- * @param  entryAddr  The address of the entry within the directory cluster
- * @param  entry      The directory entry
+ * @param fs       The file system
+ * @param positive 1 to drop every entry, 0 to drop only the negative
+ *                 entries
  */
-void setDirEntry(u_int dirCluster, u_int entryAddr, DirEntry *entry)
+void clearPathCache(BC_FS *fs, int positive)
 {
-	u_int loc = getDirEntryLoc(dirCluster, entryAddr);
-	fseek(virDrive, loc, SEEK_SET);
-	fwrite(entry, sizeof(*entry), 1, virDrive);
+	u_int i;
+
+	for(i = 0; i < PATH_CACHE_BUCKETS; i++)
+	{
+		PathCacheEntry **link = &fs->pathCache[i];
+		while(*link)
+		{
+			PathCacheEntry *cacheEntry = *link;
+			if(positive || cacheEntry->clusterAddr == 0)
+			{
+				*link = cacheEntry->next;
+				free(cacheEntry->dirPath);
+				free(cacheEntry);
+				fs->pathCacheCount--;
+			}
+			else
+				link = &cacheEntry->next;
+		}
+	}
 }
 
 /** 
@@ -988,25 +4678,566 @@ void setDirEntry(u_int dirCluster, u_int entryAddr, DirEntry *entry)
  *        - dirEntryAddr: holds the address of the file's directory entry 
  *                        within the directory cluster in which the file's
  *                        directory entry is located 
+ *
+ *        - metaDirty: set when the size or modified date of the file 
+ *                     have changed but have not been written to the
+ *                     file's directory entry. modifyTime holds the 
+ *                     time of the last write and metaSyncTime the time
+ *                     the directory entry was last written. Every open
+ *                     BC_FILE is linked into the openFiles list so the
+ *                     pending metadata can be written on sync.
+ *
+ *        - clusterMap: holds the addresses of the file's clusters in the
+ *                      order of the file's cluster chain, so the cluster
+ *                      holding any offset of the file can be found 
+ *                      without walking the FAT. The map is built lazily
+ *                      and holds the first clusterMapCount clusters of
+ *                      the chain. A chain only grows at its end while the
+ *                      file is open, so the mapped clusters stay valid.
+ *
+ *        - poolStart: holds the address of the first of the poolCount
+ *                     clusters reserved for the file which it has not
+ *                     yet used. The file's chain is extended from the
+ *                     reservation, so writers of different files do 
+ *                     not contend on the FAT. Each reservation after 
+ *                     the first is poolNext clusters (or the clusters 
+ *                     needed, if more), doubling from ALLOC_POOL_MIN to
+ *                     ALLOC_POOL_MAX, so a file written once is not 
+ *                     given clusters it does not use. The reservation
+ *                     is returned when the file is closed or the file
+ *                     system is synced.
+ *
+ *        - raBuf: holds the readahead of the file, raLen bytes of the
+ *                 file starting at the offset raStart, read ahead of a
+ *                 sequential reader so that small reads do not each 
+ *                 access the drive. raNext holds the offset following
+ *                 the last read through the file's pointer; a read 
+ *                 starting there is sequential. Each time the buffer 
+ *                 is refilled by a sequential read the window, 
+ *                 raWindow clusters, doubles from READAHEAD_MIN to 
+ *                 READAHEAD_MAX, and any other read resets it. Writes
+ *                 to a file advance the file's write sequence count 
+ *                 in the file system (chosen by its starting cluster
+ *                 from FILE_SEQ_STRIPES counts), and the buffer is 
+ *                 only used while the count is still raSeq, so it is
+ *                 dropped when any handle writes to the file.
+ *
+ *        - unlinked: set when the file has been deleted through 
+ *                    another handle, or through this one. The file's
+ *                    directory entry is gone, so its metadata is no 
+ *                    longer written, but its clusters stay allocated 
+ *                    until the last handle of the file is closed. It
+ *                    is set under openFilesLock and the lock of the 
+ *                    file's directory.
+ *
+ *        - lock: guards all of the above, so a BC_FILE may be shared 
+ *                between threads. Each operation on the file holds it
+ *                for the whole call.
  */
 
 
 void rewindBC_File(BC_FILE *file)
 {
+	pthread_mutex_lock(&file->lock);
 	file->filePosition = 0;
 	file->currentLoc = file->startLoc;
 	file->currentClusterAddr = file->startClusterAddr;
+	pthread_mutex_unlock(&file->lock);
 }
 
 void destroyBC_File(BC_FILE *file)
 {
 	if(file)
 	{	
+		BC_FS *fs = file->fs;
+		BC_FILE *open;
+
+		/* Unlink the file from the list of open files. The clusters of
+		   a deleted file are freed once its last handle is gone */
+		pthread_mutex_lock(&fs->openFilesLock);
+		if(file->prev)
+			file->prev->next = file->next;
+		else if(fs->openFiles == file)
+			fs->openFiles = file->next;
+		if(file->next)
+			file->next->prev = file->prev;
+		int last = file->unlinked;
+		for(open = fs->openFiles; open && last; open = open->next)
+			if(open->startClusterAddr == file->startClusterAddr)
+				last = 0;
+		pthread_mutex_unlock(&fs->openFilesLock);
+		releaseAllocPool(file);
+		if(last)
+			freeFileChain(fs, file->startClusterAddr);
+		pthread_mutex_destroy(&file->lock);
+		free(file->clusterMap);
+		free(file->raBuf);
 		free(file);
 		file = NULL;
 	}
 }
 
+/**
+ * Preallocates space for a file, in the manner of fallocate. The file's
+ * cluster chain is extended, as one contiguous extent where possible,
+ * until it can hold the given number of bytes. The size of the file 
+ * and the position of the file's pointer are not changed, so later 
+ * writes fill the preallocated clusters in order. The call will fail
+ * if the length exceeds the file size limit or if the drive does 
+ * not have enough free clusters.
+ *
+ * @param file A pointer to an open BC_FILE object
+ * @param len  The number of bytes to preallocate space for
+ */
+void preallocateFile(BC_FILE *file, uint64_t len)
+{
+	if(!file)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return;
+	}
+
+	BC_FS *fs = file->fs;
+
+	if(len >= getFileSizeLimit(file))
+	{
+		fprintf(stderr, "Preallocation unsuccessful: ");
+		fprintf(stderr, "length exceeds max file size of %llu bytes\n", (unsigned long long) getFileSizeLimit(file));
+		return;
+	}
+
+	pthread_mutex_lock(&file->lock);
+
+	/* Locate the end of the file's cluster chain */
+	u_int clusters = 1;
+	u_int lastCluster = file->startClusterAddr;
+	u_int nextCluster;
+	while((nextCluster = __atomic_load_n(&fs->fileAllocTable[lastCluster], __ATOMIC_SEQ_CST)) != 0xffffffff)
+	{
+		lastCluster = nextCluster;
+		clusters++;
+	}
+
+	u_int clustersNeeded = (len + fs->bootRecord->bytesPerCluster - 1) / fs->bootRecord->bytesPerCluster;
+	if(clustersNeeded > clusters)
+	{
+		if(clustersNeeded - clusters > getFreeClusterCount(fs) + file->poolCount)
+			fprintf(stderr, "Preallocation unsuccessful: drive is full\n");
+		else
+			extendFileChain(file, lastCluster, clustersNeeded - clusters);
+	}
+	pthread_mutex_unlock(&file->lock);
+}
+
+/**
+ * Returns the limit on the size of a file. Without DRIVE_LARGE_FILES 
+ * this is FILE_SIZE_MAX. With it, a file whose name is short enough 
+ * for a version 2 directory entry is limited only by its 64 bit size
+ * and any other file by the 32 bit size of its entry.
+ *
+ * @param  file A pointer to an open BC_FILE object
+ * @return      The size which the end of a write must stay below
+ */
+uint64_t getFileSizeLimit(BC_FILE *file)
+{
+	BC_FS *fs = file->fs;
+
+	if(!fs->largeFiles)
+		return FILE_SIZE_MAX;
+	if(strlen(file->fileName) > FILE_NAME_MAX_V2)
+		return 0x100000000ULL;
+
+	return UINT64_MAX;
+}
+
+/**
+ * Returns the address of a cluster of a file by its index in the file's
+ * cluster chain. The file's cluster map is extended from the FAT as 
+ * far as the index if it does not already hold it.
+ *
+ * @param  file  A pointer to an open BC_FILE object
+ * @param  index The index of the cluster in the file's cluster chain
+ * @return       The address of the cluster, or 0xffffffff if the chain
+ *               is not long enough
+ */
+u_int getFileCluster(BC_FILE *file, u_int index)
+{
+	BC_FS *fs = file->fs;
+
+	if(index < file->clusterMapCount)
+		return file->clusterMap[index];
+
+	u_int cluster = file->clusterMapCount ? file->clusterMap[file->clusterMapCount - 1] : file->startClusterAddr;
+	while(file->clusterMapCount <= index)
+	{
+		if(file->clusterMapCount)
+		{
+			u_int nextCluster = __atomic_load_n(&fs->fileAllocTable[cluster], __ATOMIC_SEQ_CST);
+			if(nextCluster == 0xffffffff)
+				return 0xffffffff;
+			cluster = nextCluster;
+		}
+		if(file->clusterMapCount == file->clusterMapSize)
+		{
+			u_int size = file->clusterMapSize ? file->clusterMapSize * 2 : 16;
+			u_int *clusterMap = realloc(file->clusterMap, size * sizeof(u_int));
+			if(!clusterMap)
+			{
+				fprintf(stderr, "Error allocating space for cluster map\n");
+				return 0xffffffff;
+			}
+			file->clusterMap = clusterMap;
+			file->clusterMapSize = size;
+		}
+		file->clusterMap[file->clusterMapCount++] = cluster;
+	}
+
+	return cluster;
+}
+
+/**
+ * Records that a file has been written. The size and modified date of
+ * the file are written to its directory entry straight away with
+ * DRIVE_SYNC_METADATA or once the metadata interval has passed, and are
+ * otherwise left pending until the file is closed or the file system 
+ * is synced.
+ *
+ * @param file A pointer to an open BC_FILE object
+ */
+void touchFileMetadata(BC_FILE *file)
+{
+	BC_FS *fs = file->fs;
+
+	file->modifyTime = time(NULL);
+	file->metaDirty = 1;
+
+	if(fs->metaStrict || (fs->metaSyncInterval && file->modifyTime - file->metaSyncTime >= fs->metaSyncInterval))
+		writeFileMetadata(file);
+}
+
+/**
+ * Writes the pending size and modified date of a file to its directory
+ * entry
+ *
+ * @param file A pointer to an open BC_FILE object
+ */
+void writeFileMetadata(BC_FILE *file)
+{
+	BC_FS *fs = file->fs;
+
+	pthread_mutex_lock(&file->lock);
+	if(file->metaDirty)
+	{
+		file->modifyDate = encodeTime(file->modifyTime);
+		lockDir(fs, file->dirClusterAddr, 1);
+		/* The entry of a deleted file may since have been reused */
+		if(!__atomic_load_n(&file->unlinked, __ATOMIC_SEQ_CST))
+		{
+			DirEntry *entry = getDirEntry(fs, file->dirClusterAddr, file->dirEntryAddr);
+			entry->modifiedDate = file->modifyDate;
+			setDirEntrySize(entry, file->fileSize);
+			setDirEntry(fs, file->dirClusterAddr, file->dirEntryAddr, entry);
+			free(entry);
+		}
+		unlockDir(fs, file->dirClusterAddr);
+
+		file->metaDirty = 0;
+		file->metaSyncTime = file->modifyTime;
+	}
+	pthread_mutex_unlock(&file->lock);
+}
+
+/**
+ * Writes the pending metadata of every open file to the directory 
+ * entries
+ *
+ * @param fs The file system
+ */
+void syncFileMetadata(BC_FS *fs)
+{
+	BC_FILE *file;
+
+	pthread_mutex_lock(&fs->openFilesLock);
+	for(file = fs->openFiles; file; file = file->next)
+		writeFileMetadata(file);
+	pthread_mutex_unlock(&fs->openFilesLock);
+}
+
+/**
+ * Extends a file's cluster chain by a number of clusters, taking them
+ * from the clusters reserved for the file and reserving more as 
+ * needed. If fewer clusters than requested are free, the chain is 
+ * extended by the clusters that are free. The cluster address that is
+ * passed in must be the ending cluster of the chain. The caller must 
+ * hold the file's lock.
+ *
+ * Another handle on the same file may extend the chain at the same 
+ * time. Whichever links first wins; the other stops, keeping its run in
+ * its reservation, and carries on along the clusters the winner added.
+ * The caller follows the chain as usual and extends it again at its new
+ * end if it needs more.
+ *
+ * @param  file        A pointer to an open BC_FILE object
+ * @param  clusterAddr The ending cluster of the file's chain
+ * @param  count       The number of clusters to add to the chain
+ * @return             The address of the cluster which now follows the
+ *                     given one, or 0 if the drive is full
+ */
+u_int extendFileChain(BC_FILE *file, u_int clusterAddr, u_int count)
+{
+	BC_FS *fs = file->fs;
+	u_int first = 0;
+
+	while(count > 0)
+	{
+		if(file->poolCount == 0)
+		{
+			u_int want = count > file->poolNext ? count : file->poolNext;
+			file->poolCount = reserveClusters(fs, want, &file->poolStart);
+			if(file->poolCount == 0)
+				break;
+			file->poolNext = file->poolNext ? file->poolNext * 2 : ALLOC_POOL_MIN;
+			if(file->poolNext > ALLOC_POOL_MAX)
+				file->poolNext = ALLOC_POOL_MAX;
+		}
+
+		u_int run = count < file->poolCount ? count : file->poolCount;
+		if(!linkReservedClusters(fs, clusterAddr, file->poolStart, run))
+		{
+			if(!first)
+				first = __atomic_load_n(&fs->fileAllocTable[clusterAddr], __ATOMIC_SEQ_CST);
+			break;
+		}
+		if(!first)
+			first = file->poolStart;
+		clusterAddr = file->poolStart + run - 1;
+		file->poolStart += run;
+		file->poolCount -= run;
+		count -= run;
+	}
+
+	if(!first)
+	{
+		fprintf(stderr, "FAT is full\n");
+		return 0;
+	}
+
+	return first;
+}
+
+/**
+ * Returns the clusters reserved for a file which it has not used
+ *
+ * @param file A pointer to an open BC_FILE object
+ */
+void releaseAllocPool(BC_FILE *file)
+{
+	pthread_mutex_lock(&file->lock);
+	if(file->poolCount)
+		unreserveClusters(file->fs, file->poolStart, file->poolCount);
+	file->poolCount = 0;
+	pthread_mutex_unlock(&file->lock);
+}
+
+/**
+ * Returns the clusters reserved for every open file which they have 
+ * not used
+ *
+ * @param fs The file system
+ */
+void releaseAllocPools(BC_FS *fs)
+{
+	BC_FILE *file;
+
+	pthread_mutex_lock(&fs->openFilesLock);
+	for(file = fs->openFiles; file; file = file->next)
+		releaseAllocPool(file);
+	pthread_mutex_unlock(&fs->openFilesLock);
+}
+
+/**
+ * Sets the position of a file's pointer, in the manner of fseek. The 
+ * new position may not be before the beginning or past the end of the
+ * file.
+ *
+ * @param  file   A pointer to an open BC_FILE object
+ * @param  offset The offset in bytes from the position given by whence
+ * @param  whence SEEK_SET, SEEK_CUR or SEEK_END to seek from the 
+ *                beginning of the file, the position of the file's 
+ *                pointer or the end of the file
+ * @return        0 if successful, -1 otherwise
+ */
+int seekFile(BC_FILE *file, long offset, int whence)
+{
+	if(!file)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return -1;
+	}
+
+	BC_FS *fs = file->fs;
+
+	pthread_mutex_lock(&file->lock);
+	long position;
+	if(whence == SEEK_SET)
+		position = offset;
+	else if(whence == SEEK_CUR)
+		position = (long) file->filePosition + offset;
+	else if(whence == SEEK_END)
+		position = (long) file->fileSize + offset;
+	else
+	{
+		pthread_mutex_unlock(&file->lock);
+		fprintf(stderr, "Seek unsuccessful: invalid whence\n");
+		return -1;
+	}
+
+	if(position < 0 || (uint64_t) position > file->fileSize)
+	{
+		pthread_mutex_unlock(&file->lock);
+		fprintf(stderr, "Seek unsuccessful: position is outside of the file\n");
+		return -1;
+	}
+
+	u_int index = position / fs->bootRecord->bytesPerCluster;
+	u_int cluster = getFileCluster(file, index);
+	off_t loc;
+	if(cluster != 0xffffffff)
+		loc = getClusterLoc(fs, cluster) + position % fs->bootRecord->bytesPerCluster;
+	else if(index > 0 && position % fs->bootRecord->bytesPerCluster == 0 &&
+	        (cluster = getFileCluster(file, index - 1)) != 0xffffffff)
+	{
+		/* The position is the end of the last cluster of the chain, 
+		   the next write will extend the chain */
+		loc = getClusterLoc(fs, cluster + 1);
+	}
+	else
+	{
+		pthread_mutex_unlock(&file->lock);
+		fprintf(stderr, "Seek unsuccessful: file's cluster chain is too short\n");
+		return -1;
+	}
+
+	file->filePosition = position;
+	file->currentClusterAddr = cluster;
+	file->currentLoc = loc;
+	pthread_mutex_unlock(&file->lock);
+
+	return 0;
+}
+
+/**
+ * Reads a number of bytes from a file, starting at a given offset, 
+ * through the file's readahead. Reads which continue from where the 
+ * last one stopped are served from the readahead buffer, which is 
+ * refilled with the next clusters of the file's chain as it runs out,
+ * in a window which grows while the reads stay sequential. Reads too 
+ * large for the window, and reads which are not sequential, go 
+ * straight to the drive. The readahead is only used in 
+ * DRIVE_MODE_STDIO without the cluster cache, as otherwise the data is
+ * already in memory. The caller must hold the file's lock.
+ *
+ * @param  file   A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to read from
+ * @param  dest   The buffer to store the data read
+ * @param  len    The number of bytes to read
+ * @return        The number of bytes read
+ */
+u_int readFileAhead(BC_FILE *file, uint64_t offset, void *dest, u_int len)
+{
+	BC_FS *fs = file->fs;
+	u_int bpc = fs->bootRecord->bytesPerCluster;
+
+	if(fs->virDriveMode != DRIVE_MODE_STDIO || fs->clusterCacheSlots)
+		return readFileAt(file, offset, dest, len);
+
+	int sequential = offset == file->raNext;
+	if(!sequential)
+		file->raWindow = 0;
+	if(file->raSeq != __atomic_load_n(&fs->fileSeq[file->startClusterAddr % FILE_SEQ_STRIPES], __ATOMIC_ACQUIRE))
+		file->raLen = 0;
+
+	u_int bytesRead = 0;
+	while(bytesRead < len)
+	{
+		uint64_t pos = offset + bytesRead;
+		if(pos >= file->raStart && pos < file->raStart + file->raLen)
+		{
+			u_int piece = file->raStart + file->raLen - pos;
+			if(piece > len - bytesRead)
+				piece = len - bytesRead;
+			memcpy((char*) dest + bytesRead, file->raBuf + (pos - file->raStart), piece);
+			bytesRead += piece;
+			continue;
+		}
+		if(pos >= file->fileSize)
+			break;
+
+		u_int window = file->raWindow ? file->raWindow * 2 : READAHEAD_MIN;
+		if(window > READAHEAD_MAX)
+			window = READAHEAD_MAX;
+		if(!sequential || len - bytesRead >= window * bpc)
+		{
+			bytesRead += readFileAt(file, pos, (char*) dest + bytesRead, len - bytesRead);
+			break;
+		}
+		file->raWindow = window;
+		fillReadahead(file, pos);
+		if(file->raLen == 0)
+			break;
+	}
+	file->raNext = offset + bytesRead;
+
+	return bytesRead;
+}
+
+/**
+ * Fills the readahead buffer of a file with the clusters of the file's
+ * chain starting at the cluster which holds the given offset, as many
+ * as the file's readahead window. Each run of physically contiguous 
+ * clusters is read in a single drive access. The caller must hold the
+ * file's lock.
+ *
+ * @param file   A pointer to an open BC_FILE object
+ * @param offset The offset in the file to read ahead from
+ */
+void fillReadahead(BC_FILE *file, uint64_t offset)
+{
+	BC_FS *fs = file->fs;
+	u_int bpc = fs->bootRecord->bytesPerCluster;
+	u_int size = file->raWindow * bpc;
+
+	if(file->raSize < size)
+	{
+		char *buf = realloc(file->raBuf, size);
+		if(!buf)
+		{
+			fprintf(stderr, "Error allocating space for the readahead buffer\n");
+			file->raLen = 0;
+			return;
+		}
+		file->raBuf = buf;
+		file->raSize = size;
+	}
+
+	/* Writes made while the buffer is filled leave it stale */
+	file->raSeq = __atomic_load_n(&fs->fileSeq[file->startClusterAddr % FILE_SEQ_STRIPES], __ATOMIC_ACQUIRE);
+	file->raStart = offset - offset % bpc;
+	file->raLen = readFileAt(file, file->raStart, file->raBuf, size);
+}
+
+/**
+ * Advances the write sequence count of a file, so that the readahead 
+ * of every handle open on the file is dropped. Called after data is 
+ * written to the file.
+ *
+ * @param file A pointer to an open BC_FILE object
+ */
+void invalidateReadahead(BC_FILE *file)
+{
+	__atomic_add_fetch(&file->fs->fileSeq[file->startClusterAddr % FILE_SEQ_STRIPES], 1, __ATOMIC_RELEASE);
+}
+
 /** 
  * ======================================================================== 
  * |                         File Operations                              | 
@@ -1023,10 +5254,11 @@ void destroyBC_File(BC_FILE *file)
  * and/or the directories in the given path do not exist, they will
  * be created.
  *
+ * @param  fs       The file system
  * @param  filePath A string containing the absolute file path
  * @return          A custom file pointer to the file
  */
-BC_FILE *openFile(char *filePath)
+BC_FILE *openFile(BC_FS *fs, char *filePath)
 {
 	BC_FILE *fp = NULL;
 
@@ -1044,10 +5276,10 @@ BC_FILE *openFile(char *filePath)
 	char fileExt[FILE_EXT_SIZE + 1];
 
 	/* Declare variables for cluster and directory navigation */
-	u_int clusterAddr = bootRecord->rootDirStart;
-	u_int nextClusterAddr;
+	u_int clusterAddr = fs->bootRecord->rootDirStart;
 	u_int entryAddr;
 	DirEntry *entry;
+	char *save;
 
 	/* If the file to open is not in the root directory,
 	   parse filePath to locate the file's parent directory */
@@ -1064,8 +5296,8 @@ BC_FILE *openFile(char *filePath)
 		strcpy(file, p[i]);
 
 		/* Parse the file name and extension */
-		strcpy(fileName, strtok(file, "."));
-		strcpy(fileExt, strtok(NULL, "."));
+		strcpy(fileName, strtok_r(file, ".", &save));
+		strcpy(fileExt, strtok_r(NULL, ".", &save));
 
 		/* Check file name and extension lengths */
 		if(strlen(fileName) < FILE_NAME_MIN || strlen(fileExt) > FILE_NAME_MAX)
@@ -1089,35 +5321,27 @@ BC_FILE *openFile(char *filePath)
 			return NULL;
 		}
 
-		/* Traverse the directories to locate the parent directory 
-		   NOTE: The last p[i] will be the file name and extension
-		   of the absolute file path given */
-		p = path;
-		i = 0;
-		while(p[i] != NULL && p[i+1] != NULL)
+		/* Locate the parent directory, creating any directories which
+		   do not exist. NOTE: The last p[i] will be the file name and 
+		   extension of the absolute file path given */
+		clusterAddr = resolveDirPath(fs, path, i, 1);
+		while(i >= 0)
+			free(p[i--]);
+		free(path);
+		if(clusterAddr == 0)
 		{
-			nextClusterAddr = getDirectoryClusterAddress(clusterAddr, p[i]);
-			if(nextClusterAddr == 0) /* If directory is not found, create */
-			{
-				u_int nextClusterEntryAddr = createDirSubEntry(clusterAddr, 0x13, p[i]);
-				entry = getDirEntry(clusterAddr, nextClusterEntryAddr);
-				nextClusterAddr = entry->startCluster;
-				free(entry);
-			}
-			clusterAddr = nextClusterAddr;
-			free(p[i]);
-			i++;
+			free(fp);
+
+			return NULL;
 		}
-		free(p[i]);
-		free(path);
 	}
 	else /* The file to open is in the root directory */
 	{
 		strcpy(file, filePath);
 
 		/* Parse the file name and extension */
-		strcpy(fileName, strtok(file, "."));
-		strcpy(fileExt, strtok(NULL, "."));
+		strcpy(fileName, strtok_r(file, ".", &save));
+		strcpy(fileExt, strtok_r(NULL, ".", &save));
 
 		/* Check file name and extension lengths */
 		if(strlen(fileName) < FILE_NAME_MIN || strlen(fileExt) > FILE_NAME_MAX)
@@ -1143,20 +5367,65 @@ BC_FILE *openFile(char *filePath)
 
 	}
 
-	/* Determine if file exists */
-	/* If so, get entry address from current directory cluster */
-	if(dirFileEntryExists(clusterAddr, fileName, fileExt))
-		entryAddr = getDirFileEntryAddr(clusterAddr, fileName, fileExt);
-	/* If not, create file and record entry address */
-	else 	
-		entryAddr = createDirFileEntry(clusterAddr, 0x3, fileName, fileExt);
+	/* With directory indexes, an existing file is found and its entry 
+	   read without taking the directory's lock. The entry is only used
+	   if the directory was not changed while it was read and it still
+	   holds the file, since the file may have been deleted after the 
+	   search */
+	entry = NULL;
+	if(fs->dirIndexEnabled)
+	{
+		entryAddr = findDirFileEntry(fs, clusterAddr, fileName, fileExt);
+		if(entryAddr != 0xffffffff)
+		{
+			u_int seq = readDirSeq(fs, clusterAddr);
+			entry = getDirEntry(fs, clusterAddr, entryAddr);
+			if(!checkDirSeq(fs, clusterAddr, seq) || !(entry->attr & 0x1) || 
+			   strncmp(entry->fileName, fileName, FILE_NAME_MAX) != 0 ||
+			   strncmp(entry->fileExt, fileExt, FILE_EXT_SIZE) != 0)
+			{
+				free(entry);
+				entry = NULL;
+			}
+		}
+	}
+
+	if(!entry)
+	{
+		/* Determine if file exists */
+		/* If so, get entry address from current directory cluster */
+		lockDir(fs, clusterAddr, 0);
+		entryAddr = findDirFileEntry(fs, clusterAddr, fileName, fileExt);
+		/* If not, create file and record entry address. The directory is
+		   searched again under the write lock, in case another thread has
+		   created the file in the meantime */
+		if(entryAddr == 0xffffffff)
+		{
+			unlockDir(fs, clusterAddr);
+			lockDir(fs, clusterAddr, 1);
+			entryAddr = findDirFileEntry(fs, clusterAddr, fileName, fileExt);
+			if(entryAddr == 0xffffffff)
+				entryAddr = createDirFileEntry(fs, clusterAddr, 0x3, fileName, fileExt);
+		}
+
+		if(entryAddr == 0xffffffff)
+		{
+			unlockDir(fs, clusterAddr);
+			fprintf(stderr, "Could not create file: drive is full\n");
+			free(fp);
+
+			return NULL;
+		}
+
+		entry = getDirEntry(fs, clusterAddr, entryAddr);
+		unlockDir(fs, clusterAddr);
+	}
 
 	/* NOTE: This function could be modified to take a "mode" and to set the 
 	         file's attributes accordingly */
 	
 	/* Set the properties of the file pointer using the metadata located 
 	   in the file's directory entry */
-	entry = getDirEntry(clusterAddr, entryAddr);
 	fp->used = entry->attr & 0x1;
 	fp->write = entry->attr & 0x2;
 	fp->hidden = entry->attr & 0x4;
@@ -1166,14 +5435,86 @@ BC_FILE *openFile(char *filePath)
 	fp->createDate = entry->createDate;
 	fp->modifyDate = entry->modifiedDate;
 	fp->filePosition = 0;
-	fp->fileSize = entry->fileSize;
+	fp->fileSize = getDirEntrySize(entry);
 	fp->startClusterAddr = entry->startCluster;
-	fp->startLoc = fp->startClusterAddr * bootRecord->bytesPerCluster;
+	fp->startLoc = getClusterLoc(fs, fp->startClusterAddr);
 	fp->currentClusterAddr = fp->startClusterAddr;
-	fp->currentLoc = fp->startClusterAddr * bootRecord->bytesPerCluster;
+	fp->currentLoc = getClusterLoc(fs, fp->startClusterAddr);
 	fp->dirClusterAddr = clusterAddr;
 	fp->dirEntryAddr = entryAddr;
+	fp->fs = fs;
+	fp->clusterMap = NULL;
+	fp->clusterMapCount = 0;
+	fp->clusterMapSize = 0;
+	fp->metaDirty = 0;
+	fp->modifyTime = time(NULL);
+	fp->metaSyncTime = fp->modifyTime;
+	fp->poolStart = 0;
+	fp->poolCount = 0;
+	fp->poolNext = 0;
+	fp->raBuf = NULL;
+	fp->raSize = 0;
+	fp->raStart = 0;
+	fp->raLen = 0;
+	fp->raWindow = 0;
+	fp->raNext = 0;
+	fp->raSeq = 0;
+	fp->unlinked = 0;
+	initRecursiveMutex(&fp->lock);
+	free(entry);
+
+	/* The entry was read without openFilesLock, so the file may have been
+	   deleted since. deleteFile() removes the entry and marks the file's
+	   handles under openFilesLock, so if the entry still holds the file
+	   here the file stays allocated until this handle is closed. If not,
+	   the file is opened again, which creates it anew */
+	pthread_mutex_lock(&fs->openFilesLock);
+	lockDir(fs, clusterAddr, 0);
+	entry = getDirEntry(fs, clusterAddr, entryAddr);
+	int valid = (entry->attr & 0x1) && entry->startCluster == fp->startClusterAddr &&
+	            strncmp(entry->fileName, fp->fileName, FILE_NAME_MAX) == 0 &&
+	            strncmp(entry->fileExt, fp->fileExt, FILE_EXT_SIZE) == 0;
+	if(valid)
+	{
+		fp->fileSize = getDirEntrySize(entry);
+		fp->modifyDate = entry->modifiedDate;
+	}
 	free(entry);
+	unlockDir(fs, clusterAddr);
+	if(!valid)
+	{
+		pthread_mutex_unlock(&fs->openFilesLock);
+		pthread_mutex_destroy(&fp->lock);
+		free(fp);
+
+		return openFile(fs, filePath);
+	}
+
+	/* If the file is already open, take the metadata which has not yet
+	   been written to the directory entry */
+	BC_FILE *open;
+	for(open = fs->openFiles; open; open = open->next)
+	{
+		pthread_mutex_lock(&open->lock);
+		int pending = open->dirClusterAddr == clusterAddr && open->dirEntryAddr == entryAddr && 
+		              !open->unlinked && open->metaDirty;
+		if(pending)
+		{
+			fp->fileSize = open->fileSize;
+			fp->modifyDate = open->modifyDate;
+		}
+		pthread_mutex_unlock(&open->lock);
+		if(pending)
+			break;
+	}
+
+	/* Link the file into the list of open files */
+	fp->prev = NULL;
+	fp->next = fs->openFiles;
+	if(fs->openFiles)
+		fs->openFiles->prev = fp;
+	fs->openFiles = fp;
+	pthread_mutex_unlock(&fs->openFilesLock);
 
 	return fp;
 }
@@ -1182,17 +5523,16 @@ BC_FILE *openFile(char *filePath)
  * Creates a directory. If any directories in the absolute path do not
  * exist, they will be created.
  *
+ * @param fs       The file system
  * @param dirPath  A string containing the absolute directory path
  */
-void createDirectory(char *dirPath)
+void createDirectory(BC_FS *fs, char *dirPath)
 {
 	/* Allocate memory for a string to parse the directory path */
-	char *dir = (char*) calloc(13, sizeof(char));
+	char dir[FILE_NAME_MAX + 1];
 
 	/* Declare variables for cluster navigation */
-	u_int clusterAddr = bootRecord->rootDirStart;
-	u_int nextClusterAddr;
-	DirEntry *entry;
+	u_int clusterAddr = fs->bootRecord->rootDirStart;
 
 	/* If the directory to create is not in the root directory,
 	   parse dirPath to locate the directory's parent directory */
@@ -1206,44 +5546,40 @@ void createDirectory(char *dirPath)
 		int i = 0;
 		while(p[i+1] != NULL)
 			i++;
-		strcpy(dir, p[i]);
+		strncpy(dir, p[i], FILE_NAME_MAX);
+		dir[FILE_NAME_MAX] = '\0';
 
 		/* Check directory name length */
-		if(strlen(dir) < FILE_NAME_MIN || strlen(dir) > FILE_NAME_MAX)
+		if(strlen(p[i]) < FILE_NAME_MIN || strlen(p[i]) > FILE_NAME_MAX)
 		{
 			fprintf(stderr, "Could not create directory: ");
 			fprintf(stderr, "invalid directory name length\n");
 			fprintf(stderr, "Directory name must be between ");
 			fprintf(stderr, "%d and %d characters in length\n", FILE_NAME_MIN, FILE_NAME_MAX);
+			while(i >= 0)
+				free(p[i--]);
+			free(path);
 
 			return;
 		}
 
-		/* Traverse the directories to locate the parent directory 
-		   NOTE: The last p[i] will be the file name and extension
-		   of the absolute file path given */
-		p = path;
-		i = 0;
-		while(p[i] != NULL && p[i+1] != NULL)
-		{
-			nextClusterAddr = getDirectoryClusterAddress(clusterAddr, p[i]);
-			if(nextClusterAddr == 0) /* If directory is not found, create it */
-			{
-				u_int nextClusterEntryAddr = createDirSubEntry(clusterAddr, 0x13, p[i]);
-				entry = getDirEntry(clusterAddr, nextClusterEntryAddr);
-				nextClusterAddr = entry->startCluster;
-				free(entry);
-			}
-			clusterAddr = nextClusterAddr;
-			i++;
-		}
+		/* Locate the parent directory, creating any directories which
+		   do not exist. NOTE: The last p[i] will be the name of the 
+		   directory to create */
+		clusterAddr = resolveDirPath(fs, path, i, 1);
+		while(i >= 0)
+			free(p[i--]);
+		free(path);
+		if(clusterAddr == 0)
+			return;
 	}
 	else /* The directory to open is in the root directory */
 	{
-		strcpy(dir, dirPath);
+		strncpy(dir, dirPath, FILE_NAME_MAX);
+		dir[FILE_NAME_MAX] = '\0';
 
 		/* Check directory name length */
-		if(strlen(dir) < FILE_NAME_MIN || strlen(dir) > FILE_NAME_MAX)
+		if(strlen(dirPath) < FILE_NAME_MIN || strlen(dirPath) > FILE_NAME_MAX)
 		{
 			fprintf(stderr, "Could not create directory: ");
 			fprintf(stderr, "invalid directory name length\n");
@@ -1254,18 +5590,26 @@ void createDirectory(char *dirPath)
 		}
 	}
 
+	/* Build the parent's index first, since the build takes the 
+	   parent's lock */
+	if(fs->dirIndexEnabled)
+		getDirIndex(fs, clusterAddr);
+
 	/* Determine if directory exists */
 	/* If not, create the directory */
-	if(!dirFileEntryExists(clusterAddr, dir, ""))
-		createDirSubEntry(clusterAddr, 0x13, dir);
+	lockDir(fs, clusterAddr, 1);
+	if(!dirFileEntryExists(fs, clusterAddr, dir, ""))
+		createDirSubEntry(fs, clusterAddr, 0x13, dir);
+	unlockDir(fs, clusterAddr);
 
 	/* NOTE: This function could be modified to take a "mode" and to set the 
 	         directory's attributes accordingly */
 }
 
 /**
- * Writes a number of bytes from a source into a file. The call will fail
- * if the length of the write exceeds the file size maximum.
+ * Writes a number of bytes from a source into a file. With the async 
+ * I/O engine the writes of the clusters are made as one batch. The call
+ * will fail if the length of the write exceeds the file size maximum.
  *
  * @param src  A pointer to the data to write
  * @param len  The number of bytes to write
@@ -1280,64 +5624,105 @@ void writeFile(void *src, u_int len, BC_FILE *dest)
 		return;
 	}
 
+	BC_FS *fs = dest->fs;
+
 	u_int lenLeft = len;
 	u_int bytesLeft;
-	DirEntry *entry;
+	BC_AIO aio;
+	int batch = initAsyncBatch(fs, &aio);
 
-	if(dest->filePosition + len >= FILE_SIZE_MAX)
+	pthread_mutex_lock(&dest->lock);
+	if(dest->filePosition + len >= getFileSizeLimit(dest))
 	{
 		fprintf(stderr, "Write unsuccessful: ");
-		fprintf(stderr, "write length exceeds max file size of %d bytes\n", FILE_SIZE_MAX);
+		fprintf(stderr, "write length exceeds max file size of %llu bytes\n", (unsigned long long) getFileSizeLimit(dest));
 	}
 	else
 	{
 		while(lenLeft > 0)
 		{
-			bytesLeft = ((dest->currentClusterAddr + 1) * bootRecord->bytesPerCluster) - dest->currentLoc; 
+			bytesLeft = getClusterLoc(fs, dest->currentClusterAddr + 1) - dest->currentLoc; 
 
 			if(lenLeft < bytesLeft) /* write to current cluster only */
 			{
-				fseek(virDrive, dest->currentLoc, SEEK_SET);
-				fwrite(src, 1, lenLeft, virDrive);
+				BC_IOVEC vec = { src, lenLeft };
+				if(batch)
+					queueAsyncIO(&aio, &vec, 1, dest->currentLoc, 1);
+				else if(writeVirDriveV(fs, &vec, 1, dest->currentLoc) < (ssize_t) lenLeft)
+				{
+					/* Leave the pointer before the failed piece and 
+					   record what was written */
+					fprintf(stderr, "Write incomplete: could not write to the virtual drive\n");
+					len -= lenLeft;
+					break;
+				}
 				dest->currentLoc += lenLeft;
 				lenLeft -= lenLeft;
 			}
 			else /* write may span multiple clusters */
 			{
-				void *srcChunk = calloc(bytesLeft, sizeof(char));
-				memcpy(srcChunk, src, bytesLeft);
-				fseek(virDrive, dest->currentLoc, SEEK_SET);
-				fwrite(srcChunk, 1, bytesLeft, virDrive);
-				free(srcChunk);
-				u_int nextClusterAddr = fileAllocTable[dest->currentClusterAddr];
+				BC_IOVEC vec = { src, bytesLeft };
+				if(batch)
+					queueAsyncIO(&aio, &vec, 1, dest->currentLoc, 1);
+				else if(writeVirDriveV(fs, &vec, 1, dest->currentLoc) < (ssize_t) bytesLeft)
+				{
+					fprintf(stderr, "Write incomplete: could not write to the virtual drive\n");
+					len -= lenLeft;
+					break;
+				}
+				u_int nextClusterAddr = __atomic_load_n(&fs->fileAllocTable[dest->currentClusterAddr], __ATOMIC_SEQ_CST);
 				if(nextClusterAddr != 0xffffffff)
 				{
 					dest->currentClusterAddr = nextClusterAddr;
-					dest->currentLoc = dest->currentClusterAddr * bootRecord->bytesPerCluster;
+					dest->currentLoc = getClusterLoc(fs, dest->currentClusterAddr);
 				}
 				else
 				{
-					dest->currentClusterAddr = addClusterToChain(dest->currentClusterAddr);
-					dest->currentLoc = dest->currentClusterAddr * bootRecord->bytesPerCluster;
+					/* Allocate the clusters for the rest of the write as 
+					   one contiguous extent */
+					u_int clustersNeeded = (lenLeft - bytesLeft + fs->bootRecord->bytesPerCluster - 1) / fs->bootRecord->bytesPerCluster;
+					if(clustersNeeded == 0)
+						clustersNeeded = 1;
+					nextClusterAddr = extendFileChain(dest, dest->currentClusterAddr, clustersNeeded);
+					if(!nextClusterAddr)
+					{
+						/* Drive is full, leave the pointer at the end of the 
+						   current cluster and record what was written */
+						fprintf(stderr, "Write incomplete: drive is full\n");
+						dest->currentLoc += bytesLeft;
+						len -= lenLeft - bytesLeft;
+						break;
+					}
+					dest->currentClusterAddr = nextClusterAddr;
+					dest->currentLoc = getClusterLoc(fs, dest->currentClusterAddr);
 				}
 				lenLeft -= bytesLeft;
 				src += bytesLeft;
 			}
 		}
-		dest->modifyDate = encodeTimeBytes();
+		if(batch && finishAsyncBatch(&aio) < len)
+		{
+			/* A failed batch gives no count of what landed, so the 
+			   write is treated as not made and the pointer is put back
+			   where it began */
+			len = 0;
+			seekFile(dest, dest->filePosition, SEEK_SET);
+		}
+		invalidateReadahead(dest);
 		dest->filePosition += len;
-		dest->fileSize += len;
-		entry = getDirEntry(dest->dirClusterAddr, dest->dirEntryAddr);
-		entry->modifiedDate = dest->modifyDate;
-		entry->fileSize = dest->fileSize;
-		setDirEntry(dest->dirClusterAddr, dest->dirEntryAddr, entry);
-		free(entry);
+		if(dest->filePosition > dest->fileSize)
+			dest->fileSize = dest->filePosition;
+		touchFileMetadata(dest);
 	}
+	pthread_mutex_unlock(&dest->lock);
 }
 
 /**
- * Reads a number of bytes from a file into a given memory location. The call
- * will fail if the length of the read exceeds.
+ * Reads a number of bytes from a file into a given memory location. The 
+ * read starts at the position of the file's pointer and stops at the end
+ * of the file. The file's pointer is advanced past the bytes read. Small
+ * sequential reads are served from the file's readahead (see 
+ * readFileAhead()).
  *
  * @param dest The buffer to store the data read
  * @param len  The number of bytes to read
@@ -1346,64 +5731,547 @@ void writeFile(void *src, u_int len, BC_FILE *dest)
 void readFile(void *dest, u_int len, BC_FILE *src)
 {
 	/* What if file object is invalid? */
-	if(!dest)
+	if(!src)
 	{
 		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
 		return;
 	}
 
-	/* If length of read exceeds the remaining length of the file,
-	   set the length of read to the remaining length of the file */
-	if(len > (src->fileSize - src->filePosition))
-		len = (src->fileSize - src->filePosition);
+	pthread_mutex_lock(&src->lock);
+	u_int bytesRead = readFileAhead(src, src->filePosition, dest, len);
+	if(bytesRead)
+		seekFile(src, bytesRead, SEEK_CUR);
+	pthread_mutex_unlock(&src->lock);
+}
+
+/**
+ * Reads a number of bytes from a file, starting at a given offset, into
+ * a given memory location, in the manner of pread. The position of the 
+ * file's pointer is not used or changed. The read stops at the end of 
+ * the file.
+ *
+ * @param  src    A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to read from
+ * @param  dest   The buffer to store the data read
+ * @param  len    The number of bytes to read
+ * @return        The number of bytes read
+ */
+u_int readFileAt(BC_FILE *src, uint64_t offset, void *dest, u_int len)
+{
+	BC_IOVEC iov = { dest, len };
+
+	return readFileRegion(src, offset, &iov, 1);
+}
+
+/**
+ * Writes a number of bytes from a source into a file, starting at a 
+ * given offset, in the manner of pwrite. The position of the file's
+ * pointer is not used or changed. The offset may not be past the end
+ * of the file. The call will fail if the end of the write exceeds the 
+ * file size maximum.
+ *
+ * @param  dest   A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to write to
+ * @param  src    A pointer to the data to write
+ * @param  len    The number of bytes to write
+ * @return        The number of bytes written
+ */
+u_int writeFileAt(BC_FILE *dest, uint64_t offset, void *src, u_int len)
+{
+	BC_IOVEC iov = { src, len };
+
+	return writeFileRegion(dest, offset, &iov, 1);
+}
+
+/**
+ * Reads from a file into several buffers, in the manner of readv. The
+ * read starts at the position of the file's pointer and stops at the 
+ * end of the file. The file's pointer is advanced past the bytes read.
+ *
+ * @param  src    A pointer to an open BC_FILE object
+ * @param  iov    The buffers to store the data read, filled in order
+ * @param  iovcnt The number of buffers
+ * @return        The number of bytes read
+ */
+u_int readFileV(BC_FILE *src, BC_IOVEC *iov, int iovcnt)
+{
+	if(!src)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return 0;
+	}
+
+	pthread_mutex_lock(&src->lock);
+	u_int bytesRead = readFileRegion(src, src->filePosition, iov, iovcnt);
+	if(bytesRead)
+		seekFile(src, bytesRead, SEEK_CUR);
+	pthread_mutex_unlock(&src->lock);
+
+	return bytesRead;
+}
+
+/**
+ * Writes several buffers into a file, in the manner of writev. The 
+ * write starts at the position of the file's pointer and the file's 
+ * pointer is advanced past the bytes written. The file's directory 
+ * entry is updated at most once for the whole call. The call will fail if the
+ * end of the write exceeds the file size maximum.
+ *
+ * @param  dest   A pointer to an open BC_FILE object
+ * @param  iov    The buffers holding the data to write, in order
+ * @param  iovcnt The number of buffers
+ * @return        The number of bytes written
+ */
+u_int writeFileV(BC_FILE *dest, BC_IOVEC *iov, int iovcnt)
+{
+	if(!dest)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return 0;
+	}
+
+	pthread_mutex_lock(&dest->lock);
+	u_int bytesWritten = writeFileRegion(dest, dest->filePosition, iov, iovcnt);
+	if(bytesWritten)
+		seekFile(dest, bytesWritten, SEEK_CUR);
+	pthread_mutex_unlock(&dest->lock);
+
+	return bytesWritten;
+}
+
+/**
+ * Reads a region of a file into several buffers. The position of the
+ * file's pointer is not used or changed. The read stops at the end of
+ * the file. The data is read straight into the buffers, with each run
+ * of physically contiguous clusters read in a single drive access. 
+ * With the async I/O engine the accesses are made as one batch.
+ *
+ * @param  src    A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to read from
+ * @param  iov    The buffers to store the data read, filled in order
+ * @param  iovcnt The number of buffers
+ * @return        The number of bytes read
+ */
+u_int readFileRegion(BC_FILE *src, uint64_t offset, BC_IOVEC *iov, int iovcnt)
+{
+	if(!src)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return 0;
+	}
+
+	BC_AIO aio;
+	int batch = initAsyncBatch(src->fs, &aio);
+
+	pthread_mutex_lock(&src->lock);
+	u_int bytesRead = readFileRuns(src, offset, iov, iovcnt, batch ? &aio : NULL);
+	if(batch)
+		bytesRead = finishAsyncBatch(&aio);
+	pthread_mutex_unlock(&src->lock);
+
+	return bytesRead;
+}
+
+/**
+ * Writes several buffers into a region of a file. The position of the
+ * file's pointer is not used or changed. The offset may not be past 
+ * the end of the file. The clusters needed by the whole write are 
+ * added to the file's chain at once, as one contiguous extent where 
+ * possible, and each run of physically contiguous clusters is written
+ * in a single drive access. With the async I/O engine the accesses are
+ * made as one batch. The file's directory entry is updated 
+ * at most once. The call will fail if the end of the write exceeds the
+ * file size maximum.
+ *
+ * @param  dest   A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to write to
+ * @param  iov    The buffers holding the data to write, in order
+ * @param  iovcnt The number of buffers
+ * @return        The number of bytes written
+ */
+u_int writeFileRegion(BC_FILE *dest, uint64_t offset, BC_IOVEC *iov, int iovcnt)
+{
+	if(!dest)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return 0;
+	}
+
+	BC_AIO aio;
+	int batch = initAsyncBatch(dest->fs, &aio);
+
+	pthread_mutex_lock(&dest->lock);
+	uint64_t fileSize = dest->fileSize;
+	u_int bytesWritten = writeFileRuns(dest, offset, iov, iovcnt, batch ? &aio : NULL);
+	if(batch && finishAsyncBatch(&aio) < bytesWritten)
+	{
+		/* The batch failed, so the file does not grow */
+		bytesWritten = 0;
+		dest->fileSize = fileSize;
+		touchFileMetadata(dest);
+	}
+	invalidateReadahead(dest);
+	pthread_mutex_unlock(&dest->lock);
+
+	return bytesWritten;
+}
+
+/**
+ * Makes the drive accesses which read a region of a file into several
+ * buffers, for readFileRegion() and readFileAsync(). The caller must
+ * hold the file's lock.
+ *
+ * @param  src    A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to read from
+ * @param  iov    The buffers to store the data read, filled in order
+ * @param  iovcnt The number of buffers
+ * @param  aio    The batch to queue the accesses to, or NULL to make 
+ *                them straight away
+ * @return        The number of bytes read
+ */
+u_int readFileRuns(BC_FILE *src, uint64_t offset, BC_IOVEC *iov, int iovcnt, BC_AIO *aio)
+{
+	u_int len = 0;
+	int i;
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+
+	if(offset >= src->fileSize)
+		len = 0;
+	else if(len > src->fileSize - offset)
+		len = src->fileSize - offset;
+
+	u_int lenLeft = len;
+	u_int iovOffset = 0;
+	while(lenLeft > 0)
+	{
+		u_int run = transferFileRun(src, offset, lenLeft, &iov, &iovOffset, 0, aio);
+		if(run == 0)
+			break;
+		offset += run;
+		lenLeft -= run;
+	}
+
+	return len - lenLeft;
+}
+
+/**
+ * Makes the drive accesses which write several buffers into a region of
+ * a file, for writeFileRegion() and writeFileAsync(), extending the 
+ * file's chain and size as needed. The caller must hold the file's lock.
+ *
+ * @param  dest   A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to write to
+ * @param  iov    The buffers holding the data to write, in order
+ * @param  iovcnt The number of buffers
+ * @param  aio    The batch to queue the accesses to, or NULL to make 
+ *                them straight away
+ * @return        The number of bytes written
+ */
+u_int writeFileRuns(BC_FILE *dest, uint64_t offset, BC_IOVEC *iov, int iovcnt, BC_AIO *aio)
+{
+	BC_FS *fs = dest->fs;
+
+	u_int len = 0;
+	int i;
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+
+	if(offset > dest->fileSize)
+	{
+		fprintf(stderr, "Write unsuccessful: offset is past the end of the file\n");
+		return 0;
+	}
+
+	if(offset + len >= getFileSizeLimit(dest))
+	{
+		fprintf(stderr, "Write unsuccessful: ");
+		fprintf(stderr, "write length exceeds max file size of %llu bytes\n", (unsigned long long) getFileSizeLimit(dest));
+		return 0;
+	}
 
+	u_int bpc = fs->bootRecord->bytesPerCluster;
 	u_int lenLeft = len;
-	u_int bytesLeft;
-	
+	u_int iovOffset = 0;
 	while(lenLeft > 0)
 	{
-		bytesLeft = ((src->currentClusterAddr + 1) * bootRecord->bytesPerCluster) - src->currentLoc; 
+		if(getFileCluster(dest, offset / bpc) == 0xffffffff)
+		{
+			/* Allocate the clusters for the rest of the write as one 
+			   contiguous extent */
+			u_int clustersNeeded = (offset % bpc + lenLeft + bpc - 1) / bpc;
+			if(!extendFileChain(dest, dest->clusterMap[dest->clusterMapCount - 1], clustersNeeded))
+			{
+				fprintf(stderr, "Write incomplete: drive is full\n");
+				break;
+			}
+		}
+		u_int run = transferFileRun(dest, offset, lenLeft, &iov, &iovOffset, 1, aio);
+		if(run == 0)
+			break;
+		offset += run;
+		lenLeft -= run;
+	}
+
+	if(offset > dest->fileSize)
+		dest->fileSize = offset;
+	touchFileMetadata(dest);
+
+	return len - lenLeft;
+}
 
-		char *srcChunk = calloc(lenLeft, sizeof(char));
-		fseek(virDrive, src->currentLoc, SEEK_SET);
-		fread(srcChunk, sizeof(char), lenLeft, virDrive);
-		memcpy(dest, srcChunk, lenLeft);
-		free(srcChunk);
+/**
+ * Reads or writes the run of physically contiguous clusters of a file
+ * which holds the given offset, as a single drive access. The buffers 
+ * are consumed in order; the buffer pointer and the offset within the
+ * current buffer are advanced past the bytes transferred.
+ *
+ * @param  file      A pointer to an open BC_FILE object
+ * @param  offset    The offset in the file to start at
+ * @param  len       The most bytes to transfer
+ * @param  iov       The current buffer
+ * @param  iovOffset The offset within the current buffer
+ * @param  write     1 to write the buffers to the file, 0 to read
+ * @param  aio       The batch to queue the access to, or NULL to make
+ *                   it straight away
+ * @return           The number of bytes transferred, 0 if the offset
+ *                   is past the end of the file's cluster chain or the
+ *                   drive access failed. A short count is returned if
+ *                   the access stopped part way through the run.
+ */
+u_int transferFileRun(BC_FILE *file, uint64_t offset, u_int len, BC_IOVEC **iov, u_int *iovOffset, int write, BC_AIO *aio)
+{
+	BC_FS *fs = file->fs;
+	u_int bpc = fs->bootRecord->bytesPerCluster;
+	u_int index = offset / bpc;
+	u_int cluster = getFileCluster(file, index);
+	if(cluster == 0xffffffff)
+		return 0;
 
-		if(lenLeft < bytesLeft) /* read from current cluster only */
+	/* Extend the run over the contiguous clusters which follow */
+	u_int runClusters = 1;
+	u_int runLen = bpc - offset % bpc;
+	while(runLen < len && getFileCluster(file, index + runClusters) == cluster + runClusters)
+	{
+		runLen += bpc;
+		runClusters++;
+	}
+	if(runLen > len)
+		runLen = len;
+
+	/* Gather the pieces of the buffers which make up the run */
+	off_t loc = getClusterLoc(fs, cluster) + offset % bpc;
+	u_int lenLeft = runLen;
+	while(lenLeft > 0)
+	{
+		BC_IOVEC vec[DRIVE_IOV_MAX];
+		BC_IOVEC *vecIov = *iov;
+		u_int vecIovOffset = *iovOffset;
+		int count = 0;
+		u_int vecLen = 0;
+		while(lenLeft > 0 && count < DRIVE_IOV_MAX)
+		{
+			u_int piece = (*iov)->len - *iovOffset;
+			if(piece > lenLeft)
+				piece = lenLeft;
+			if(piece)
+			{
+				vec[count].base = (char*) (*iov)->base + *iovOffset;
+				vec[count].len = piece;
+				count++;
+			}
+			*iovOffset += piece;
+			if(*iovOffset == (*iov)->len)
+			{
+				(*iov)++;
+				*iovOffset = 0;
+			}
+			vecLen += piece;
+			lenLeft -= piece;
+		}
+		if(aio)
 		{
-			src->currentLoc += lenLeft;
-			lenLeft -= lenLeft;
+			queueAsyncIO(aio, vec, count, loc, write);
+			loc += vecLen;
+			continue;
 		}
-		else /* read may span multiple clusters */
+
+		ssize_t done = write ? writeVirDriveV(fs, vec, count, loc) : readVirDriveV(fs, vec, count, loc);
+		if(done < (ssize_t) vecLen)
 		{
-			u_int nextClusterAddr = fileAllocTable[src->currentClusterAddr];
-			if(nextClusterAddr != 0xffffffff) 
+			if(done <= 0)
 			{
-				src->currentClusterAddr = nextClusterAddr;
-				src->currentLoc = src->currentClusterAddr * bootRecord->bytesPerCluster;
+				fprintf(stderr, "%s incomplete: could not %s the virtual drive\n", 
+				        write ? "Write" : "Read", write ? "write to" : "read from");
+				done = 0;
 			}
-			else
+
+			/* Leave the buffers just past the bytes transferred */
+			u_int skip = done;
+			*iov = vecIov;
+			*iovOffset = vecIovOffset;
+			while(skip > 0)
 			{
-				src->currentClusterAddr = addClusterToChain(src->currentClusterAddr);
-				src->currentLoc = src->currentClusterAddr * bootRecord->bytesPerCluster;
+				u_int piece = (*iov)->len - *iovOffset;
+				if(piece > skip)
+					piece = skip;
+				*iovOffset += piece;
+				skip -= piece;
+				if(*iovOffset == (*iov)->len)
+				{
+					(*iov)++;
+					*iovOffset = 0;
+				}
 			}
-			lenLeft -= bytesLeft;
-			dest += bytesLeft;
+			return runLen - lenLeft - vecLen + done;
 		}
+		loc += vecLen;
+	}
+
+	return runLen;
+}
+
+/**
+ * Starts reading a number of bytes from a file, starting at a given 
+ * offset, into a given memory location, in the manner of readFileAt().
+ * With the async I/O engine the call returns once the reads of the 
+ * file's clusters have been submitted, so one thread may keep several
+ * reads in flight; otherwise the data has been read when it returns. 
+ * The buffer must not be used until the read has been waited for with
+ * waitFileAsync().
+ *
+ * @param  src    A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to read from
+ * @param  dest   The buffer to store the data read
+ * @param  len    The number of bytes to read
+ * @return        A handle for the read, or NULL if the file object is 
+ *                invalid or the handle cannot be allocated
+ */
+BC_AIO *readFileAsync(BC_FILE *src, uint64_t offset, void *dest, u_int len)
+{
+	if(!src)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return NULL;
 	}
-	src->filePosition += len;
+
+	BC_AIO *aio = malloc(sizeof(BC_AIO));
+	if(!aio)
+	{
+		fprintf(stderr, "Error allocating space for an async read\n");
+		return NULL;
+	}
+	int batch = initAsyncBatch(src->fs, aio);
+	BC_IOVEC iov = { dest, len };
+
+	pthread_mutex_lock(&src->lock);
+	u_int bytesRead = readFileRuns(src, offset, &iov, 1, batch ? aio : NULL);
+	if(!batch)
+		aio->transferred = bytesRead;
+	pthread_mutex_unlock(&src->lock);
+	submitAsyncBatch(aio);
+
+	return aio;
+}
+
+/**
+ * Starts writing a number of bytes from a source into a file, starting
+ * at a given offset, in the manner of writeFileAt(). The file's chain
+ * and size are updated before the call returns. With the async I/O 
+ * engine the call returns once the writes of the file's clusters have 
+ * been submitted; otherwise the data has been written when it returns.
+ * The source must not be changed until the write has been waited for 
+ * with waitFileAsync().
+ *
+ * @param  dest   A pointer to an open BC_FILE object
+ * @param  offset The offset in the file to write to
+ * @param  src    A pointer to the data to write
+ * @param  len    The number of bytes to write
+ * @return        A handle for the write, or NULL if the file object is
+ *                invalid or the handle cannot be allocated
+ */
+BC_AIO *writeFileAsync(BC_FILE *dest, uint64_t offset, void *src, u_int len)
+{
+	if(!dest)
+	{
+		fprintf(stdout, "BC_FILE object is null. Invalid operation.\n");
+		return NULL;
+	}
+
+	BC_AIO *aio = malloc(sizeof(BC_AIO));
+	if(!aio)
+	{
+		fprintf(stderr, "Error allocating space for an async write\n");
+		return NULL;
+	}
+	int batch = initAsyncBatch(dest->fs, aio);
+	BC_IOVEC iov = { src, len };
+
+	pthread_mutex_lock(&dest->lock);
+	u_int bytesWritten = writeFileRuns(dest, offset, &iov, 1, batch ? aio : NULL);
+	if(!batch)
+		aio->transferred = bytesWritten;
+	invalidateReadahead(dest);
+	pthread_mutex_unlock(&dest->lock);
+	if(batch)
+		aio->fileSeq = &dest->fs->fileSeq[dest->startClusterAddr % FILE_SEQ_STRIPES];
+	submitAsyncBatch(aio);
+
+	return aio;
+}
+
+/**
+ * Determines if an async read or write has completed, without waiting
+ *
+ * @param  aio The handle returned by readFileAsync() or writeFileAsync()
+ * @return     1 if the read or write has completed, 0 otherwise
+ */
+int pollFileAsync(BC_AIO *aio)
+{
+	BC_FS *fs = aio->fs;
+
+	pthread_mutex_lock(&fs->aioLock);
+	if(fs->aioMode == AIO_MODE_URING && !fs->aioRing.reaping)
+		reapAsyncRing(fs);
+	int done = aio->pending == 0;
+	pthread_mutex_unlock(&fs->aioLock);
+
+	return done;
+}
+
+/**
+ * Waits for an async read or write to complete and frees its handle. 
+ * The readahead of the file is dropped again once a write has landed, 
+ * in case it was refilled while the write was in flight.
+ *
+ * @param  aio The handle returned by readFileAsync() or writeFileAsync()
+ * @return     The number of bytes read or written, or 0 if the transfer
+ *             failed or was cut short
+ */
+u_int waitFileAsync(BC_AIO *aio)
+{
+	waitAsyncBatch(aio);
+	if(aio->fileSeq)
+		__atomic_add_fetch(aio->fileSeq, 1, __ATOMIC_RELEASE);
+	u_int result = aio->error ? 0 : aio->transferred;
+	free(aio);
+
+	return result;
 }
 
 /**
- * Closes a file.
+ * Closes a file, writing any pending size and modified date of the 
+ * file to its directory entry.
  *
  * @param file A pointer to an open BC_FILE object
  */
 void closeFile(BC_FILE *file)
 {
 	if(file)
+	{
+		writeFileMetadata(file);
 		destroyBC_File(file);
+	}
 }
 
 /**
@@ -1416,25 +6284,78 @@ void deleteFile(BC_FILE *file)
 {
 	if(file)
 	{
-		/* Zero used clusters and FAT entries*/
-		u_int currentCluster = file->startClusterAddr;
-		u_int nextCluster = fileAllocTable[currentCluster];
-		while(nextCluster != 0xffffffff)
+		BC_FS *fs = file->fs;
+		BC_FILE *open;
+
+		/* Zero the directory entry first, so the file can no longer be
+		   opened, and mark every handle of the file as unlinked. Its 
+		   clusters are freed when the last handle is closed. If the 
+		   file was already deleted through another handle this handle
+		   is only closed */
+		pthread_mutex_lock(&fs->openFilesLock);
+		lockDir(fs, file->dirClusterAddr, 1);
+		if(!file->unlinked)
 		{
-			formatCluster(currentCluster);
-			fileAllocTable[currentCluster] = 0x00000000;
-			currentCluster = nextCluster;
-			nextCluster = fileAllocTable[currentCluster];
-			bootRecord->freeClusters++;
+			deleteDirEntry(fs, file->dirClusterAddr, file->dirEntryAddr);
+			for(open = fs->openFiles; open; open = open->next)
+				if(open->startClusterAddr == file->startClusterAddr)
+					__atomic_store_n(&open->unlinked, 1, __ATOMIC_SEQ_CST);
 		}
-		formatCluster(currentCluster);
-		fileAllocTable[currentCluster] = 0x00000000;
-		bootRecord->freeClusters++;
-		findAndSetNextFreeCluster();
-
-		/* Zero directory entry */
-		deleteDirEntry(file->dirClusterAddr, file->dirEntryAddr);
+		unlockDir(fs, file->dirClusterAddr);
+		pthread_mutex_unlock(&fs->openFilesLock);
 
 		destroyBC_File(file);
 	}
 }
+
+/**
+ * Frees the cluster chain of a deleted file. The clusters are zeroed
+ * and their FAT entries cleared. With DRIVE_LAZY_ZERO the clusters are
+ * only marked to be zeroed later.
+ *
+ * @param fs           The file system
+ * @param startCluster The first cluster of the chain
+ */
+void freeFileChain(BC_FS *fs, u_int startCluster)
+{
+	u_int currentCluster = startCluster;
+	while(currentCluster != 0xffffffff)
+	{
+		u_int nextCluster = __atomic_load_n(&fs->fileAllocTable[currentCluster], __ATOMIC_SEQ_CST);
+		if(fs->lazyZero)
+			markClusterForZeroing(fs, currentCluster);
+		else
+			formatCluster(fs, currentCluster);
+		setFATEntry(fs, currentCluster, 0x00000000);
+		currentCluster = nextCluster;
+	}
+}
+
+/**
+ * Frees the clusters of every deleted file which is still open, so 
+ * that they are not lost when the file system is closed with the 
+ * file's handles open.
+ *
+ * @param fs The file system
+ */
+void freeUnlinkedFiles(BC_FS *fs)
+{
+	BC_FILE *file;
+	BC_FILE *open;
+
+	pthread_mutex_lock(&fs->openFilesLock);
+	for(file = fs->openFiles; file; file = file->next)
+	{
+		if(!file->unlinked)
+			continue;
+		for(open = fs->openFiles; open != file; open = open->next)
+			if(open->startClusterAddr == file->startClusterAddr)
+				break;
+		if(open == file)
+		{
+			releaseAllocPool(file);
+			freeFileChain(fs, file->startClusterAddr);
+		}
+	}
+	pthread_mutex_unlock(&fs->openFilesLock);
+}
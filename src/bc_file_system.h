@@ -18,23 +18,57 @@
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/uio.h>
 #include "bc_strlib/bc_strlib.h"
 
  /* Constants */
 
 #define DRIVE_LABEL_MAX 23
+#define BOOT_RECORD_VERSION 2
 #define FILE_NAME_MIN 8
 #define FILE_NAME_MAX 42
+#define FILE_NAME_MAX_V2 38
 #define FILE_EXT_SIZE 3
 #define FILE_SIZE_MAX 16384
 #define CLUSTER_SIZE 512
+#define CLUSTER_SIZE_MIN 512
+#define CLUSTER_SIZE_MAX 65536
 #define FAT_ENTRY_BYTES 4
 #define DIR_ENTRY_BYTES 64
-#define DIR_ENTRIES_PER_CLUSTER 8
+#define DRIVE_MODE_STDIO 0x0
+#define DRIVE_MODE_MMAP 0x1
+#define DRIVE_DIR_INDEX 0x2
+#define DRIVE_SYNC_METADATA 0x4
+#define DRIVE_LARGE_FILES 0x8
+#define DRIVE_LAZY_ZERO 0x10
+#define DRIVE_BACKGROUND_RECLAIM 0x20
+#define DRIVE_ASYNC_IO 0x40
+#define DRIVE_IOV_MAX 64
+#define DIR_INDEX_BUCKETS 256
+#define DIR_BTREE_THRESHOLD 32
+#define PATH_CACHE_BUCKETS 256
+#define PATH_CACHE_MAX 4096
+#define DIR_LOCK_STRIPES 64
+#define DIR_SNAPSHOT_SLOTS 64
+#define DIR_SNAPSHOT_RETIRE_MAX 256
+#define ALLOC_POOL_MIN 8
+#define ALLOC_POOL_MAX 64
+#define AIO_MODE_NONE 0
+#define AIO_MODE_URING 1
+#define AIO_MODE_THREADS 2
+#define AIO_QUEUE_DEPTH 128
+#define AIO_WORKERS 4
+#define READAHEAD_MIN 2
+#define READAHEAD_MAX 32
+#define FILE_SEQ_STRIPES 64
+#define RECLAIM_BATCH 256
+#define RECLAIM_INTERVAL_MS 100
 
 /* Type definitions */
 
@@ -54,6 +88,8 @@ typedef struct
 	u_int freeClusters;
 	u_int nextFreeCluster;
 	u_int driveSize;
+	u_int version;
+	uint64_t driveSize64;
 
 } BootRecord;
 
@@ -70,6 +106,13 @@ typedef struct
 } DirEntry;
 
 typedef struct
+{
+	void *base;
+	u_int len;
+
+} BC_IOVEC;
+
+typedef struct BC_FILE
 {
 	u_int used;
 	u_int write;
@@ -79,78 +122,415 @@ typedef struct
 	char fileExt[FILE_EXT_SIZE + 1];
 	u_int createDate;
 	u_int modifyDate;
-	u_int filePosition;
-	u_int fileSize;
+	uint64_t filePosition;
+	uint64_t fileSize;
 	u_int startClusterAddr;
-	u_int startLoc;
+	off_t startLoc;
 	u_int currentClusterAddr;
-	u_int currentLoc;
+	off_t currentLoc;
 	u_int dirClusterAddr;
 	u_int dirEntryAddr;
+	u_int *clusterMap;
+	u_int clusterMapCount;
+	u_int clusterMapSize;
+	u_int metaDirty;
+	time_t modifyTime;
+	time_t metaSyncTime;
+	u_int poolStart;
+	u_int poolCount;
+	u_int poolNext;
+	char *raBuf;
+	u_int raSize;
+	uint64_t raStart;
+	u_int raLen;
+	u_int raWindow;
+	uint64_t raNext;
+	u_int raSeq;
+	u_int unlinked;
+	struct BC_FS *fs;
+	pthread_mutex_t lock;
+	struct BC_FILE *prev;
+	struct BC_FILE *next;
 
 } BC_FILE;
 
-/* Globals */
+typedef struct
+{
+	u_int clusterAddr;
+	u_int dirty;
+	u_int prev;
+	u_int next;
+	char *data;
+
+} CacheSlot;
+
+typedef struct
+{
+	u_int hash;
+	u_int entryAddr;
+	u_int ptr;
+
+} BTreeKey;
+
+typedef struct
+{
+	u_int leaf;
+	u_int count;
+	u_int link;
+	u_int reserved;
+	BTreeKey keys[];
+
+} BTreeNode;
+
+typedef struct DirIndexEntry
+{
+	char fileName[FILE_NAME_MAX + 1];
+	char fileExt[FILE_EXT_SIZE + 1];
+	char attr;
+	u_int startCluster;
+	u_int entryAddr;
+	struct DirIndexEntry *next;
+
+} DirIndexEntry;
+
+typedef struct PathCacheEntry
+{
+	char *dirPath;
+	u_int clusterAddr;
+	struct PathCacheEntry *next;
+
+} PathCacheEntry;
+
+typedef struct DirSnapshot
+{
+	u_int buckets;
+	u_int count;
+	DirIndexEntry *table[];
+
+} DirSnapshot;
+
+typedef struct DirIndex
+{
+	u_int dirCluster;
+	DirSnapshot *snapshot;
+	struct DirIndex *next;
 
-FILE *virDrive;
-BootRecord *bootRecord;
-u_int *fileAllocTable;
+} DirIndex;
+
+typedef struct
+{
+	u_int count[2];
+	char pad[56];
+
+} SnapshotReader;
+
+typedef struct AsyncOp
+{
+	struct BC_AIO *aio;
+	int write;
+	int iovcnt;
+	u_int len;
+	off_t loc;
+	struct AsyncOp *next;
+	struct iovec vec[];
+
+} AsyncOp;
+
+typedef struct BC_AIO
+{
+	struct BC_FS *fs;
+	AsyncOp *queued;
+	AsyncOp **queuedTail;
+	u_int queuedCount;
+	u_int pending;
+	u_int transferred;
+	int error;
+	u_int *fileSeq;
+
+} BC_AIO;
+
+typedef struct
+{
+	int fd;
+	u_int entries;
+	u_int *sqHead;
+	u_int *sqTail;
+	u_int sqMask;
+	u_int *sqArray;
+	void *sqes;
+	size_t sqesSize;
+	u_int *cqHead;
+	u_int *cqTail;
+	u_int cqMask;
+	void *cqes;
+	void *sqMap;
+	size_t sqMapSize;
+	void *cqMap;
+	size_t cqMapSize;
+	int reaping;
+
+} AsyncRing;
+
+typedef struct BC_FS
+{
+	FILE *virDrive;
+	int virDriveMode;
+	char *virDriveMap;
+	size_t virDriveMapSize;
+	BootRecord *bootRecord;
+	u_int *fileAllocTable;
+	uint64_t *freeClusterMap;
+	u_int *fatClusterFree;
+	uint64_t *pendingZeroMap;
+	u_int pendingZeroCount;
+	int lazyZero;
+	char *fatClusterDirty;
+	int dirIndexEnabled;
+	DirIndex *dirIndexes[DIR_INDEX_BUCKETS];
+	u_int snapshotEpoch;
+	SnapshotReader *snapshotReaders;
+	void **retiredSnapshots;
+	u_int retiredCount;
+	u_int retiredSize;
+	PathCacheEntry *pathCache[PATH_CACHE_BUCKETS];
+	u_int pathCacheCount;
+	int metaStrict;
+	int largeFiles;
+	u_int metaSyncInterval;
+	BC_FILE *openFiles;
+	CacheSlot *clusterCache;
+	u_int *clusterCacheIndex;
+	u_int clusterCacheSlots;
+	u_int clusterCacheHead;
+	u_int clusterCacheTail;
+	pthread_mutex_t fatLock;
+	pthread_mutex_t cacheLock;
+	pthread_mutex_t openFilesLock;
+	pthread_mutex_t dirIndexLock;
+	pthread_rwlock_t pathCacheLock;
+	pthread_rwlock_t dirLocks[DIR_LOCK_STRIPES];
+	u_int dirSeq[DIR_LOCK_STRIPES];
+	int aioMode;
+	AsyncRing aioRing;
+	pthread_t aioWorkers[AIO_WORKERS];
+	AsyncOp *aioQueue;
+	AsyncOp **aioQueueTail;
+	int aioStop;
+	pthread_mutex_t aioLock;
+	pthread_cond_t aioDone;
+	pthread_cond_t aioWork;
+	u_int fileSeq[FILE_SEQ_STRIPES];
+	int reclaimRunning;
+	int reclaimStop;
+	pthread_t reclaimThread;
+	pthread_mutex_t reclaimLock;
+	pthread_cond_t reclaimWake;
+
+} BC_FS;
 
 /* File System Operations */
 
-void initFileSystem(char *virDriveName, char *virDriveLabel);
-void closeFileSystem();
+BC_FS *initFileSystem(char *virDriveName, char *virDriveLabel, int driveFlags, u_int cacheSlots, u_int clusterSize);
+void closeFileSystem(BC_FS *fs);
+void syncFileSystem(BC_FS *fs);
+void setMetadataInterval(BC_FS *fs, u_int seconds);
+
+/* Lock Operations */
+
+void initLocks(BC_FS *fs);
+void destroyLocks(BC_FS *fs);
+void initRecursiveMutex(pthread_mutex_t *mutex);
+void lockDir(BC_FS *fs, u_int dirCluster, int write);
+void unlockDir(BC_FS *fs, u_int dirCluster);
+u_int readDirSeq(BC_FS *fs, u_int dirCluster);
+int checkDirSeq(BC_FS *fs, u_int dirCluster, u_int seq);
 
 /* Virtual Drive Operations */
 
 FILE *openVirDrive(char *virDriveName);
-void formatVirDrive();
-void closeVirDrive();
-void formatCluster(u_int clusterAddr);
+int formatVirDrive(BC_FS *fs);
+void closeVirDrive(BC_FS *fs);
+void formatCluster(BC_FS *fs, u_int clusterAddr);
+int mapVirDrive(BC_FS *fs);
+void unmapVirDrive(BC_FS *fs);
+void syncVirDrive(BC_FS *fs);
+off_t getClusterLoc(BC_FS *fs, u_int clusterAddr);
+char *getClusterPtr(BC_FS *fs, u_int clusterAddr);
+void readVirDrive(BC_FS *fs, void *dest, off_t loc, u_int len);
+void writeVirDrive(BC_FS *fs, void *src, off_t loc, u_int len);
+ssize_t readVirDriveDirect(BC_FS *fs, void *dest, off_t loc, u_int len);
+ssize_t writeVirDriveDirect(BC_FS *fs, void *src, off_t loc, u_int len);
+ssize_t readVirDriveV(BC_FS *fs, BC_IOVEC *iov, int iovcnt, off_t loc);
+ssize_t writeVirDriveV(BC_FS *fs, BC_IOVEC *iov, int iovcnt, off_t loc);
+
+/* Async I/O Operations */
+
+void initAsyncEngine(BC_FS *fs);
+void destroyAsyncEngine(BC_FS *fs);
+int setupAsyncRing(BC_FS *fs);
+void *asyncWorker(void *arg);
+int initAsyncBatch(BC_FS *fs, BC_AIO *aio);
+void queueAsyncIO(BC_AIO *aio, BC_IOVEC *iov, int iovcnt, off_t loc, int write);
+void submitAsyncBatch(BC_AIO *aio);
+void waitAsyncBatch(BC_AIO *aio);
+u_int finishAsyncBatch(BC_AIO *aio);
+void submitAsyncRing(BC_FS *fs, AsyncOp *op);
+void enterAsyncRing(BC_FS *fs, u_int toSubmit);
+void reapAsyncRing(BC_FS *fs);
+int runAsyncOp(BC_FS *fs, AsyncOp *op);
+void completeAsyncOp(AsyncOp *op, int res);
+
+/* Cluster Cache Operations */
+
+void initClusterCache(BC_FS *fs, u_int slots);
+void destroyClusterCache(BC_FS *fs);
+void flushClusterCache(BC_FS *fs);
+CacheSlot *getCacheSlot(BC_FS *fs, u_int clusterAddr, int load);
+void writeBackCacheSlot(BC_FS *fs, CacheSlot *slot);
+void touchCacheSlot(BC_FS *fs, u_int slotIndex);
+void zeroCacheSlot(BC_FS *fs, u_int clusterAddr);
 
 /* Boot Record Operations */
 
-BootRecord *initBootRecord(char *driveLabel);
-void writeBootRecord();
-void readBootRecord();
+BootRecord *initBootRecord(BC_FS *fs, char *driveLabel, u_int clusterSize);
+void writeBootRecord(BC_FS *fs);
+void readBootRecord(BC_FS *fs);
 
 /* File Allocation Table Operations */
 
-u_int *initFATClusters();
-void writeFAT();
-void readFAT();
-u_int addClusterToChain(u_int clusterAddr);
-void findAndSetNextFreeCluster();
+u_int *initFATClusters(BC_FS *fs);
+void writeFAT(BC_FS *fs);
+void readFAT(BC_FS *fs);
+u_int addClusterToChain(BC_FS *fs, u_int clusterAddr);
+void findAndSetNextFreeCluster(BC_FS *fs);
+int setFATEntry(BC_FS *fs, u_int clusterAddr, u_int value);
+u_int allocateCluster(BC_FS *fs);
+u_int buildFreeClusterMap(BC_FS *fs);
+u_int findFreeCluster(BC_FS *fs, u_int startAddr);
+u_int countFreeRun(BC_FS *fs, u_int startAddr, u_int maxCount);
+u_int findFreeRun(BC_FS *fs, u_int count, u_int *runStart);
+u_int extendClusterChain(BC_FS *fs, u_int clusterAddr, u_int count);
+u_int reserveClusters(BC_FS *fs, u_int count, u_int *runStart);
+void unreserveClusters(BC_FS *fs, u_int startAddr, u_int count);
+int linkReservedClusters(BC_FS *fs, u_int clusterAddr, u_int startAddr, u_int count);
+u_int getFreeClusterCount(BC_FS *fs);
+uint64_t getFreeBytes(BC_FS *fs);
+void markClusterForZeroing(BC_FS *fs, u_int clusterAddr);
+u_int reclaimClusters(BC_FS *fs, u_int maxClusters);
+void zeroClusters(BC_FS *fs, u_int startAddr, u_int count);
+void startReclaimer(BC_FS *fs);
+void stopReclaimer(BC_FS *fs);
+void *reclaimWorker(void *arg);
 
 /* Directory Entry Operations */
 
-u_int createDirFileEntry(u_int clusterAddr, char attr, char *name, char *ext);
-u_int createDirSubEntry(u_int clusterAddr, char attr, char *name);
-void deleteDirEntry(u_int dirCluster, u_int entryAddr);
-u_int dirFileEntryExists(u_int clusterAddr, char *fileName, char *fileExt);
-u_int getDirFileEntryAddr(u_int clusterAddr, char *fileName, char *fileExt);
-char *getDirectoryListing(char *dirPath);
-u_int getDirectoryClusterAddress(u_int currentClusterAddr, char *dirName);
+u_int createDirFileEntry(BC_FS *fs, u_int clusterAddr, char attr, char *name, char *ext);
+u_int createDirSubEntry(BC_FS *fs, u_int clusterAddr, char attr, char *name);
+void deleteDirEntry(BC_FS *fs, u_int dirCluster, u_int entryAddr);
+u_int dirFileEntryExists(BC_FS *fs, u_int clusterAddr, char *fileName, char *fileExt);
+u_int findDirFileEntry(BC_FS *fs, u_int clusterAddr, char *fileName, char *fileExt);
+u_int getDirFileEntryAddr(BC_FS *fs, u_int clusterAddr, char *fileName, char *fileExt);
+char *getDirectoryListing(BC_FS *fs, char *dirPath);
+u_int getDirectoryClusterAddress(BC_FS *fs, u_int currentClusterAddr, char *dirName);
 u_int encodeTimeBytes();
+u_int encodeTime(time_t calTime);
 struct tm *decodeTimeBytes(u_int timeBytes);
-u_int getDataStartLoc();
-u_int getFirstFreeDirEntryAddr(u_int dirCluster);
-u_int getDirEntryLoc(u_int dirCluster, u_int entryAddr);
-DirEntry *getDirEntry(u_int dirCluster, u_int entryAddr);
-void setDirEntry(u_int dirCluster, u_int entryAddr, DirEntry *entry);
+u_int getDirEntriesPerCluster(BC_FS *fs);
+off_t getDataStartLoc(BC_FS *fs);
+u_int getFirstFreeDirEntryAddr(BC_FS *fs, u_int dirCluster);
+off_t getDirEntryLoc(BC_FS *fs, u_int dirCluster, u_int entryAddr);
+DirEntry *getDirEntry(BC_FS *fs, u_int dirCluster, u_int entryAddr);
+uint64_t getDirEntrySize(DirEntry *entry);
+int setDirEntrySize(DirEntry *entry, uint64_t size);
+void setDirEntry(BC_FS *fs, u_int dirCluster, u_int entryAddr, DirEntry *entry);
+
+/* Directory Index Operations */
+
+u_int hashDirEntryName(char *fileName, char *fileExt);
+DirIndex *findDirIndex(BC_FS *fs, u_int dirCluster);
+DirIndex *getDirIndex(BC_FS *fs, u_int dirCluster);
+int lookupDirIndex(BC_FS *fs, u_int dirCluster, char *fileName, char *fileExt, DirIndexEntry *found);
+DirIndexEntry *lookupDirSnapshot(DirSnapshot *snapshot, char *fileName, char *fileExt);
+void insertDirSnapshotEntry(DirSnapshot *snapshot, DirIndexEntry *indexEntry);
+DirSnapshot *copyDirSnapshot(BC_FS *fs, DirSnapshot *snapshot);
+void unlinkDirSnapshotEntry(BC_FS *fs, DirSnapshot *snapshot, char *fileName, char *fileExt);
+void publishDirSnapshot(BC_FS *fs, DirIndex *index, DirSnapshot *snapshot);
+void retireDirSnapshotMemory(BC_FS *fs, void *ptr);
+void reclaimDirSnapshots(BC_FS *fs);
+u_int enterDirSnapshot(BC_FS *fs);
+void leaveDirSnapshot(BC_FS *fs, u_int token);
+void addDirIndexEntry(BC_FS *fs, u_int dirCluster, DirEntry *entry, u_int entryAddr);
+void removeDirIndexEntry(BC_FS *fs, u_int dirCluster, char *fileName, char *fileExt);
+void destroyDirIndexes(BC_FS *fs);
+
+/* Directory B-Tree Operations */
+
+void initDirHeader(BC_FS *fs, u_int dirCluster);
+int readDirHeader(BC_FS *fs, u_int dirCluster, DirEntry *header);
+void writeDirHeader(BC_FS *fs, u_int dirCluster, DirEntry *header);
+void addDirBTreeEntry(BC_FS *fs, u_int dirCluster, DirEntry *entry, u_int entryAddr, u_int entryCluster);
+void insertDirBTreeEntry(BC_FS *fs, DirEntry *header, DirEntry *entry, u_int entryAddr, u_int entryCluster);
+void removeDirBTreeEntry(BC_FS *fs, u_int dirCluster, DirEntry *entry, u_int entryAddr);
+u_int lookupDirBTree(BC_FS *fs, u_int root, char *fileName, char *fileExt, DirEntry *entry);
+void buildDirBTree(BC_FS *fs, u_int dirCluster, DirEntry *header);
+void freeDirBTree(BC_FS *fs, u_int nodeCluster);
+u_int getBTreeNodeCapacity(BC_FS *fs);
+BTreeNode *readBTreeNode(BC_FS *fs, u_int nodeCluster);
+void writeBTreeNode(BC_FS *fs, u_int nodeCluster, BTreeNode *node);
+int compareBTreeKeys(BTreeKey *a, BTreeKey *b);
+u_int findBTreeChild(BTreeNode *node, BTreeKey *key);
+int insertBTreeKey(BC_FS *fs, u_int nodeCluster, BTreeKey *key, BTreeKey *promoted);
+
+/* Path Cache Operations */
+
+u_int resolveDirPath(BC_FS *fs, char **path, u_int depth, int create);
+u_int createDirPathEntry(BC_FS *fs, u_int clusterAddr, char *dirName);
+u_int hashDirPath(char *dirPath);
+int lookupPathCache(BC_FS *fs, char *dirPath, u_int *clusterAddr);
+void addPathCacheEntry(BC_FS *fs, char *dirPath, u_int clusterAddr);
+void invalidatePathCache(BC_FS *fs, int positive);
+void clearPathCache(BC_FS *fs, int positive);
 
 /* File Struct Operations */
 
 void rewindBC_File(BC_FILE*);
 void destroyBC_File(BC_FILE*);
+void preallocateFile(BC_FILE *file, uint64_t len);
+uint64_t getFileSizeLimit(BC_FILE *file);
+u_int getFileCluster(BC_FILE *file, u_int index);
+int seekFile(BC_FILE *file, long offset, int whence);
+void touchFileMetadata(BC_FILE *file);
+void writeFileMetadata(BC_FILE *file);
+void syncFileMetadata(BC_FS *fs);
+u_int extendFileChain(BC_FILE *file, u_int clusterAddr, u_int count);
+void releaseAllocPool(BC_FILE *file);
+void releaseAllocPools(BC_FS *fs);
+u_int readFileAhead(BC_FILE *file, uint64_t offset, void *dest, u_int len);
+void fillReadahead(BC_FILE *file, uint64_t offset);
+void invalidateReadahead(BC_FILE *file);
 
 /* File Operations */
 
-BC_FILE *openFile(char *filePath);
-void createDirectory(char *dirPath);
+BC_FILE *openFile(BC_FS *fs, char *filePath);
+void createDirectory(BC_FS *fs, char *dirPath);
 void writeFile(void *src, u_int len, BC_FILE *dest);
 void readFile(void *dest, u_int len, BC_FILE *src);
+u_int readFileAt(BC_FILE *src, uint64_t offset, void *dest, u_int len);
+u_int writeFileAt(BC_FILE *dest, uint64_t offset, void *src, u_int len);
+u_int readFileV(BC_FILE *src, BC_IOVEC *iov, int iovcnt);
+u_int writeFileV(BC_FILE *dest, BC_IOVEC *iov, int iovcnt);
+u_int readFileRegion(BC_FILE *src, uint64_t offset, BC_IOVEC *iov, int iovcnt);
+u_int writeFileRegion(BC_FILE *dest, uint64_t offset, BC_IOVEC *iov, int iovcnt);
+u_int readFileRuns(BC_FILE *src, uint64_t offset, BC_IOVEC *iov, int iovcnt, BC_AIO *aio);
+u_int writeFileRuns(BC_FILE *dest, uint64_t offset, BC_IOVEC *iov, int iovcnt, BC_AIO *aio);
+u_int transferFileRun(BC_FILE *file, uint64_t offset, u_int len, BC_IOVEC **iov, u_int *iovOffset, int write, BC_AIO *aio);
+BC_AIO *readFileAsync(BC_FILE *src, uint64_t offset, void *dest, u_int len);
+BC_AIO *writeFileAsync(BC_FILE *dest, uint64_t offset, void *src, u_int len);
+int pollFileAsync(BC_AIO *aio);
+u_int waitFileAsync(BC_AIO *aio);
 void closeFile(BC_FILE *file);
 void deleteFile(BC_FILE *file);
+void freeFileChain(BC_FS *fs, u_int startCluster);
+void freeUnlinkedFiles(BC_FS *fs);
 
 #endif
@@ -17,8 +17,21 @@
 
 void testRun1();
 void testRun2();
-void printBootClusterInfo();
-void printDirectoryListing(char *dir);
+void testRun3();
+void testRun4();
+void testRun5();
+void benchmarkRead(int driveFlags, u_int cacheSlots);
+void benchmarkFragmentedRead(int driveFlags);
+void benchmarkRecordRead(int driveFlags, u_int cacheSlots, u_int recordSize);
+void benchmarkThreads(BC_FS *fs, u_int threads);
+void *readerThread(void *arg);
+void benchmarkWriteThreads(BC_FS *fs, u_int threads);
+void *writerThread(void *arg);
+void testDeleteWhileOpen(BC_FS *fs);
+void testDeleteDuringOpen(BC_FS *fs, u_int threads);
+void *deleterThread(void *arg);
+void printBootClusterInfo(BC_FS *fs);
+void printDirectoryListing(BC_FS *fs, char *dir);
 void pause(int pause);
 
 int main(int argc, char **argv)
@@ -37,18 +50,34 @@ int main(int argc, char **argv)
 	fprintf(stdout, "Test run 2 will reopen the previously initialized Drive2MB and\n");
 	fprintf(stdout, "display the boot record and the contents on the virtual drive.\n\n");
 
+	fprintf(stdout, "Test run 3 will benchmark sequential reads of a file on the\n");
+	fprintf(stdout, "Drive3MB virtual drive.\n\n");
+
+	fprintf(stdout, "Test run 4 will benchmark concurrent reads and appends of separate\n");
+	fprintf(stdout, "files on the Drive3MB virtual drive from 1 to 16 threads.\n\n");
+
+	fprintf(stdout, "Test run 5 will delete files on the Drive3MB virtual drive while\n");
+	fprintf(stdout, "they are open through other handles and while other threads are\n");
+	fprintf(stdout, "opening them.\n\n");
+
 	fprintf(stdout, "Note: Test run 1 should be performed before test run 2.\n\n");
 
-	while(input != 1 && input != 2)
+	while(input < 1 || input > 5)
 	{
-		fprintf(stdout, "Please choose the test to perform (1 or 2): ");
+		fprintf(stdout, "Please choose the test to perform (1, 2, 3, 4 or 5): ");
 		scanf("%d", &input);
 	}
 
 	if(input == 1)
 		testRun1();
-	else
+	else if(input == 2)
 		testRun2();
+	else if(input == 3)
+		testRun3();
+	else if(input == 4)
+		testRun4();
+	else
+		testRun5();
 
 	fprintf(stdout, "\nTest finished. Exiting program.\n");
 
@@ -59,45 +88,45 @@ void testRun1()
 {
 	pause(PAUSE);
 
-	initFileSystem("Drive2MB", "2MB_VDrive");
+	BC_FS *fs = initFileSystem("Drive2MB", "2MB_VDrive", DRIVE_MODE_STDIO, 64, CLUSTER_SIZE);
 
-	if(!virDrive)
+	if(!fs)
 	{
 		fprintf(stderr, "Error opening drive. Exiting");
 		exit(1);
 	}
 	fprintf(stdout, "Virtual drive opened\n");
 
-	printBootClusterInfo();
+	printBootClusterInfo(fs);
 
 	pause(PAUSE);
 
 	fprintf(stdout, "Opening 'testfile0.txt'\n");
-	BC_FILE *testfile0 = openFile("testfile0.txt");
+	BC_FILE *testfile0 = openFile(fs, "testfile0.txt");
 	
 	fprintf(stdout, "Creating 'directory0'\n");
-	createDirectory("directory0");
+	createDirectory(fs, "directory0");
 
 	fprintf(stdout, "Opening 'directory0/testfile1.txt'\n");
-	BC_FILE *testfile1 = openFile("directory0/testfile1.txt");
+	BC_FILE *testfile1 = openFile(fs, "directory0/testfile1.txt");
 
 	fprintf(stdout, "\n");
-	printDirectoryListing("root");
-	printDirectoryListing("directory0");
+	printDirectoryListing(fs, "root");
+	printDirectoryListing(fs, "directory0");
 
-	printBootClusterInfo();
+	printBootClusterInfo(fs);
 
 	pause(PAUSE);
 
 	fprintf(stdout, "Opening 'directory1/directory2/directory3/testfile2.txt'\n");
-	BC_FILE *testfile2 = openFile("directory1/directory2/directory3/testfile2.txt");
+	BC_FILE *testfile2 = openFile(fs, "directory1/directory2/directory3/testfile2.txt");
 
 	fprintf(stdout, "\n");
-	printDirectoryListing("root");
-	printDirectoryListing("directory0");
-	printDirectoryListing("directory1");
-	printDirectoryListing("directory1/directory2");
-	printDirectoryListing("directory1/directory2/directory3");
+	printDirectoryListing(fs, "root");
+	printDirectoryListing(fs, "directory0");
+	printDirectoryListing(fs, "directory1");
+	printDirectoryListing(fs, "directory1/directory2");
+	printDirectoryListing(fs, "directory1/directory2/directory3");
 
 	pause(PAUSE);
 
@@ -114,11 +143,11 @@ void testRun1()
 	writeFile(test2066, 2066, testfile1);
 
 	fprintf(stdout, "\n");
-	printDirectoryListing("root");
-	printDirectoryListing("directory0");
-	printDirectoryListing("directory1");
-	printDirectoryListing("directory1/directory2");
-	printDirectoryListing("directory1/directory2/directory3");
+	printDirectoryListing(fs, "root");
+	printDirectoryListing(fs, "directory0");
+	printDirectoryListing(fs, "directory1");
+	printDirectoryListing(fs, "directory1/directory2");
+	printDirectoryListing(fs, "directory1/directory2/directory3");
 
 	pause(PAUSE);
 
@@ -143,36 +172,36 @@ void testRun1()
 	strRead1[2066] = '\0';
 	printf("%s\n\n", strRead1);
 
-	printBootClusterInfo();
+	printBootClusterInfo(fs);
 
 	fprintf(stdout, "\n");
-	printDirectoryListing("root");
-	printDirectoryListing("directory0");
-	printDirectoryListing("directory1");
-	printDirectoryListing("directory1/directory2");
-	printDirectoryListing("directory1/directory2/directory3");
+	printDirectoryListing(fs, "root");
+	printDirectoryListing(fs, "directory0");
+	printDirectoryListing(fs, "directory1");
+	printDirectoryListing(fs, "directory1/directory2");
+	printDirectoryListing(fs, "directory1/directory2/directory3");
 
 	pause(PAUSE);
 
 	fprintf(stdout, "Attempting to print non-existent directories\n");
 
 	fprintf(stdout, "\n");
-	printDirectoryListing("directory1/directory4/directory3");
-	printDirectoryListing("directory1/directory2/directory3/directory4");
+	printDirectoryListing(fs, "directory1/directory4/directory3");
+	printDirectoryListing(fs, "directory1/directory2/directory3/directory4");
 
 	pause(PAUSE);
 
 	fprintf(stdout, "Deleting 'testfile0.txt'\n");
 	deleteFile(testfile0);
 
-	printBootClusterInfo();
+	printBootClusterInfo(fs);
 
 	fprintf(stdout, "\n");
-	printDirectoryListing("root");
-	printDirectoryListing("directory0");
-	printDirectoryListing("directory1");
-	printDirectoryListing("directory1/directory2");
-	printDirectoryListing("directory1/directory2/directory3");
+	printDirectoryListing(fs, "root");
+	printDirectoryListing(fs, "directory0");
+	printDirectoryListing(fs, "directory1");
+	printDirectoryListing(fs, "directory1/directory2");
+	printDirectoryListing(fs, "directory1/directory2/directory3");
 
 	pause(PAUSE);
 
@@ -181,57 +210,591 @@ void testRun1()
 	fprintf(stdout, "Closing 'testfile2.txt'\n");
 	closeFile(testfile2);
 
-	closeFileSystem();
+	closeFileSystem(fs);
 }
 
 void testRun2()
 {
 	pause(PAUSE);
 
-	initFileSystem("Drive2MB", "");
+	BC_FS *fs = initFileSystem("Drive2MB", "", DRIVE_MODE_MMAP, 0, 0);
 
-	if(!virDrive)
+	if(!fs)
 	{
 		fprintf(stderr, "Error opening drive. Exiting");
 		exit(1);
 	}
 	fprintf(stdout, "Virtual drive opened\n");
 
-	printBootClusterInfo();
+	printBootClusterInfo(fs);
 
 	pause(PAUSE);
 
 	fprintf(stdout, "\n");
-	printDirectoryListing("root");
-	printDirectoryListing("directory0");
-	printDirectoryListing("directory1");
-	printDirectoryListing("directory1/directory2");
-	printDirectoryListing("directory1/directory2/directory3");
+	printDirectoryListing(fs, "root");
+	printDirectoryListing(fs, "directory0");
+	printDirectoryListing(fs, "directory1");
+	printDirectoryListing(fs, "directory1/directory2");
+	printDirectoryListing(fs, "directory1/directory2/directory3");
+
+	pause(PAUSE);
+}
+
+void testRun3()
+{
+	pause(PAUSE);
+
+	fprintf(stdout, "Benchmarking sequential reads (stdio, 64 cache slots)\n");
+	benchmarkRead(DRIVE_MODE_STDIO, 64);
+	fprintf(stdout, "Benchmarking sequential reads (stdio, no cache)\n");
+	benchmarkRead(DRIVE_MODE_STDIO, 0);
+	fprintf(stdout, "Benchmarking sequential reads (mmap)\n");
+	benchmarkRead(DRIVE_MODE_MMAP, 0);
+	fprintf(stdout, "Benchmarking fragmented reads (stdio, no cache)\n");
+	benchmarkFragmentedRead(DRIVE_MODE_STDIO);
+	fprintf(stdout, "Benchmarking fragmented reads (stdio, no cache, async I/O)\n");
+	benchmarkFragmentedRead(DRIVE_MODE_STDIO | DRIVE_ASYNC_IO);
+	fprintf(stdout, "Benchmarking 64 byte record reads (stdio, 64 cache slots)\n");
+	benchmarkRecordRead(DRIVE_MODE_STDIO, 64, 64);
+	fprintf(stdout, "Benchmarking 64 byte record reads (stdio, no cache)\n");
+	benchmarkRecordRead(DRIVE_MODE_STDIO, 0, 64);
+
+	pause(PAUSE);
+}
+
+void benchmarkRead(int driveFlags, u_int cacheSlots)
+{
+	u_int size = FILE_SIZE_MAX - 1;
+	u_int runs = 20000;
+	u_int i;
+
+	BC_FS *fs = initFileSystem("Drive3MB", "3MB_VDrive", driveFlags, cacheSlots, CLUSTER_SIZE);
+
+	if(!fs)
+	{
+		fprintf(stderr, "Error opening drive. Exiting");
+		exit(1);
+	}
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	for(i = 0; i < size; i++)
+		data[i] = 'a' + i % 26;
+
+	/* Write the file once so it is laid out sequentially */
+	BC_FILE *file = openFile(fs, "benchmark/sequential.txt");
+	if(file->fileSize != size)
+	{
+		preallocateFile(file, size);
+		writeFile(data, size, file);
+	}
+
+	clock_t start = clock();
+	for(i = 0; i < runs; i++)
+	{
+		rewindBC_File(file);
+		readFile(buf, size, file);
+	}
+	double secs = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+	if(memcmp(buf, data, size) != 0)
+		fprintf(stdout, "    Data read does not match data written\n");
+	fprintf(stdout, "    Read %u bytes %u times in %.3f seconds (%.1f MB/s)\n\n",
+	        size, runs, secs, (double) size * runs / secs / (1024 * 1024));
+
+	closeFile(file);
+	closeFileSystem(fs);
+	free(data);
+	free(buf);
+}
+
+void benchmarkFragmentedRead(int driveFlags)
+{
+	u_int files = 8;
+	u_int size = FILE_SIZE_MAX - 1;
+	u_int runs = 5000;
+	u_int i, j;
+	struct timespec start, end;
+
+	BC_FS *fs = initFileSystem("Drive3MB", "3MB_VDrive", driveFlags, 0, CLUSTER_SIZE);
+
+	if(!fs)
+	{
+		fprintf(stderr, "Error opening drive. Exiting");
+		exit(1);
+	}
+
+	char path[64];
+	char *data = malloc(size);
+	char *bufs[8];
+	BC_FILE *file[8];
+	BC_AIO *aio[8];
+	for(i = 0; i < size; i++)
+		data[i] = 'a' + i % 26;
+
+	/* Write the files a cluster at a time in turn so that their 
+	   clusters are interleaved on the drive */
+	for(j = 0; j < files; j++)
+	{
+		sprintf(path, "benchmark/fragmented%u.txt", j);
+		file[j] = openFile(fs, path);
+		bufs[j] = malloc(size);
+	}
+	if(file[0]->fileSize != size)
+	{
+		for(i = 0; i < size; i += CLUSTER_SIZE)
+			for(j = 0; j < files; j++)
+				writeFileAt(file[j], i, data + i, size - i < CLUSTER_SIZE ? size - i : CLUSTER_SIZE);
+	}
+
+	/* Keep the reads of all of the files in flight at once */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < runs; i++)
+	{
+		for(j = 0; j < files; j++)
+			aio[j] = readFileAsync(file[j], 0, bufs[j], size);
+		for(j = 0; j < files; j++)
+			waitFileAsync(aio[j]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	for(j = 0; j < files; j++)
+		if(memcmp(bufs[j], data, size) != 0)
+			fprintf(stdout, "    Data read from file %u does not match data written\n", j);
+	fprintf(stdout, "    Read %u files of %u bytes %u times in %.3f seconds (%.1f MB/s)\n\n",
+	        files, size, runs, secs, (double) size * files * runs / secs / (1024 * 1024));
+
+	for(j = 0; j < files; j++)
+	{
+		closeFile(file[j]);
+		free(bufs[j]);
+	}
+	closeFileSystem(fs);
+	free(data);
+}
+
+void benchmarkRecordRead(int driveFlags, u_int cacheSlots, u_int recordSize)
+{
+	u_int size = FILE_SIZE_MAX - 1;
+	u_int runs = 2000;
+	u_int records = size / recordSize;
+	u_int i, j;
+	struct timespec start, end;
+
+	BC_FS *fs = initFileSystem("Drive3MB", "3MB_VDrive", driveFlags, cacheSlots, CLUSTER_SIZE);
+
+	if(!fs)
+	{
+		fprintf(stderr, "Error opening drive. Exiting");
+		exit(1);
+	}
+
+	char *data = malloc(size);
+	char *buf = malloc(records * recordSize);
+	for(i = 0; i < size; i++)
+		data[i] = 'a' + i % 26;
+
+	BC_FILE *file = openFile(fs, "benchmark/sequential.txt");
+	if(file->fileSize != size)
+	{
+		preallocateFile(file, size);
+		writeFile(data, size, file);
+	}
+
+	/* Read the file front to back one record at a time */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < runs; i++)
+	{
+		rewindBC_File(file);
+		for(j = 0; j < records; j++)
+			readFile(buf + j * recordSize, recordSize, file);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	if(memcmp(buf, data, records * recordSize) != 0)
+		fprintf(stdout, "    Data read does not match data written\n");
+	fprintf(stdout, "    Read %u records of %u bytes %u times in %.3f seconds (%.1f MB/s)\n\n",
+	        records, recordSize, runs, secs, (double) records * recordSize * runs / secs / (1024 * 1024));
+
+	closeFile(file);
+	closeFileSystem(fs);
+	free(data);
+	free(buf);
+}
+
+void testRun4()
+{
+	u_int threads;
+
+	pause(PAUSE);
+
+	BC_FS *fs = initFileSystem("Drive3MB", "3MB_VDrive", DRIVE_MODE_STDIO, 64, CLUSTER_SIZE);
+
+	if(!fs)
+	{
+		fprintf(stderr, "Error opening drive. Exiting");
+		exit(1);
+	}
+
+	for(threads = 1; threads <= 16; threads *= 2)
+	{
+		fprintf(stdout, "Benchmarking concurrent reads (stdio, 64 cache slots, %u threads)\n", threads);
+		benchmarkThreads(fs, threads);
+	}
+
+	for(threads = 1; threads <= 16; threads *= 2)
+	{
+		fprintf(stdout, "Benchmarking concurrent appends (stdio, 64 cache slots, %u threads)\n", threads);
+		benchmarkWriteThreads(fs, threads);
+	}
+
+	closeFileSystem(fs);
 
 	pause(PAUSE);
 }
 
-void printBootClusterInfo()
+/* The work given to each reader thread by benchmarkThreads() */
+typedef struct ReaderArg
+{
+	BC_FS *fs;
+	u_int id;
+	u_int size;
+	u_int runs;
+	int mismatch;
+} ReaderArg;
+
+void benchmarkThreads(BC_FS *fs, u_int threads)
+{
+	u_int size = 4096;
+	u_int runs = 400000;
+	u_int i;
+	struct timespec start, end;
+
+	pthread_t tids[16];
+	ReaderArg args[16];
+
+	/* The total amount read is the same for every thread count */
+	for(i = 0; i < threads; i++)
+	{
+		args[i].fs = fs;
+		args[i].id = i;
+		args[i].size = size;
+		args[i].runs = runs / threads;
+		args[i].mismatch = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, readerThread, &args[i]);
+	for(i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	for(i = 0; i < threads; i++)
+		if(args[i].mismatch)
+			fprintf(stdout, "    Data read by thread %u does not match data written\n", i);
+	fprintf(stdout, "    Read %u bytes %u times in %.3f seconds (%.1f MB/s)\n\n",
+	        size, runs / threads * threads, secs,
+	        (double) size * (runs / threads * threads) / secs / (1024 * 1024));
+}
+
+void *readerThread(void *arg)
+{
+	ReaderArg *ra = arg;
+	char path[64];
+	u_int i;
+
+	char *data = malloc(ra->size);
+	char *buf = malloc(ra->size);
+	for(i = 0; i < ra->size; i++)
+		data[i] = 'a' + (i + ra->id) % 26;
+
+	sprintf(path, "benchmark/thread%02u.txt", ra->id);
+	BC_FILE *file = openFile(ra->fs, path);
+	if(file->fileSize != ra->size)
+		writeFile(data, ra->size, file);
+
+	for(i = 0; i < ra->runs; i++)
+	{
+		rewindBC_File(file);
+		readFile(buf, ra->size, file);
+	}
+
+	if(memcmp(buf, data, ra->size) != 0)
+		ra->mismatch = 1;
+
+	closeFile(file);
+	free(data);
+	free(buf);
+
+	return NULL;
+}
+
+void benchmarkWriteThreads(BC_FS *fs, u_int threads)
+{
+	u_int size = 256;
+	u_int runs = 32000;
+	u_int i;
+	struct timespec start, end;
+
+	pthread_t tids[16];
+	ReaderArg args[16];
+
+	/* The total amount written is the same for every thread count */
+	for(i = 0; i < threads; i++)
+	{
+		args[i].fs = fs;
+		args[i].id = i;
+		args[i].size = size;
+		args[i].runs = runs / threads;
+		args[i].mismatch = 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, writerThread, &args[i]);
+	for(i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+	for(i = 0; i < threads; i++)
+		if(args[i].mismatch)
+			fprintf(stdout, "    Data read by thread %u does not match data written\n", i);
+	fprintf(stdout, "    Appended %u bytes %u times in %.3f seconds (%.1f MB/s)\n\n",
+	        size, runs / threads * threads, secs,
+	        (double) size * (runs / threads * threads) / secs / (1024 * 1024));
+}
+
+void *writerThread(void *arg)
+{
+	ReaderArg *ra = arg;
+	char path[64];
+	u_int i;
+	u_int records = (FILE_SIZE_MAX - 1) / ra->size;
+
+	char *data = malloc(ra->size);
+	char *buf = malloc(ra->size);
+	for(i = 0; i < ra->size; i++)
+		data[i] = 'a' + (i + ra->id) % 26;
+
+	/* Each file is appended to one record at a time until it is full,
+	   then checked and deleted */
+	sprintf(path, "benchmark/writer%02u.txt", ra->id);
+	BC_FILE *file = openFile(ra->fs, path);
+	for(i = 0; i < ra->runs; i++)
+	{
+		writeFile(data, ra->size, file);
+		if((i + 1) % records == 0 || i + 1 == ra->runs)
+		{
+			rewindBC_File(file);
+			readFile(buf, ra->size, file);
+			if(memcmp(buf, data, ra->size) != 0)
+				ra->mismatch = 1;
+			deleteFile(file);
+			file = i + 1 < ra->runs ? openFile(ra->fs, path) : NULL;
+		}
+	}
+
+	free(data);
+	free(buf);
+
+	return NULL;
+}
+
+void testRun5()
+{
+	pause(PAUSE);
+
+	BC_FS *fs = initFileSystem("Drive3MB", "3MB_VDrive", DRIVE_MODE_STDIO, 64, CLUSTER_SIZE);
+
+	if(!fs)
+	{
+		fprintf(stderr, "Error opening drive. Exiting");
+		exit(1);
+	}
+
+	/* The directory is created first, so that the cluster it takes is
+	   not counted by the tests. The tests keep at most five files in 
+	   it, so it does not grow past its first cluster */
+	createDirectory(fs, "deletetest");
+
+	fprintf(stdout, "Deleting a file while it is open through another handle\n");
+	testDeleteWhileOpen(fs);
+	fprintf(stdout, "Deleting a file while 4 threads open, write and delete it\n");
+	testDeleteDuringOpen(fs, 4);
+
+	closeFileSystem(fs);
+
+	pause(PAUSE);
+}
+
+void testDeleteWhileOpen(BC_FS *fs)
+{
+	u_int size = 12000;
+	u_int i;
+	int failed = 0;
+
+	char *data = malloc(size);
+	char *other = malloc(size);
+	char *buf = malloc(size);
+	for(i = 0; i < size; i++)
+	{
+		data[i] = 'a' + i % 26;
+		other[i] = 'A' + i % 26;
+	}
+
+	u_int freeClusters = getFreeClusterCount(fs);
+
+	/* The file is deleted through one handle while the other writes it */
+	BC_FILE *file = openFile(fs, "deletetest/openfile.txt");
+	BC_FILE *deleter = openFile(fs, "deletetest/openfile.txt");
+	writeFile(data, size / 2, file);
+	deleteFile(deleter);
+	writeFile(data + size / 2, size - size / 2, file);
+
+	/* The name is free again, but the new file must not be given any of
+	   the clusters still held by the open handle */
+	BC_FILE *reused = openFile(fs, "deletetest/openfile.txt");
+	if(reused->startClusterAddr == file->startClusterAddr || reused->fileSize != 0)
+		failed = 1;
+	writeFile(other, size, reused);
+
+	if(readFileAt(file, 0, buf, size) != size || memcmp(buf, data, size) != 0)
+		failed = 1;
+	if(readFileAt(reused, 0, buf, size) != size || memcmp(buf, other, size) != 0)
+		failed = 1;
+
+	/* The clusters of the deleted file are freed when it is closed */
+	closeFile(file);
+	deleteFile(reused);
+	if(getFreeClusterCount(fs) != freeClusters)
+		failed = 1;
+
+	fprintf(stdout, "    %s\n\n", failed ? "Failed" : "Passed");
+
+	free(data);
+	free(other);
+	free(buf);
+}
+
+/* The work given to each thread by testDeleteDuringOpen() */
+typedef struct DeleterArg
+{
+	BC_FS *fs;
+	u_int id;
+	u_int runs;
+	int mismatch;
+} DeleterArg;
+
+void testDeleteDuringOpen(BC_FS *fs, u_int threads)
+{
+	u_int i;
+	int failed = 0;
+
+	pthread_t tids[16];
+	DeleterArg args[16];
+
+	u_int freeClusters = getFreeClusterCount(fs);
+
+	for(i = 0; i < threads; i++)
+	{
+		args[i].fs = fs;
+		args[i].id = i;
+		args[i].runs = 200;
+		args[i].mismatch = 0;
+	}
+
+	for(i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, deleterThread, &args[i]);
+	for(i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	for(i = 0; i < threads; i++)
+	{
+		if(args[i].mismatch)
+		{
+			fprintf(stdout, "    Data read by thread %u does not match data written\n", i);
+			failed = 1;
+		}
+	}
+
+	/* Every file has been deleted, so every cluster must be free again */
+	deleteFile(openFile(fs, "deletetest/sharedfile.txt"));
+	if(getFreeClusterCount(fs) != freeClusters)
+		failed = 1;
+
+	fprintf(stdout, "    %s\n\n", failed ? "Failed" : "Passed");
+}
+
+void *deleterThread(void *arg)
+{
+	DeleterArg *da = arg;
+	char path[64];
+	u_int size = 3000;
+	u_int i;
+
+	char *data = malloc(size);
+	char *buf = malloc(size);
+	for(i = 0; i < size; i++)
+		data[i] = 'a' + (i + da->id) % 26;
+
+	/* Each thread writes to a file shared by all of them, which the 
+	   threads delete while others have it open, and rewrites a file of
+	   its own. Clusters of the shared file given to the thread's own 
+	   file while still in use would be overwritten through the shared
+	   file's handles */
+	sprintf(path, "deletetest/private%02u.txt", da->id);
+	for(i = 0; i < da->runs; i++)
+	{
+		BC_FILE *shared = openFile(da->fs, "deletetest/sharedfile.txt");
+		BC_FILE *file = openFile(da->fs, path);
+		writeFileAt(shared, 0, data, size);
+		writeFile(data, size, file);
+		writeFileAt(shared, size, data, size);
+		if(readFileAt(file, 0, buf, size) != size || memcmp(buf, data, size) != 0)
+			da->mismatch = 1;
+		deleteFile(file);
+		if(i % 2)
+			deleteFile(shared);
+		else
+			closeFile(shared);
+	}
+
+	free(data);
+	free(buf);
+
+	return NULL;
+}
+
+void printBootClusterInfo(BC_FS *fs)
 {
 	fprintf(stdout, "\nBoot Cluster Info:\n\n");
 	fprintf(stdout, "    Parameter                   |        Value       \n");
 	fprintf(stdout, "  ===================================================\n");
-	fprintf(stdout, "    Initialized                 | %17u\n", bootRecord->init);
-	fprintf(stdout, "    Drive Label                 | %17s\n", bootRecord->label);
-	fprintf(stdout, "    Bytes Per Cluster           | %17u\n", bootRecord->bytesPerCluster);
-	fprintf(stdout, "    Number Of Reserved Clusters | %17u\n", bootRecord->reservedClusters);
-	fprintf(stdout, "    Number Of Clusters On Drive | %17u\n", bootRecord->clustersOnDrive);
-	fprintf(stdout, "    Number Of Clusters Per FAT  | %17u\n", bootRecord->clustersPerFat);
-	fprintf(stdout, "    First Cluster Of Root Dir   | %17u\n", bootRecord->rootDirStart);
-	fprintf(stdout, "    Number Of Free Clusters     | %17u\n", bootRecord->freeClusters);
-	fprintf(stdout, "    Next Free Cluster           | %17u\n", bootRecord->nextFreeCluster);
-	fprintf(stdout, "    Size Of Drive               | %17u\n", bootRecord->driveSize);
+	fprintf(stdout, "    Initialized                 | %17u\n", fs->bootRecord->init);
+	fprintf(stdout, "    Drive Label                 | %17s\n", fs->bootRecord->label);
+	fprintf(stdout, "    Bytes Per Cluster           | %17u\n", fs->bootRecord->bytesPerCluster);
+	fprintf(stdout, "    Number Of Reserved Clusters | %17u\n", fs->bootRecord->reservedClusters);
+	fprintf(stdout, "    Number Of Clusters On Drive | %17u\n", fs->bootRecord->clustersOnDrive);
+	fprintf(stdout, "    Number Of Clusters Per FAT  | %17u\n", fs->bootRecord->clustersPerFat);
+	fprintf(stdout, "    First Cluster Of Root Dir   | %17u\n", fs->bootRecord->rootDirStart);
+	fprintf(stdout, "    Number Of Free Clusters     | %17u\n", fs->bootRecord->freeClusters);
+	fprintf(stdout, "    Next Free Cluster           | %17u\n", fs->bootRecord->nextFreeCluster);
+	fprintf(stdout, "    Size Of Drive               | %17llu\n", (unsigned long long) fs->bootRecord->driveSize64);
 	fprintf(stdout, "  ===================================================\n\n");
 }
 
-void printDirectoryListing(char *dir)
+void printDirectoryListing(BC_FS *fs, char *dir)
 {
-	char *listing = getDirectoryListing(dir);
+	char *listing = getDirectoryListing(fs, dir);
 	fprintf(stdout, "'%s/' directory listing: \n\n%s\n", dir, listing);
 	free(listing);
 }